@@ -0,0 +1,491 @@
+#include <lipp/lipp.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+// Generates synthetic corpora and measures `include_file` + `read_all()` over them, with both
+// `basic_preprocessor` and the virtual `preprocessor`. Corpora are deterministic for a given scale, so
+// numbers are comparable between builds and releases. Results are printed as one JSON object,
+// progress goes to stderr.
+//
+//   bench [--scale N] [--iterations N] [--dir path] [--corpus name]
+
+using traits = lipp::preprocessor_traits<char, std::string, std::string_view, std::vector>;
+
+static std::atomic<size_t> g_allocations( 0 );
+static std::atomic<size_t> g_allocatedBytes( 0 );
+
+// Out of line, so that compilers do not pair the inlined `free` with `operator new` and warn
+[[gnu::noinline]] void *operator new( size_t size )
+{
+	g_allocations.fetch_add( 1, std::memory_order_relaxed );
+	g_allocatedBytes.fetch_add( size, std::memory_order_relaxed );
+
+	if ( void *p = malloc( size ? size : 1 ) )
+		return p;
+
+	throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete( void *p ) noexcept { free( p ); }
+
+[[gnu::noinline]] void operator delete( void *p, size_t ) noexcept { free( p ); }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Deterministic across platforms, unlike the standard distributions
+struct random_generator
+{
+	uint64_t state;
+
+	uint32_t next()
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		return uint32_t( state >> 33 );
+	}
+
+	uint32_t below( uint32_t n ) { return next() % n; }
+};
+
+struct corpus
+{
+	const char *name;
+	std::string mainFile;
+	size_t fileCount = 0;
+	size_t inputBytes = 0; // Of all files, each counted once
+};
+
+struct corpus_writer
+{
+	std::filesystem::path dir;
+	corpus &c;
+
+	bool write( const std::string &fileName, const std::string &text )
+	{
+		FILE *file = fopen( ( dir / fileName ).string().c_str(), "wb" );
+		if ( !file )
+			return false;
+
+		bool ok = fwrite( text.data(), 1, text.size(), file ) == text.size();
+		fclose( file );
+
+		c.fileCount++;
+		c.inputBytes += text.size();
+		return ok;
+	}
+};
+
+static void append_format( std::string &out, const char *format, ... );
+
+//---------------------------------------------------------------------------------------------------------------------
+// Layers of guarded headers, every header includes several from the layer below, so most includes
+// hit a file which was already included
+static bool generate_include_tree( corpus_writer &w, int scale )
+{
+	const int depth = 8, width = 16 * scale, fanout = 4;
+	random_generator rng = { 1 };
+
+	for ( int level = depth - 1; level >= 0; --level )
+	{
+		for ( int i = 0; i < width; ++i )
+		{
+			std::string text;
+			append_format( text, "#ifndef TREE_%d_%d_H\n#define TREE_%d_%d_H\n\n", level, i, level, i );
+
+			if ( level + 1 < depth )
+				for ( int k = 0; k < fanout; ++k )
+					append_format( text, "#include \"tree_%d_%d.h\"\n", level + 1, int( rng.below( width ) ) );
+
+			append_format( text, "\n#define TREE_%d_%d_SIZE %d\n\n", level, i, int( rng.below( 64 ) ) + 1 );
+
+			for ( int k = 0; k < 24; ++k )
+			{
+				append_format( text, "struct tree_%d_%d_%d\n{\n\tint values[TREE_%d_%d_SIZE];\n\tconst char *name;\n};\n\n",
+				               level, i, k, level, i );
+				append_format( text, "int tree_%d_%d_%d_get( const struct tree_%d_%d_%d *self, int index );\n\n",
+				               level, i, k, level, i, k );
+			}
+
+			text += "#endif\n";
+
+			char fileName[64];
+			snprintf( fileName, sizeof( fileName ), "tree_%d_%d.h", level, i );
+
+			if ( !w.write( fileName, text ) )
+				return false;
+		}
+	}
+
+	std::string text;
+	for ( int i = 0; i < width; ++i )
+		append_format( text, "#include \"tree_0_%d.h\"\n", i );
+
+	return w.write( w.c.mainFile, text );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Nested function-like macros, stringizing, pasting and variadic arguments on every line
+static bool generate_macro_heavy( corpus_writer &w, int scale )
+{
+	random_generator rng = { 2 };
+	std::string text =
+		"#define CAT_(a, b) a ## b\n"
+		"#define CAT(a, b) CAT_(a, b)\n"
+		"#define STR_(x) #x\n"
+		"#define STR(x) STR_(x)\n"
+		"#define ADD(a, b) ((a) + (b))\n"
+		"#define MUL(a, b) ((a) * (b))\n"
+		"#define SQR(x) MUL(x, x)\n"
+		"#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+		"#define CLAMP(x, lo, hi) MAX(lo, MIN(x, hi))\n"
+		"#define MIN(a, b) ((a) < (b) ? (a) : (b))\n"
+		"#define LOG(fmt, ...) log_message( __FILE__, STR(fmt), __VA_ARGS__ )\n"
+		"#define FIELD(type, name) type CAT(m_, name);\n"
+		"#define VERSION 42\n\n";
+
+	for ( int i = 0; i < 64; ++i )
+		append_format( text, "#define CONST_%d ADD(VERSION, %d)\n", i, i );
+
+	for ( int i = 0, S = 20000 * scale; i < S; ++i )
+	{
+		int a = int( rng.below( 64 ) ), b = int( rng.below( 64 ) );
+
+		switch ( rng.below( 4 ) )
+		{
+		case 0: append_format( text, "int CAT(value_, %d) = CLAMP(SQR(CONST_%d), CONST_%d, MUL(%d, VERSION));\n", i, a, b, b ); break;
+		case 1: append_format( text, "LOG(value %d is out of range, CONST_%d, SQR(%d));\n", i, a, b ); break;
+		case 2: append_format( text, "struct s%d { FIELD(int, x%d) FIELD(float, y%d) };\n", i, a, b ); break;
+		default: append_format( text, "const char *name%d = STR(CAT(item_, %d)) STR(MAX(CONST_%d, %d));\n", i, a, b, a ); break;
+		}
+	}
+
+	return w.write( w.c.mainFile, text );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Large blocks behind conditions which are false, nested, with the rare active line in between
+static bool generate_disabled_blocks( corpus_writer &w, int scale )
+{
+	random_generator rng = { 3 };
+	std::string text = "#define ENABLED 1\n\n";
+
+	for ( int block = 0, S = 400 * scale; block < S; ++block )
+	{
+		switch ( rng.below( 3 ) )
+		{
+		case 0: text += "#if 0\n"; break;
+		case 1: append_format( text, "#ifdef NOT_DEFINED_%d\n", block ); break;
+		default: append_format( text, "#if defined(NOT_DEFINED_%d) && ENABLED > %d\n", block, int( rng.below( 5 ) ) ); break;
+		}
+
+		for ( int line = 0, L = 100 + int( rng.below( 100 ) ); line < L; ++line )
+		{
+			if ( rng.below( 20 ) == 0 )
+			{
+				append_format( text, "#  if VARIANT_%d\n\t\"string with #if inside\", '\\'', /* comment */\n#  else\n", line );
+				text += "\tint alternative = 0; // #endif in a comment\n#  endif\n";
+			}
+			else
+				append_format( text, "\tstatic int disabled_%d_%d( int value ) { return value * %d + %d; }\n", block, line, line, block );
+		}
+
+		append_format( text, "#else\nint enabled_%d;\n#endif\n\n", block );
+	}
+
+	return w.write( w.c.mainFile, text );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Configuration checks, the same few `#if` conditions over and over with a line of code each
+static bool generate_conditions( corpus_writer &w, int scale )
+{
+	random_generator rng = { 5 };
+	std::string text = "#define PLATFORM 3\n#define VERSION 42\n#define HAS_THREADS 1\n#define IS_ENABLED(x) ( (x) != 0 )\n\n";
+
+	static const char *const conditions[] =
+	{
+		"PLATFORM == 3 && VERSION >= 40",
+		"defined(HAS_THREADS) && HAS_THREADS",
+		"IS_ENABLED(HAS_THREADS) || defined(FORCE_THREADS)",
+		"VERSION > 10 * PLATFORM + 5",
+		"!defined(NO_EXCEPTIONS) && (PLATFORM & 1)",
+		"UNDEFINED_OPTION || VERSION < 10",
+	};
+
+	for ( int i = 0, S = 20000 * scale; i < S; ++i )
+		append_format( text, "#if %s\nint taken_%d;\n#else\nint other_%d;\n#endif\n", conditions[rng.below( 6 )], i, i );
+
+	return w.write( w.c.mainFile, text );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Documentation comments which are much longer than the code between them
+static bool generate_comment_blocks( corpus_writer &w, int scale )
+{
+	random_generator rng = { 4 };
+	std::string text;
+
+	for ( int block = 0, S = 2000 * scale; block < S; ++block )
+	{
+		text += "/**\n";
+
+		for ( int line = 0, L = 10 + int( rng.below( 30 ) ); line < L; ++line )
+			append_format( text, " * Line %d of the description, with a path/like/this and a * b / c math %d.\n", line, block );
+
+		text += " */\n";
+
+		for ( int line = 0, L = int( rng.below( 6 ) ); line < L; ++line )
+			append_format( text, "// Note %d: \"quoted\" text and 'chars' are not strings in comments\n", line );
+
+		append_format( text, "int documented_%d( int a, int b ); /* trailing */ // and more\n\n", block );
+	}
+
+	return w.write( w.c.mainFile, text );
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+static void append_format( std::string &out, const char *format, ... )
+{
+	char buff[1024];
+
+	va_list args;
+	va_start( args, format );
+	int length = vsnprintf( buff, sizeof( buff ), format, args );
+	va_end( args );
+
+	if ( length > 0 )
+		out.append( buff, std::min( size_t( length ), sizeof( buff ) - 1 ) );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Peak resident set size in kilobytes, restarted where the platform allows it so that every corpus
+// reports its own peak. Elsewhere the value is the peak of the whole process so far.
+static void reset_peak_rss()
+{
+#if defined(__linux__)
+	if ( FILE *file = fopen( "/proc/self/clear_refs", "w" ) )
+	{
+		fputs( "5", file );
+		fclose( file );
+	}
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+static size_t peak_rss_kb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters = { };
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+		return size_t( counters.PeakWorkingSetSize / 1024 );
+
+	return 0;
+#else
+	#if defined(__linux__)
+	if ( FILE *file = fopen( "/proc/self/status", "r" ) )
+	{
+		char line[256];
+		size_t result = 0;
+
+		while ( fgets( line, sizeof( line ), file ) )
+			if ( strncmp( line, "VmHWM:", 6 ) == 0 )
+				result = size_t( strtoull( line + 6, nullptr, 10 ) );
+
+		fclose( file );
+
+		if ( result )
+			return result;
+	}
+	#endif
+
+	struct rusage usage = { };
+	getrusage( RUSAGE_SELF, &usage );
+
+	#if defined(__APPLE__)
+	return size_t( usage.ru_maxrss / 1024 ); // Bytes there
+	#else
+	return size_t( usage.ru_maxrss );
+	#endif
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct result
+{
+	size_t outputBytes = 0;
+	size_t tokens = 0;
+	size_t allocations = 0;
+	size_t allocatedBytes = 0;
+	size_t peakRssKb = 0;
+	const char *preprocessor = "";
+	std::vector<double> seconds;
+	lipp::error_type error = lipp::error_type::none;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Every iteration starts from a new preprocessor, so file reading and the include cache are measured too
+template <class P>
+static result run_corpus( const corpus &c, const std::filesystem::path &dir, int iterations, const char *name )
+{
+	result r;
+	r.preprocessor = name;
+	std::string mainFile = ( dir / c.mainFile ).generic_string();
+
+	reset_peak_rss();
+	size_t allocationsBefore = g_allocations.load(), bytesBefore = g_allocatedBytes.load();
+
+	for ( int i = 0; i < iterations; ++i )
+	{
+		size_t outputBytes = 0, tokens = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		{
+			P pp;
+
+			if ( !pp.include_file( mainFile ) || !pp.read_all( [&]( std::string_view whitespace, std::string_view text )
+			     {
+			         outputBytes += whitespace.size() + text.size();
+			         tokens++;
+			     } ) )
+			{
+				r.error = pp.error() != lipp::error_type::none ? pp.error() : lipp::error_type::read_failed;
+				return r;
+			}
+		}
+
+		r.seconds.push_back( std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+		r.outputBytes = outputBytes;
+		r.tokens = tokens;
+	}
+
+	r.allocations = ( g_allocations.load() - allocationsBefore ) / size_t( iterations );
+	r.allocatedBytes = ( g_allocatedBytes.load() - bytesBefore ) / size_t( iterations );
+	r.peakRssKb = peak_rss_kb();
+	return r;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+int main( int argc, char **argv )
+{
+	int scale = 1, iterations = 5;
+	std::filesystem::path dir = "bench-corpus";
+	const char *only = nullptr;
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		std::string_view arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		/**/ if ( arg == "--scale" && value ) scale = std::max( atoi( argv[++i] ), 1 );
+		else if ( arg == "--iterations" && value ) iterations = std::max( atoi( argv[++i] ), 1 );
+		else if ( arg == "--dir" && value ) dir = argv[++i];
+		else if ( arg == "--corpus" && value ) only = argv[++i];
+		else
+		{
+			fprintf( stderr, "usage: bench [--scale N] [--iterations N] [--dir path] [--corpus name]\n" );
+			return 2;
+		}
+	}
+
+	struct generator
+	{
+		const char *name;
+		bool ( *generate )( corpus_writer &, int );
+	};
+
+	const generator generators[] =
+	{
+		{ "include_tree", generate_include_tree },
+		{ "macro_heavy", generate_macro_heavy },
+		{ "disabled_blocks", generate_disabled_blocks },
+		{ "conditions", generate_conditions },
+		{ "comment_blocks", generate_comment_blocks },
+	};
+
+	printf( "{\n\t\"format\": \"lipp-bench\",\n\t\"version\": 1,\n\t\"scale\": %d,\n\t\"iterations\": %d,\n\t\"corpora\": [", scale, iterations );
+
+	bool first = true, failed = false;
+
+	for ( const auto &g : generators )
+	{
+		if ( only && strcmp( only, g.name ) != 0 )
+			continue;
+
+		corpus c;
+		c.name = g.name;
+		c.mainFile = std::string( g.name ) + ".c";
+
+		std::error_code ec;
+		auto corpusDir = dir / g.name;
+		std::filesystem::remove_all( corpusDir, ec );
+		std::filesystem::create_directories( corpusDir, ec );
+
+		corpus_writer w = { corpusDir, c };
+		if ( !g.generate( w, scale ) )
+		{
+			fprintf( stderr, "%s: cannot write corpus to %s\n", g.name, corpusDir.string().c_str() );
+			failed = true;
+			continue;
+		}
+
+		fprintf( stderr, "%s: %zu files, %zu bytes\n", g.name, c.fileCount, c.inputBytes );
+
+		const result results[] =
+		{
+			run_corpus<lipp::basic_preprocessor<traits>>( c, corpusDir, iterations, "basic" ),
+			run_corpus<lipp::preprocessor<traits>>( c, corpusDir, iterations, "virtual" ),
+		};
+
+		for ( result r : results )
+		{
+			if ( r.error != lipp::error_type::none )
+			{
+				fprintf( stderr, "%s: %s\n", g.name, lipp::to_string( r.error ) );
+				failed = true;
+				continue;
+			}
+
+			std::sort( r.seconds.begin(), r.seconds.end() );
+			double best = std::max( r.seconds.front(), 1e-9 ), median = r.seconds[r.seconds.size() / 2];
+
+			printf( "%s\n\t\t{\n", first ? "" : "," );
+			printf( "\t\t\t\"name\": \"%s\",\n", c.name );
+			printf( "\t\t\t\"preprocessor\": \"%s\",\n", r.preprocessor );
+			printf( "\t\t\t\"files\": %zu,\n", c.fileCount );
+			printf( "\t\t\t\"input_bytes\": %zu,\n", c.inputBytes );
+			printf( "\t\t\t\"output_bytes\": %zu,\n", r.outputBytes );
+			printf( "\t\t\t\"tokens\": %zu,\n", r.tokens );
+			printf( "\t\t\t\"seconds_min\": %.6f,\n", best );
+			printf( "\t\t\t\"seconds_median\": %.6f,\n", median );
+			printf( "\t\t\t\"mb_per_s\": %.2f,\n", double( c.inputBytes ) / ( 1024.0 * 1024.0 ) / best );
+			printf( "\t\t\t\"tokens_per_s\": %.0f,\n", double( r.tokens ) / best );
+			printf( "\t\t\t\"allocations_per_run\": %zu,\n", r.allocations );
+			printf( "\t\t\t\"allocated_bytes_per_run\": %zu,\n", r.allocatedBytes );
+			printf( "\t\t\t\"peak_rss_kb\": %zu\n", r.peakRssKb );
+			printf( "\t\t}" );
+
+			first = false;
+		}
+	}
+
+	printf( "\n\t]\n}\n" );
+	return failed ? 1 : 0;
+}
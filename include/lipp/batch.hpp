@@ -0,0 +1,209 @@
+#pragma once
+
+#include <lipp/lipp.hpp>
+
+#if defined(LIPP_DO_NOT_USE_STL)
+	#error "lipp/batch.hpp needs the standard library for threads"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace lipp {
+
+// Preprocesses many inputs on a pool of worker threads. Every worker owns one preprocessor, which
+// starts each input from a shared read only snapshot of the predefined macros (copied only when the
+// input defines or undefines something), and all workers share one include cache. Inputs are split
+// into one range per worker, a worker that runs out of work steals half of the range of another one.
+template <class Preprocessor>
+class batch_preprocessor
+{
+public:
+	using preprocessor_t = Preprocessor;
+	using traits_t = typename preprocessor_t::traits_t;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	using include_cache_t = typename preprocessor_t::include_cache_t;
+
+	// Zero uses one thread per hardware thread
+	explicit batch_preprocessor( size_t threadCount = 0 ) LIPP_NOEXCEPT
+		: _threadCount( threadCount ? threadCount : ( std::max )( size_t( std::thread::hardware_concurrency() ), size_t( 1 ) ) ) { }
+
+	// Predefined macros, must not change during `run`
+	bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT { return _prelude.define( name, value ); }
+
+	bool define( string_view_t name ) LIPP_NOEXCEPT { return _prelude.define( name ); }
+
+	bool undef( string_view_t name ) LIPP_NOEXCEPT { return _prelude.undef( name ); }
+
+	// See `preprocessor::add_include_directory`, every worker searches the same directories
+	void add_include_directory( string_view_t directory, bool isSystem = false ) LIPP_NOEXCEPT
+	{
+		push_back( _includeDirectories, include_directory{ string_t( directory ), isSystem } );
+	}
+
+	// Kept across runs, so files included by several inputs are read once
+	include_cache_t &get_include_cache() LIPP_NOEXCEPT { return _cache; }
+
+	size_t thread_count() const LIPP_NOEXCEPT { return _threadCount; }
+
+	// See `preprocessor::set_token_replay`, tokens are recorded into the shared cache
+	void set_token_replay( bool enable ) LIPP_NOEXCEPT { _tokenReplay = enable; }
+
+	// Includes every input file and calls `process( index, preprocessor )` on the worker thread, which is
+	// expected to consume the tokens, for example with `read_all( sink )`. It is called also when the input
+	// could not be read, `preprocessor.error()` then tells. Returns number of inputs that failed, either
+	// with an error or by `process` returning false.
+	template <class Process>
+	size_t run( const vector_t<string_t> &inputs, Process &&process ) LIPP_NOEXCEPT;
+
+	// Collects whole outputs, `errors` gets `error_type::none` for inputs that succeeded
+	size_t run( const vector_t<string_t> &inputs, vector_t<string_t> &outputs, vector_t<error_type> &errors ) LIPP_NOEXCEPT;
+
+protected:
+	struct work_queue
+	{
+		std::mutex mutex;
+		size_t begin = 0;
+		size_t end = 0;
+	};
+
+	struct include_directory
+	{
+		string_t path;
+		bool isSystem;
+	};
+
+	static bool take( work_queue &queue, size_t &index ) LIPP_NOEXCEPT;
+
+	static bool steal( std::vector<work_queue> &queues, size_t thief, size_t &index ) LIPP_NOEXCEPT;
+
+	preprocessor_t _prelude;
+
+	include_cache_t _cache;
+
+	vector_t<include_directory> _includeDirectories;
+
+	size_t _threadCount;
+
+	bool _tokenReplay = false;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> template <class Process>
+inline size_t batch_preprocessor<P>::run( const vector_t<string_t> &inputs, Process &&process ) LIPP_NOEXCEPT
+{
+	size_t inputCount = lipp::size( inputs );
+	size_t threadCount = ( std::min )( _threadCount, ( std::max )( inputCount, size_t( 1 ) ) );
+
+	std::vector<work_queue> queues( threadCount );
+	for ( size_t i = 0; i < threadCount; ++i )
+	{
+		queues[i].begin = inputCount * i / threadCount;
+		queues[i].end = inputCount * ( i + 1 ) / threadCount;
+	}
+
+	std::atomic<size_t> failed( 0 );
+
+	auto work = [&]( size_t self )
+	{
+		preprocessor_t pp;
+		pp.set_include_cache( &_cache );
+		pp.set_token_replay( _tokenReplay );
+
+		for ( const auto &d : _includeDirectories )
+			pp.add_include_directory( d.path, d.isSystem );
+
+		size_t index = 0;
+		while ( take( queues[self], index ) || steal( queues, self, index ) )
+		{
+			pp.reset();
+			pp.share_macros( _prelude.macros() );
+
+			bool included = pp.include_file( inputs[index] );
+
+			if ( !process( index, pp ) || !included || pp.error() != error_type::none )
+				failed.fetch_add( 1, std::memory_order_relaxed );
+		}
+	};
+
+	// Calling thread is one of the workers
+	std::vector<std::thread> threads;
+	for ( size_t i = 1; i < threadCount; ++i )
+		threads.emplace_back( work, i );
+
+	work( 0 );
+
+	for ( auto &t : threads )
+		t.join();
+
+	return failed.load();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline size_t batch_preprocessor<P>::run( const vector_t<string_t> &inputs,
+                                                             vector_t<string_t> &outputs,
+                                                             vector_t<error_type> &errors ) LIPP_NOEXCEPT
+{
+	lipp::clear( outputs );
+	lipp::clear( errors );
+	resize( outputs, lipp::size( inputs ) );
+	resize( errors, lipp::size( inputs ) );
+
+	// Every worker writes different elements
+	return run( inputs, [&outputs, &errors]( size_t index, preprocessor_t &pp )
+	{
+		outputs[index] = pp.read_all();
+		errors[index] = pp.error();
+		return pp.error() == error_type::none;
+	} );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool batch_preprocessor<P>::take( work_queue &queue, size_t &index ) LIPP_NOEXCEPT
+{
+	std::lock_guard<std::mutex> lock( queue.mutex );
+
+	if ( queue.begin == queue.end )
+		return false;
+
+	index = queue.begin++;
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool batch_preprocessor<P>::steal( std::vector<work_queue> &queues, size_t thief, size_t &index ) LIPP_NOEXCEPT
+{
+	for ( size_t i = 1, S = queues.size(); i < S; ++i )
+	{
+		auto &victim = queues[( thief + i ) % S];
+		size_t begin = 0, end = 0;
+
+		{
+			std::lock_guard<std::mutex> lock( victim.mutex );
+
+			if ( victim.begin == victim.end )
+				continue;
+
+			// Upper half, victim keeps the lower one it is working through
+			begin = victim.begin + ( victim.end - victim.begin ) / 2;
+			end = victim.end;
+			victim.end = begin;
+		}
+
+		index = begin;
+
+		std::lock_guard<std::mutex> lock( queues[thief].mutex );
+		queues[thief].begin = begin + 1;
+		queues[thief].end = end;
+		return true;
+	}
+
+	return false;
+}
+
+} // namespace lipp
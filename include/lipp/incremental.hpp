@@ -0,0 +1,372 @@
+#pragma once
+
+#include <lipp/lipp.hpp>
+
+namespace lipp {
+
+// Preprocesses one text again after every edit, like an editor does on each keystroke. State of the preprocessor
+// is saved every few lines, at ends of lines of the text outside of includes and macros (see
+// `preprocessor::checkpoint_offset`), together with the length of the output up to there. An edit resumes
+// from the last checkpoint in front of it and stops at the first checkpoint behind it where the state is the
+// same as in the previous run, the rest of the previous output is reused. Included files are expected not to
+// change between runs, they are kept in the include cache of the preprocessor.
+template <class Preprocessor>
+class incremental_preprocessor
+{
+public:
+	using preprocessor_t = Preprocessor;
+	using traits_t = typename preprocessor_t::traits_t;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	using checkpoint_t = typename preprocessor_t::checkpoint;
+	using token_t = typename preprocessor_t::token;
+
+	// Checkpoints are at least `spacing` characters apart, fewer of them take less memory but an edit
+	// preprocesses more text again
+	explicit incremental_preprocessor( size_t spacing = 2048 ) LIPP_NOEXCEPT : _spacing( spacing ) { }
+
+	// Predefined macros, the next `set_text` or `edit` then preprocesses the whole text
+	bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT { _stale = true; return _prelude.define( name, value ); }
+
+	bool define( string_view_t name ) LIPP_NOEXCEPT { _stale = true; return _prelude.define( name ); }
+
+	bool undef( string_view_t name ) LIPP_NOEXCEPT { _stale = true; return _prelude.undef( name ); }
+
+	// For include directories and such, it is reset by every run
+	preprocessor_t &get_preprocessor() LIPP_NOEXCEPT { return _pp; }
+
+	// Preprocesses the whole text, false on error
+	bool set_text( string_view_t text, string_view_t sourceName = string_view_t() ) LIPP_NOEXCEPT;
+
+	// Replaces `length` characters at `offset` with `text`, false on error or when the range is outside of the text
+	bool edit( size_t offset, size_t length, string_view_t text ) LIPP_NOEXCEPT;
+
+	string_view_t text() const LIPP_NOEXCEPT { return _text; }
+
+	string_view_t output() const LIPP_NOEXCEPT { return _output; }
+
+	// Of the whole text, also when the part of the output it comes from was reused
+	error_type error() const LIPP_NOEXCEPT { return _error; }
+
+	// Characters of the text preprocessed by the last `set_text` or `edit`
+	size_t reprocessed() const LIPP_NOEXCEPT { return _reprocessed; }
+
+protected:
+	struct saved_checkpoint
+	{
+		checkpoint_t state;
+		size_t output;     // Length of the output in front of the checkpoint
+		size_t lineTokens; // Number of `_lineTokens` in front of the checkpoint
+	};
+
+	// `#line N "name"` in the output, numbers of those naming the text follow its lines
+	struct line_token
+	{
+		size_t offset;
+		size_t length;
+	};
+
+	// Text from `resume`, or all of it with `SIZE_MAX`. Checkpoints at or behind `editEnd` are compared with
+	// `old` ones `delta` characters closer to the start.
+	bool run( size_t resume, size_t editEnd, ptrdiff_t delta ) LIPP_NOEXCEPT;
+
+	// Appends the previous output from `old[index]` on and takes over the checkpoints behind it
+	void reuse( size_t index, const checkpoint_t &current, ptrdiff_t delta ) LIPP_NOEXCEPT;
+
+	// Copies a line token of the previous output, number shifted by `lineDelta` when it names `sourceName`
+	void append_line_token( const line_token &t, int lineDelta, string_view_t sourceName ) LIPP_NOEXCEPT;
+
+	static bool has_line_directive( string_view_t text ) LIPP_NOEXCEPT;
+
+	void move_checkpoint( saved_checkpoint &from ) LIPP_NOEXCEPT
+	{
+		resize( _checkpoints, lipp::size( _checkpoints ) + 1 );
+		_checkpoints[lipp::size( _checkpoints ) - 1] = static_cast<saved_checkpoint &&>( from );
+	}
+
+	preprocessor_t _prelude;
+
+	preprocessor_t _pp;
+
+	string_t _text = string_t();
+
+	string_t _sourceName = string_t();
+
+	string_t _output = string_t();
+
+	vector_t<line_token> _lineTokens;
+
+	vector_t<saved_checkpoint> _checkpoints;
+
+	// Previous run, while the next one is compared with it
+	string_t _oldOutput = string_t();
+
+	vector_t<line_token> _oldLineTokens;
+
+	vector_t<saved_checkpoint> _old;
+
+	error_type _oldError = error_type::none;
+
+	error_type _error = error_type::none;
+
+	size_t _spacing;
+
+	size_t _reprocessed = 0;
+
+	bool _stale = false;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool incremental_preprocessor<P>::set_text( string_view_t text, string_view_t sourceName ) LIPP_NOEXCEPT
+{
+	_text = string_t( text );
+	_sourceName = string_t( sourceName );
+	_stale = false;
+
+	clear( _checkpoints );
+	return run( SIZE_MAX, SIZE_MAX, 0 );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool incremental_preprocessor<P>::edit( size_t offset, size_t length, string_view_t text ) LIPP_NOEXCEPT
+{
+	if ( offset > lipp::size( _text ) || length > lipp::size( _text ) - offset )
+		return false;
+
+	string_t edited = string_t( substr( string_view_t( _text ), 0, offset ) );
+	edited += text;
+	edited += substr( string_view_t( _text ), offset + length );
+	_text = static_cast<string_t &&>( edited );
+
+	if ( _stale )
+	{
+		_stale = false;
+		clear( _checkpoints );
+		return run( SIZE_MAX, SIZE_MAX, 0 );
+	}
+
+	// Lexing the token in front of a checkpoint looked at the character at it, so that must not be edited
+	size_t resume = lipp::size( _checkpoints );
+	while ( resume > 0 && _checkpoints[resume - 1].state.offset >= offset )
+		--resume;
+
+	return run( resume ? resume - 1 : SIZE_MAX, offset + lipp::size( text ), ptrdiff_t( lipp::size( text ) ) - ptrdiff_t( length ) );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool incremental_preprocessor<P>::run( size_t resume, size_t editEnd, ptrdiff_t delta ) LIPP_NOEXCEPT
+{
+	_old = static_cast<vector_t<saved_checkpoint> &&>( _checkpoints );
+	_oldOutput = static_cast<string_t &&>( _output );
+	_oldLineTokens = static_cast<vector_t<line_token> &&>( _lineTokens );
+	_oldError = _error;
+
+	clear( _checkpoints );
+	clear( _lineTokens );
+	_output = string_t();
+
+	size_t start = 0;
+
+	if ( resume != SIZE_MAX )
+	{
+		const auto &from = _old[resume];
+		start = from.state.offset;
+
+		_output = string_t( substr( string_view_t( _oldOutput ), 0, from.output ) );
+
+		for ( size_t i = 0; i < from.lineTokens; ++i )
+			push_back( _lineTokens, _oldLineTokens[i] );
+
+		_pp.resume( _text, from.state );
+
+		for ( size_t i = 0; i <= resume; ++i )
+			move_checkpoint( _old[i] );
+	}
+	else
+	{
+		_pp.reset();
+		_pp.share_macros( _prelude.macros() );
+		_pp.include_string( _text, _sourceName );
+	}
+
+	size_t saved = start;
+	token_t t;
+
+	while ( _pp.next_token( t ) )
+	{
+		_output += t.whitespace;
+
+		if ( lipp::size( t.text ) > 5 && substr( t.text, 0, 5 ) == string_view_t( "#line" ) )
+			push_back( _lineTokens, line_token{ lipp::size( _output ), lipp::size( t.text ) } );
+
+		_output += t.text;
+
+		size_t at = _pp.checkpoint_offset();
+		if ( at == SIZE_MAX )
+			continue;
+
+		// Looking for arguments of a function-like macro may have read past the end of the line
+		if ( t.type == token_type::identifier )
+		{
+			if ( const auto *m = _pp.macros().find( t.text ); m && ( m->flags & macro_flags::function_like ) )
+				continue;
+		}
+
+		// Text from here on is the same as behind an old checkpoint, and so is the output if the state is too
+		if ( at >= editEnd )
+		{
+			size_t oldAt = size_t( ptrdiff_t( at ) - delta );
+			size_t lo = resume != SIZE_MAX ? resume + 1 : 0, hi = lipp::size( _old );
+
+			while ( lo < hi )
+			{
+				size_t mid = ( lo + hi ) / 2;
+
+				if ( _old[mid].state.offset < oldAt )
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if ( lo < lipp::size( _old ) && _old[lo].state.offset == oldAt && _pp.same_state( _old[lo].state ) )
+			{
+				// Output names lines, those behind a `#line` directive of the text do not move with the edit
+				int lineDelta = _pp.current_line_number() - _old[lo].state.lineNumber;
+
+				if ( !lineDelta || !has_line_directive( substr( string_view_t( _text ), at ) ) )
+				{
+					checkpoint_t current;
+					_pp.save_checkpoint( current );
+
+					_reprocessed = at - start;
+					reuse( lo, current, delta );
+					return _error == error_type::none;
+				}
+			}
+		}
+
+		if ( at >= saved + _spacing )
+		{
+			resize( _checkpoints, lipp::size( _checkpoints ) + 1 );
+			auto &c = _checkpoints[lipp::size( _checkpoints ) - 1];
+			_pp.save_checkpoint( c.state );
+			c.output = lipp::size( _output );
+			c.lineTokens = lipp::size( _lineTokens );
+			saved = at;
+		}
+	}
+
+	_reprocessed = lipp::size( _text ) - start;
+	_error = _pp.error();
+
+	clear( _old );
+	_oldOutput = string_t();
+	clear( _oldLineTokens );
+
+	return _error == error_type::none;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline void incremental_preprocessor<P>::reuse( size_t index, const checkpoint_t &current, ptrdiff_t delta ) LIPP_NOEXCEPT
+{
+	int lineDelta = current.lineNumber - _old[index].state.lineNumber;
+	string_view_t oldOutput = _oldOutput;
+	size_t copied = _old[index].output;
+	size_t lineToken = _old[index].lineTokens;
+
+	auto copyUpTo = [&]( size_t end )
+	{
+		for ( ; lineToken < lipp::size( _oldLineTokens ) && _oldLineTokens[lineToken].offset < end; ++lineToken )
+		{
+			const auto &t = _oldLineTokens[lineToken];
+			_output += substr( oldOutput, copied, t.offset - copied );
+			append_line_token( t, lineDelta, current.sourceName );
+			copied = t.offset + t.length;
+		}
+
+		_output += substr( oldOutput, copied, end - copied );
+		copied = end;
+	};
+
+	for ( size_t i = index, S = lipp::size( _old ); i < S; ++i )
+	{
+		auto &c = _old[i];
+		copyUpTo( c.output );
+
+		if ( i == index )
+			c.state = current;
+		else
+		{
+			c.state.offset = size_t( ptrdiff_t( c.state.offset ) + delta );
+			c.state.lineNumber += lineDelta;
+
+			// Blocks still open from the first reused checkpoint were opened where the current run says
+			for ( size_t b = 0, B = lipp::size( c.state.conditions ); b < B; ++b )
+				c.state.conditions[b].line = b < lipp::size( current.conditions ) ? current.conditions[b].line : c.state.conditions[b].line + lineDelta;
+		}
+
+		c.output = lipp::size( _output );
+		c.lineTokens = lipp::size( _lineTokens );
+		move_checkpoint( c );
+	}
+
+	copyUpTo( lipp::size( oldOutput ) );
+	_error = _oldError;
+
+	clear( _old );
+	_oldOutput = string_t();
+	clear( _oldLineTokens );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline void incremental_preprocessor<P>::append_line_token( const line_token &t, int lineDelta,
+                                                                             string_view_t sourceName ) LIPP_NOEXCEPT
+{
+	// "#line N \"name\""
+	auto text = substr( string_view_t( _oldOutput ), t.offset, t.length );
+	size_t numberEnd = 6;
+	while ( numberEnd < lipp::size( text ) && text[numberEnd] >= '0' && text[numberEnd] <= '9' )
+		++numberEnd;
+
+	auto name = numberEnd < lipp::size( text ) ? substr( text, numberEnd + 1 ) : string_view_t();
+	bool shift = lineDelta && lipp::size( name ) == lipp::size( sourceName ) + 2 && substr( name, 1, lipp::size( sourceName ) ) == sourceName;
+
+	push_back( _lineTokens, line_token{ lipp::size( _output ), t.length } );
+
+	if ( !shift )
+	{
+		_output += text;
+		return;
+	}
+
+	char_t buff[32] = { };
+	LIPP_SPRINTF( buff, "#line %d", to_int( substr( text, 6, numberEnd - 6 ) ) + lineDelta );
+
+	_output += buff;
+	_output += substr( text, numberEnd );
+	_lineTokens[lipp::size( _lineTokens ) - 1].length = lipp::size( _output ) - _lineTokens[lipp::size( _lineTokens ) - 1].offset;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool incremental_preprocessor<P>::has_line_directive( string_view_t text ) LIPP_NOEXCEPT
+{
+	// Any '#' followed by "line", also in comments, which only costs reusing less
+	for ( size_t i = 0, S = lipp::size( text ); i < S; ++i )
+	{
+		if ( text[i] != '#' )
+			continue;
+
+		size_t j = i + 1;
+		while ( j < S && ( text[j] == ' ' || text[j] == '\t' ) )
+			++j;
+
+		if ( substr( text, j, 4 ) == string_view_t( "line" ) )
+			return true;
+	}
+
+	return false;
+}
+
+} // namespace lipp
@@ -1,6 +1,21 @@
 #pragma once
 
 #include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+#if !defined(LIPP_DO_NOT_USE_MMAP) && ( defined(__unix__) || defined(__APPLE__) )
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#define LIPP_MMAP
+#endif
 
 #if !defined(LIPP_NOEXCEPT)
 	#define LIPP_NOEXCEPT noexcept
@@ -14,10 +29,32 @@
 	#endif
 #endif
 
+#if !defined(LIPP_DO_NOT_USE_SIMD)
+	#if defined(__AVX2__)
+		#include <immintrin.h>
+		#define LIPP_AVX2
+	#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+		#include <emmintrin.h>
+		#define LIPP_SSE2
+	#endif
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+#if defined(LIPP_STATISTICS)
+	#if defined(LIPP_DO_NOT_USE_STL)
+		#error "LIPP_STATISTICS needs the standard library for timing"
+	#endif
+
+	#include <chrono>
+#endif
+
 #if !defined(LIPP_DO_NOT_USE_STL)
 #include <string>
 #include <vector>
-#include <fstream>
+#include <mutex>
 
 namespace lipp {
 
@@ -34,6 +71,15 @@ template <class T, class A>
 void swap_erase_at( std::vector<T, A> &vec, size_t index ) LIPP_NOEXCEPT
 { vec[index] = std::move( vec[vec.size() - 1] ); pop_back( vec ); }
 
+template <class T, class A>
+void resize( std::vector<T, A> &vec, size_t length ) LIPP_NOEXCEPT { vec.resize( length ); }
+
+template <class C, class T, class A>
+void clear( std::basic_string<C, T, A> &str ) LIPP_NOEXCEPT { str.clear(); }
+
+template <class C, class T, class A>
+void resize( std::basic_string<C, T, A> &str, size_t length ) LIPP_NOEXCEPT { str.resize( length ); }
+
 } // namespace lipp
 #endif
 
@@ -67,8 +113,19 @@ enum class token_type
 	not_equal,
 	logical_and,
 	logical_or,
+	bit_and,
+	bit_or,
+	bit_xor,
+	bit_not,
+	shift_left,
+	shift_right,
+	question,
+	colon,
 	assign,
 	semicolon,
+	comma,
+	ellipsis,
+	hash_hash,
 };
 
 enum class error_type
@@ -86,15 +143,16 @@ enum class error_type
 	invalid_expression,
 	division_by_zero,
 	error_directive,
+	invalid_macro_arguments,
 };
 
 inline const char *to_string( error_type e ) LIPP_NOEXCEPT
 {
-	static constexpr char *errorStrings[] =
+	static constexpr const char *errorStrings[] =
 	{
 		"none", "unexpected_eof", "syntax_error", "invalid_string", "invalid_path", "expected_identifier",
 		"mismatch_if", "include_error", "read_failed", "expression_too_complex", "invalid_expression",
-		"division_by_zero", "error_directive",
+		"division_by_zero", "error_directive", "invalid_macro_arguments",
 	};
 
 	return errorStrings[size_t( e )];
@@ -106,11 +164,21 @@ struct parsing_flags
 	{
 		stop_at_eols     = 0b0'0000'0001,
 		expand_macros    = 0b0'0000'0010,
+		no_directives    = 0b0'0000'0100, // Return '#' as a token instead of processing a directive
+		defer_values     = 0b0'0000'1000, // Leave undefined names and macros defined to an integer unexpanded
 
 		default_parsing_flags = expand_macros
 	};
 };
 
+// What `next_token` keeps besides the tokens themselves
+enum class output_mode
+{
+	full = 0,       // Whitespace and comments in front of tokens as in the source, directives echoed
+	minified,       // No comments or directives, whitespace only where neighbouring tokens would merge
+	minified_lines, // Like `minified`, but tokens go to the line they come from unless the output is already past it
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 inline size_t size( const char *str ) LIPP_NOEXCEPT { return str ? strlen( str ) : 0; }
@@ -140,693 +208,5025 @@ template <class T>
 inline auto remove_first_and_last( const T &str ) LIPP_NOEXCEPT
 { return substr( str, 1, lipp::size( str ) - 2 ); }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-template <class Char, class String, class StringView, template <class> class Vector>
-struct preprocessor_traits
-{
-	using char_t = Char;
-	using string_t = String;
-	using string_view_t = StringView;
-	template <typename T> using vector_t = Vector<T>;
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+// Unlike `atoi` it never reads past the end, source text does not have to be null terminated
 template <class T>
-class preprocessor
+inline int to_int( const T &str ) LIPP_NOEXCEPT
 {
-public:
-	using traits_t = T;
-	using char_t = typename traits_t::char_t;
-	using string_t = typename traits_t::string_t;
-	using string_view_t = typename traits_t::string_view_t;
-	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	unsigned result = 0;
 
-	preprocessor() = default;
+	for ( size_t i = 0, S = lipp::size( str ); i < S && str[i] >= '0' && str[i] <= '9'; ++i )
+		result = result * 10u + unsigned( str[i] - '0' );
 
-	virtual ~preprocessor() = default;
+	return int( result );
+}
 
-	virtual bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT;
+// Decimal, octal or hex integer with optional `u` and `l` suffixes. Values too large for `intmax_t`
+// are unsigned, like in C. False for anything else, including floating point numbers and overflow.
+template <class T>
+inline bool parse_integer_literal( const T &str, uintmax_t &value, bool &isUnsigned ) LIPP_NOEXCEPT
+{
+	size_t length = lipp::size( str );
+	size_t i = 0;
+	unsigned base = 10;
 
-	bool define( string_view_t name ) LIPP_NOEXCEPT { return define( name, "" ); }
+	if ( length > 2 && str[0] == '0' && ( str[1] == 'x' || str[1] == 'X' ) )
+	{
+		base = 16;
+		i = 2;
+	}
+	else if ( length > 1 && str[0] == '0' )
+		base = 8;
 
-	virtual bool undef( string_view_t name ) LIPP_NOEXCEPT;
+	size_t digitsStart = i;
+	value = 0;
 
-	virtual const char_t *find_macro( string_view_t name ) const LIPP_NOEXCEPT;
+	for ( ; i < length; ++i )
+	{
+		auto ch = str[i];
+		unsigned digit = ( ch >= '0' && ch <= '9' ) ? unsigned( ch - '0' ) :
+		                 ( ch >= 'a' && ch <= 'f' ) ? unsigned( ch - 'a' + 10 ) :
+		                 ( ch >= 'A' && ch <= 'F' ) ? unsigned( ch - 'A' + 10 ) : 16;
 
-	virtual void reset() LIPP_NOEXCEPT;
+		if ( digit >= base )
+			break;
 
-	virtual bool include_string( string_view_t src, string_view_t sourceName ) LIPP_NOEXCEPT;
+		if ( value > ( UINTMAX_MAX - digit ) / base )
+			return false;
 
-	bool include_string( string_view_t src ) LIPP_NOEXCEPT { return include_string( src, "" ); }
+		value = value * base + digit;
+	}
 
-	virtual bool include_file( string_view_t fileName, bool isSystemPath ) LIPP_NOEXCEPT;
+	if ( i == digitsStart )
+		return false;
 
-	bool include_file( string_view_t fileName ) LIPP_NOEXCEPT { return include_file( fileName, false ); }
+	isUnsigned = false;
 
-	bool is_inside_true_block() const LIPP_NOEXCEPT { return !( ( _ifBits + 1ull ) & _ifBits ); }
+	for ( ; i < length; ++i )
+	{
+		/**/ if ( str[i] == 'u' || str[i] == 'U' )
+			isUnsigned = true;
+		else if ( str[i] != 'l' && str[i] != 'L' )
+			return false;
+	}
 
-	string_view_t current_source_name() const LIPP_NOEXCEPT { return _sourceName; }
+	isUnsigned = isUnsigned || value > uintmax_t( INTMAX_MAX );
+	return true;
+}
 
-	int current_line_number() const LIPP_NOEXCEPT { return _lineNumber; }
+// Character literal including its quotes, several characters are packed into one value like GCC does
+template <class T>
+inline bool parse_char_literal( const T &str, uintmax_t &value ) LIPP_NOEXCEPT
+{
+	size_t length = lipp::size( str );
+	if ( length < 3 || str[0] != '\'' || str[length - 1] != '\'' )
+		return false;
 
-	error_type error() const LIPP_NOEXCEPT { return _error; }
+	value = 0;
+	size_t count = 0;
 
-	struct token
+	for ( size_t i = 1; i < length - 1; ++count )
 	{
-		token_type type;
-		string_view_t whitespace;
-		string_view_t text;
-	};
+		uintmax_t ch = uintmax_t( uint8_t( str[i++] ) );
 
-	bool next_token( token &result, int flags = parsing_flags::default_parsing_flags ) LIPP_NOEXCEPT;
+		if ( ch == '\\' && i < length - 1 )
+		{
+			auto escape = str[i++];
+
+			/**/ if ( escape == 'n' ) ch = '\n';
+			else if ( escape == 't' ) ch = '\t';
+			else if ( escape == 'r' ) ch = '\r';
+			else if ( escape == 'a' ) ch = '\a';
+			else if ( escape == 'b' ) ch = '\b';
+			else if ( escape == 'f' ) ch = '\f';
+			else if ( escape == 'v' ) ch = '\v';
+			else if ( escape == 'x' )
+			{
+				for ( ch = 0; i < length - 1; ++i )
+				{
+					auto h = str[i];
+					unsigned digit = ( h >= '0' && h <= '9' ) ? unsigned( h - '0' ) :
+					                 ( h >= 'a' && h <= 'f' ) ? unsigned( h - 'a' + 10 ) :
+					                 ( h >= 'A' && h <= 'F' ) ? unsigned( h - 'A' + 10 ) : 16;
+					if ( digit == 16 )
+						break;
+
+					ch = ( ch * 16 + digit ) & 0xff;
+				}
+			}
+			else if ( escape >= '0' && escape <= '7' )
+			{
+				ch = uintmax_t( escape - '0' );
 
-	string_t read_all() LIPP_NOEXCEPT;
+				for ( int n = 1; n < 3 && i < length - 1 && str[i] >= '0' && str[i] <= '7'; ++n )
+					ch = ( ch * 8 + uintmax_t( str[i++] - '0' ) ) & 0xff;
+			}
+			else
+				ch = uintmax_t( uint8_t( escape ) );
+		}
 
-protected:
-	static constexpr size_t char_t_buffer_size = 256;
-	static constexpr size_t expression_stack_size = 16;
+		value = ( value << 8 ) | ch;
+	}
 
-	static string_view_t trim( string_view_t s ) LIPP_NOEXCEPT;
+	// Single character is a signed char
+	if ( count == 1 )
+		value = uintmax_t( intmax_t( int8_t( uint8_t( value ) ) ) );
 
-	bool parse_next_token( token &result, int flags = parsing_flags::default_parsing_flags ) LIPP_NOEXCEPT;
+	return true;
+}
 
-	virtual void set_error( error_type e ) LIPP_NOEXCEPT { _error = e; }
+// Stack keeping its first `N` items inline, so short uses never allocate
+template <class T, size_t N, class Vector>
+class small_stack
+{
+public:
+	void push( const T &item ) LIPP_NOEXCEPT
+	{
+		if ( _size < N )
+			_inline[_size] = item;
+		else
+			push_back( _heap, item );
 
-	virtual bool read_file( string_view_t fileName, string_t &output ) LIPP_NOEXCEPT;
+		++_size;
+	}
 
-	virtual int process_unknown_directive( string_view_t name ) LIPP_NOEXCEPT { return 1; }
+	void pop() LIPP_NOEXCEPT
+	{
+		if ( _size-- > N )
+			pop_back( _heap );
+	}
 
-	bool concat_remaining_tokens( string_t &result ) LIPP_NOEXCEPT;
+	T &operator[]( size_t index ) LIPP_NOEXCEPT { return index < N ? _inline[index] : _heap[index - N]; }
 
-	bool return_line_directive( token &result ) LIPP_NOEXCEPT;
+	const T &operator[]( size_t index ) const LIPP_NOEXCEPT { return index < N ? _inline[index] : _heap[index - N]; }
 
-	bool process_directive( token &result ) LIPP_NOEXCEPT;
+	T &back() LIPP_NOEXCEPT { return ( *this )[_size - 1]; }
 
-	int evaluate_expression() LIPP_NOEXCEPT;
+	size_t size() const LIPP_NOEXCEPT { return _size; }
 
-	struct macro
+	void clear() LIPP_NOEXCEPT
 	{
-		string_t name;
-		string_t value;
-	};
+		lipp::clear( _heap );
+		_size = 0;
+	}
 
-	using macros_t = vector_t<macro>;
+protected:
+	T _inline[N] = { };
 
-	macros_t _macros;
+	Vector _heap;
 
-	string_t _source = string_t();
+	size_t _size = 0;
+};
 
-	string_t _sourceName = string_t();
+// Maps the whole file read only, returns null when it cannot be mapped or is empty
+inline const void *map_file( const char *path, size_t &size ) LIPP_NOEXCEPT
+{
+#if defined(LIPP_MMAP)
+	int fd = open( path, O_RDONLY );
+	if ( fd < 0 )
+		return nullptr;
 
-	string_view_t _cwd = string_view_t();
+	void *mapping = nullptr;
 
-	string_t _tempString = string_t();
+	if ( struct stat st; fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+	{
+		mapping = mmap( nullptr, size_t( st.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
 
-	size_t _cursor = 0;
+		if ( mapping == MAP_FAILED )
+			mapping = nullptr;
+		else
+			size = size_t( st.st_size );
+	}
 
-	int _lineNumber = 0;
+	::close( fd );
+	return mapping;
+#else
+	return nullptr;
+#endif
+}
 
-	error_type _error = error_type::none;
+inline void unmap_file( const void *mapping, size_t size ) LIPP_NOEXCEPT
+{
+#if defined(LIPP_MMAP)
+	munmap( const_cast<void *>( mapping ), size );
+#endif
+}
 
-	unsigned long long _ifBits = 0;
+// True when the file can be opened for reading
+inline bool file_exists( const char *path ) LIPP_NOEXCEPT
+{
+#if defined(_WIN32)
+	return _access( path, 4 ) == 0;
+#else
+	return access( path, R_OK ) == 0;
+#endif
+}
 
-	bool _insideCommentBlock = false;
-};
+// Turns '\\' into '/', drops empty and "." segments and folds "dir/.." pairs, so the same file
+// is always reached through the same string
+template <class T>
+inline void normalize_path( T &path ) LIPP_NOEXCEPT
+{
+	auto isSeparator = []( auto ch ) { return ch == '/' || ch == '\\'; };
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	size_t length = lipp::size( path );
+	size_t root = ( length && isSeparator( path[0] ) ) ? 1 : 0;
+	size_t w = root;
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT
-{
-	name = trim( name );
-	value = trim( value );
+	if ( root )
+		path[0] = '/';
 
-	for ( auto &m : _macros )
+	for ( size_t i = root; i < length; )
 	{
-		if ( m.name == name )
+		size_t start = i;
+		while ( i < length && !isSeparator( path[i] ) )
+			++i;
+
+		size_t segmentLength = i - start;
+		i += ( i < length ) ? 1 : 0;
+
+		if ( !segmentLength || ( segmentLength == 1 && path[start] == '.' ) )
+			continue;
+
+		if ( segmentLength == 2 && path[start] == '.' && path[start + 1] == '.' )
 		{
-			m.value = value;
-			return true;
+			size_t prev = w;
+			while ( prev > root && path[prev - 1] != '/' )
+				--prev;
+
+			bool prevIsParent = w - prev == 2 && path[prev] == '.' && path[prev + 1] == '.';
+			if ( w > root && !prevIsParent )
+			{
+				w = prev > root ? prev - 1 : root;
+				continue;
+			}
+
+			// There is nothing above root
+			if ( root && w == root )
+				continue;
 		}
+
+		if ( w > root )
+			path[w++] = '/';
+
+		for ( size_t j = 0; j < segmentLength; ++j )
+			path[w++] = path[start + j];
 	}
 
-	push_back( _macros, { string_t( name ), string_t( value ) } );
-	return false;
+	resize( path, w );
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::undef( string_view_t name ) LIPP_NOEXCEPT
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct char_class
 {
-	for ( size_t i = 0, S = lipp::size( _macros ); i < S; ++i )
+	enum : uint8_t
 	{
-		if ( _macros[i].name == name )
-		{
-			swap_erase_at( _macros, i );
-			return true;
-		}
+		blank   = 0b0000'0001, // Everything <= 32 and (for 8-bit chars) >= 128, same as signed `ch <= 32`
+		newline = 0b0000'0010,
+		alpha   = 0b0000'0100, // Identifier start
+		digit   = 0b0000'1000,
+		quote   = 0b0001'0000,
+		punct   = 0b0010'0000,
+
+		identifier = alpha | digit,
+	};
+};
+
+struct char_class_table
+{
+	uint8_t classes[256];
+};
+
+inline constexpr char_class_table make_char_class_table() LIPP_NOEXCEPT
+{
+	char_class_table t = { };
+
+	for ( int i = 0; i < 256; ++i )
+	{
+		uint8_t c = 0;
+
+		/**/ if ( i <= 32 || i >= 128 ) c = char_class::blank | ( i == '\n' ? char_class::newline : 0 );
+		else if ( ( i >= 'a' && i <= 'z' ) || ( i >= 'A' && i <= 'Z' ) || i == '_' || i == '$' ) c = char_class::alpha;
+		else if ( i >= '0' && i <= '9' ) c = char_class::digit;
+		else if ( i == '\'' || i == '"' ) c = char_class::quote;
+
+		for ( const char *p = "!@#%^&*()[]{}<>.,:;+-/*=|?~"; *p; ++p )
+			if ( *p == i )
+				c = char_class::punct;
+
+		t.classes[i] = c;
 	}
 
-	return false;
+	return t;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline const typename T::char_t *preprocessor<T>::find_macro( string_view_t name ) const LIPP_NOEXCEPT
+inline constexpr char_class_table char_classes = make_char_class_table();
+
+template <class C>
+inline uint8_t char_class_of( C ch ) LIPP_NOEXCEPT
 {
-	for ( const auto &m : _macros )
-		if ( m.name == name )
-			return m.value.c_str();
+	if constexpr ( sizeof( C ) == 1 )
+		return char_classes.classes[uint8_t( ch )];
+	else
+		return ( ch >= 0 && ch < 128 ) ? char_classes.classes[size_t( ch )] : 0;
+}
 
-	return nullptr;
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+inline uint32_t count_trailing_zeros( uint32_t mask ) LIPP_NOEXCEPT
+{
+#if defined(_MSC_VER)
+	unsigned long index = 0;
+	_BitScanForward( &index, mask );
+	return uint32_t( index );
+#else
+	return uint32_t( __builtin_ctz( mask ) );
+#endif
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline void preprocessor<T>::reset() LIPP_NOEXCEPT
+// Index of the highest set bit, `mask` must not be zero
+inline uint32_t bit_scan_reverse( uint32_t mask ) LIPP_NOEXCEPT
 {
-	clear( _macros );
-	_source = string_t();
-	_sourceName = string_t();
-	_cwd = string_view_t();
-	_tempString = string_t();
-	_cursor = 0;
-	_lineNumber = 0;
-	_error = error_type::none;
-	_ifBits = 0;
-	_insideCommentBlock = false;
+#if defined(_MSC_VER)
+	unsigned long index = 0;
+	_BitScanReverse( &index, mask );
+	return uint32_t( index );
+#else
+	return uint32_t( 31 - __builtin_clz( mask ) );
+#endif
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::include_string( string_view_t src, string_view_t sourceName ) LIPP_NOEXCEPT
+inline int pop_count( uint32_t mask ) LIPP_NOEXCEPT
 {
-	if ( !lipp::size( src ) )
-		return true;
+#if defined(_MSC_VER)
+	return int( __popcnt( mask ) );
+#else
+	return __builtin_popcount( mask );
+#endif
+}
+
+#if defined(LIPP_AVX2)
+struct simd
+{
+	using reg_t = __m256i;
+	static constexpr size_t width = 32;
+	static constexpr uint32_t all = 0xFFFF'FFFFu;
+
+	static reg_t load( const void *p ) LIPP_NOEXCEPT { return _mm256_loadu_si256( static_cast<const __m256i *>( p ) ); }
+	static reg_t splat( char c ) LIPP_NOEXCEPT { return _mm256_set1_epi8( c ); }
+	static reg_t eq( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm256_cmpeq_epi8( a, b ); }
+	static reg_t gt( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm256_cmpgt_epi8( a, b ); }
+	static reg_t or_( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm256_or_si256( a, b ); }
+	static reg_t and_( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm256_and_si256( a, b ); }
+	static uint32_t mask( reg_t a ) LIPP_NOEXCEPT { return uint32_t( _mm256_movemask_epi8( a ) ); }
+};
+#elif defined(LIPP_SSE2)
+struct simd
+{
+	using reg_t = __m128i;
+	static constexpr size_t width = 16;
+	static constexpr uint32_t all = 0xFFFFu;
+
+	static reg_t load( const void *p ) LIPP_NOEXCEPT { return _mm_loadu_si128( static_cast<const __m128i *>( p ) ); }
+	static reg_t splat( char c ) LIPP_NOEXCEPT { return _mm_set1_epi8( c ); }
+	static reg_t eq( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm_cmpeq_epi8( a, b ); }
+	static reg_t gt( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm_cmpgt_epi8( a, b ); }
+	static reg_t or_( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm_or_si128( a, b ); }
+	static reg_t and_( reg_t a, reg_t b ) LIPP_NOEXCEPT { return _mm_and_si128( a, b ); }
+	static uint32_t mask( reg_t a ) LIPP_NOEXCEPT { return uint32_t( _mm_movemask_epi8( a ) ); }
+};
+#endif
+
+// Length of leading blank run, new lines are counted into `lines`. With `stopAtEol`, run ends before first new line.
+template <class C>
+inline size_t scan_blank( const C *str, size_t length, bool stopAtEol, int &lines ) LIPP_NOEXCEPT
+{
+	size_t i = 0;
+
+#if defined(LIPP_AVX2) || defined(LIPP_SSE2)
+	if constexpr ( sizeof( C ) == 1 )
+	{
+		const auto space = simd::splat( 32 ), newLine = simd::splat( '\n' );
 
-	char_t buff[char_t_buffer_size] = { };
+		for ( ; i + simd::width <= length; i += simd::width )
+		{
+			auto v = simd::load( str + i );
+			auto nl = simd::mask( simd::eq( v, newLine ) );
 
-	LIPP_SPRINTF( buff, "#line 1 \"%.*s\"\n", int( lipp::size( sourceName ) ), data( sourceName ) );
+			if ( auto stop = simd::mask( simd::gt( v, space ) ) | ( stopAtEol ? nl : 0 ); stop )
+			{
+				auto index = count_trailing_zeros( stop );
+				lines += pop_count( nl & ( ( 1u << index ) - 1 ) );
+				return i + index;
+			}
 
-	string_t source = buff;
-	source += src;
+			lines += pop_count( nl );
+		}
+	}
+#endif
 
-	if ( lipp::size( _source ) )
+	for ( ; i < length; ++i )
 	{
-		if ( source[lipp::size( source ) - 1] != '\n' )
-			source += "\n";
+		auto cls = char_class_of( str[i] );
+
+		if ( cls & char_class::newline )
+		{
+			if ( stopAtEol )
+				break;
 
-		LIPP_SPRINTF( buff, "#line %d \"%s\"\n", _lineNumber, data( _sourceName ) );
-		source += buff;
+			++lines;
+		}
+		else if ( !( cls & char_class::blank ) )
+			break;
 	}
 
-	_source = substr( _source, 0, _cursor ) + source + substr( _source, _cursor );
-	return true;
+	return i;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::include_file( string_view_t fileName, bool isSystemPath ) LIPP_NOEXCEPT
+// Position of `*/` closing a block comment, new lines are counted into `lines`. With `stopAtEol`, stops at first new line.
+template <class C>
+inline size_t scan_comment_body( const C *str, size_t length, bool stopAtEol, int &lines ) LIPP_NOEXCEPT
 {
-	char_t buff[char_t_buffer_size] = { };
+	size_t i = 0;
 
-	if ( !isSystemPath && lipp::size( _cwd ) )
-	{
-		LIPP_SPRINTF( buff, "%.*s/%.*s",
-		              int( lipp::size( _cwd ) ),
-		              data( _cwd ),
-		              int( lipp::size( fileName ) ),
-		              data( fileName ) )
-	}
-	else
+#if defined(LIPP_AVX2) || defined(LIPP_SSE2)
+	if constexpr ( sizeof( C ) == 1 )
 	{
-		LIPP_SPRINTF( buff, "%.*s",
-		              int( lipp::size( fileName ) ),
-		              data( fileName ) )
-	}
+		const auto star = simd::splat( '*' ), newLine = simd::splat( '\n' );
 
-	// Correct path separators
-	for ( size_t i = 0, S = lipp::size( buff ); i < S; ++i )
-	{
-		if ( buff[i] == '\\' )
-			buff[i] = '/';
+		for ( ; i + simd::width <= length; i += simd::width )
+		{
+			auto v = simd::load( str + i );
+			auto nl = simd::mask( simd::eq( v, newLine ) );
+
+			for ( auto stop = simd::mask( simd::eq( v, star ) ) | ( stopAtEol ? nl : 0 ); stop; stop &= stop - 1 )
+			{
+				auto index = count_trailing_zeros( stop );
+
+				if ( str[i + index] == '\n' || ( i + index + 1 < length && str[i + index + 1] == '/' ) )
+				{
+					lines += pop_count( nl & ( ( 1u << index ) - 1 ) );
+					return i + index;
+				}
+			}
+
+			lines += pop_count( nl );
+		}
 	}
+#endif
 
-	string_t fileContent;
-	if ( !read_file( buff, fileContent ) )
+	for ( ; i < length; ++i )
 	{
-		if ( _error == error_type::none )
-			set_error( error_type::read_failed );
+		if ( str[i] == '\n' )
+		{
+			if ( stopAtEol )
+				break;
 
-		return false;
+			++lines;
+		}
+		else if ( str[i] == '*' && i + 1 < length && str[i + 1] == '/' )
+			break;
 	}
 
-	return include_string( fileContent, buff );
+	return i;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::read_file( string_view_t fileName, string_t &output ) LIPP_NOEXCEPT
+// Position of the first new line
+template <class C>
+inline size_t scan_line( const C *str, size_t length ) LIPP_NOEXCEPT
 {
-#if !defined(LIPP_DO_NOT_USE_STL)
-	if ( std::ifstream ifs( string_t( fileName ).c_str() ); ifs.is_open() )
+	if constexpr ( sizeof( C ) == 1 )
 	{
-		output = string_t( std::istreambuf_iterator<char_t>( ifs ), std::istreambuf_iterator<char_t>() );
-		return true;
+		const void *eol = memchr( str, '\n', length );
+		return eol ? size_t( static_cast<const C *>( eol ) - str ) : length;
+	}
+	else
+	{
+		size_t i = 0;
+		while ( i < length && str[i] != '\n' ) ++i;
+		return i;
 	}
-#endif
-
-	set_error( error_type::read_failed );
-	return false;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline
-typename T::string_view_t preprocessor<T>::trim( string_view_t s ) LIPP_NOEXCEPT
+// Length of leading run of identifier characters
+template <class C>
+inline size_t scan_identifier( const C *str, size_t length ) LIPP_NOEXCEPT
 {
-	size_t start = 0;
-	size_t end = lipp::size( s );
+	size_t i = 0;
 
-	while ( start < end && s[start] <= 32 ) ++start;
-	while ( end > start && s[end - 1] <= 32 ) --end;
+#if defined(LIPP_AVX2) || defined(LIPP_SSE2)
+	if constexpr ( sizeof( C ) == 1 )
+	{
+		const auto lowerCase = simd::splat( 0x20 );
+		const auto beforeA = simd::splat( 'a' - 1 ), afterZ = simd::splat( 'z' + 1 );
+		const auto before0 = simd::splat( '0' - 1 ), after9 = simd::splat( '9' + 1 );
+		const auto underscore = simd::splat( '_' ), dollar = simd::splat( '$' );
 
-	return ( start < end ) ? lipp::substr( s, start, end - start ) : string_view_t();
-}
+		for ( ; i + simd::width <= length; i += simd::width )
+		{
+			auto v = simd::load( str + i );
+			auto lower = simd::or_( v, lowerCase );
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::next_token( token &result, int flags ) LIPP_NOEXCEPT
-{
-	result = token();
+			auto isAlpha = simd::and_( simd::gt( lower, beforeA ), simd::gt( afterZ, lower ) );
+			auto isDigit = simd::and_( simd::gt( v, before0 ), simd::gt( after9, v ) );
+			auto isOther = simd::or_( simd::eq( v, underscore ), simd::eq( v, dollar ) );
 
-	while ( parse_next_token( result, flags ) )
-	{
-		if ( is_inside_true_block() )
-			return true;
+			if ( auto stop = ~simd::mask( simd::or_( simd::or_( isAlpha, isDigit ), isOther ) ) & simd::all; stop )
+				return i + count_trailing_zeros( stop );
+		}
 	}
+#endif
 
-	return false;
+	while ( i < length && ( char_class_of( str[i] ) & char_class::identifier ) )
+		++i;
+
+	return i;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::parse_next_token( token &result, int flags ) LIPP_NOEXCEPT
+// Length of leading whitespace including comments. With `stopAtEol`, stops before first new line and sets `stoppedAtEol`.
+template <class C>
+inline size_t skip_whitespace( const C *str, size_t length, bool stopAtEol, int &lines, bool &insideCommentBlock, bool &stoppedAtEol ) LIPP_NOEXCEPT
 {
-	auto src = lipp::substr( string_view_t( _source ), _cursor );
-
-	size_t whitespaceLength = 0;
+	size_t i = 0;
 	bool insideLineComment = false;
-	bool prevInsideCommentBlock = _insideCommentBlock;
-	auto prevCursor = _cursor;
-	auto prevLineNumber = _lineNumber;
 
-	// Consume as much whitespace as possible
-	while ( whitespaceLength < lipp::size( src ) )
-	{
-		auto ch = lipp::char_at( src, whitespaceLength );
+	stoppedAtEol = false;
 
-		if ( ch == '\n' )
+	while ( i < length )
+	{
+		if ( insideCommentBlock )
 		{
-			if ( !!( flags & parsing_flags::stop_at_eols ) )
+			i += scan_comment_body( str + i, length - i, stopAtEol, lines );
+			if ( i == length )
+				break;
+
+			if ( str[i] == '\n' )
 			{
-				_insideCommentBlock = prevInsideCommentBlock;
-				return false;
+				stoppedAtEol = true;
+				break;
 			}
 
-			++_lineNumber;
-		}
-
-		if ( _insideCommentBlock )
-		{
-			if ( ch == '*' && lipp::char_at( src, whitespaceLength + 1 ) == '/' )
-			{
-				_insideCommentBlock = false;
-				++whitespaceLength;
-			}
+			insideCommentBlock = false;
+			i += 2; // Skip "*/"
 		}
 		else if ( insideLineComment )
 		{
-			if ( ch == '\n' )
-				insideLineComment = false;
+			i += scan_line( str + i, length - i );
+			insideLineComment = false;
 		}
-		else if ( ch == '/' )
+		else
 		{
-			if ( auto nextCh = lipp::char_at( src, whitespaceLength + 1 ); nextCh == '/' )
-			{
-				insideLineComment = true;
-				++whitespaceLength;
-			}
-			else if ( nextCh == '*' ) // Start of block comment?
+			i += scan_blank( str + i, length - i, stopAtEol, lines );
+			if ( i == length )
+				break;
+
+			if ( str[i] == '\n' )
 			{
-				_insideCommentBlock = true;
-				++whitespaceLength;
+				stoppedAtEol = true;
+				break;
 			}
+			else if ( str[i] != '/' || i + 1 == length )
+				break;
+
+			/**/ if ( str[i + 1] == '/' )
+				insideLineComment = true;
+			else if ( str[i + 1] == '*' ) // Start of block comment?
+				insideCommentBlock = true;
 			else
 				break;
-		}
-		else if ( ch > 32 )
-			break;
 
-		++whitespaceLength;
+			i += 2;
+		}
 	}
 
-	if ( !!( flags & parsing_flags::stop_at_eols ) && whitespaceLength == lipp::size( src ) )
-	{
-		_insideCommentBlock = prevInsideCommentBlock;
-		return false;
-	}
+	return i;
+}
 
-	result.whitespace = lipp::substr( src, 0, whitespaceLength );
-	src = lipp::substr( src, whitespaceLength );
-	_cursor += whitespaceLength;
+// Position of the first character that may change meaning of the rest of a line in disabled code:
+// new line, comment or literal start, or a backslash
+template <class C>
+inline size_t scan_plain_text( const C *str, size_t length ) LIPP_NOEXCEPT
+{
+	size_t i = 0;
 
-	if ( lipp::size( src ) == 0 )
+#if defined(LIPP_AVX2) || defined(LIPP_SSE2)
+	if constexpr ( sizeof( C ) == 1 )
 	{
-		if ( _insideCommentBlock )
+		const auto newLine = simd::splat( '\n' ), slash = simd::splat( '/' ), backslash = simd::splat( '\\' );
+		const auto quote = simd::splat( '"' ), apostrophe = simd::splat( '\'' );
+
+		for ( ; i + simd::width <= length; i += simd::width )
 		{
-			set_error( error_type::unexpected_eof );
-			return false;
-		}
+			auto v = simd::load( str + i );
+			auto special = simd::or_( simd::or_( simd::eq( v, newLine ), simd::eq( v, slash ) ),
+			                          simd::or_( simd::or_( simd::eq( v, quote ), simd::eq( v, apostrophe ) ), simd::eq( v, backslash ) ) );
 
-		result.type = token_type::eof;
-		return false;
+			if ( auto stop = simd::mask( special ); stop )
+				return i + count_trailing_zeros( stop );
+		}
 	}
+#endif
 
-	static constexpr char_t *alphaChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_$";
-	static constexpr char_t *numChars = "0123456789";
-	static constexpr char_t *numDotChars = "0123456789.";
-
-	size_t tokenLength = 1;
-
-	/**/ if ( auto ch = lipp::char_at( src, 0 ); ch == '#' )
+	for ( ; i < length; ++i )
 	{
-		src = substr( src, 1 ); // Cut away '#'
-		_cursor += 1;
-		result.type = token_type::directive;
-		return process_directive( result );
+		auto ch = str[i];
+		if ( ch == '\n' || ch == '/' || ch == '"' || ch == '\'' || ch == '\\' )
+			break;
 	}
-	else if ( strchr( alphaChars, ch ) )
+
+	return i;
+}
+
+// Skips code without tokenizing it. Only comments, literals and line starts are tracked. Stops after the
+// last code in front of a directive, so the directive still gets the whitespace in front of it. Inside of
+// a disabled block nested blocks are counted and only the `#elif`, `#else` or `#endif` ending it stops,
+// otherwise any directive does.
+template <class C>
+inline size_t skip_code( const C *str, size_t length, int &lines, bool lineStart, bool disabledBlock ) LIPP_NOEXCEPT
+{
+	auto isDirective = []( const C *name, size_t nameLength, const char *directive )
 	{
-		result.type = token_type::identifier;
+		size_t i = 0;
+		while ( i < nameLength && directive[i] && name[i] == directive[i] )
+			++i;
 
-		while ( tokenLength < lipp::size( src ) )
-		{
-			auto ch = lipp::char_at( src, tokenLength );
-			if ( !strchr( alphaChars, ch ) && !strchr( numChars, ch ) )
-				break;
+		return i == nameLength && !directive[i];
+	};
 
-			++tokenLength;
-		}
-	}
-	else if ( strchr( numChars, ch ) )
+	size_t i = 0;
+	size_t codeEnd = 0;
+	int linesAtCodeEnd = lines;
+	int depth = 0;
+
+	while ( i < length )
 	{
-		char_t buff[char_t_buffer_size] = { };
-		buff[0] = ch;
+		auto ch = str[i];
 
-		result.type = token_type::number;
-		auto lastChar = ch;
-		bool containsDot = false;
-		bool containsExponent = false;
+		if ( ch == '\n' )
+		{
+			lineStart = true;
 
-		while ( tokenLength < lipp::size( src ) )
+			++lines;
+			++i;
+		}
+		else if ( char_class_of( ch ) & char_class::blank )
+			++i;
+		else if ( ch == '/' && i + 1 < length && str[i + 1] == '/' )
+			i += scan_line( str + i, length - i );
+		else if ( ch == '/' && i + 1 < length && str[i + 1] == '*' )
 		{
-			auto ch = src[tokenLength];
+			i += 2;
+			i += scan_comment_body( str + i, length - i, false, lines );
+			i += ( i < length ) ? 2 : 0;
+		}
+		else if ( ch == '#' && lineStart )
+		{
+			if ( !disabledBlock )
+			{
+				lines = linesAtCodeEnd;
+				return codeEnd;
+			}
 
-			/**/ if ( ch == 'e' && strchr( numDotChars, lastChar ) )
+			// Comments and line continuations are whitespace between '#' and the name too
+			size_t nameStart = ++i;
+			while ( nameStart < length )
 			{
-				if ( containsExponent )
+				if ( str[nameStart] == ' ' || str[nameStart] == '\t' )
+					++nameStart;
+				else if ( str[nameStart] == '/' && nameStart + 1 < length && str[nameStart + 1] == '*' )
 				{
-					set_error( error_type::syntax_error );
-					return false;
+					nameStart += 2;
+					nameStart += scan_comment_body( str + nameStart, length - nameStart, false, lines );
+					nameStart += ( nameStart < length ) ? 2 : 0;
 				}
-
-				containsExponent = true;
-			}
-			else if ( ch == '+' || ch == '-' )
-			{
-				if ( lastChar != 'e' )
+				else if ( str[nameStart] == '\\' && nameStart + 1 < length && str[nameStart + 1] == '\n' )
+				{
+					nameStart += 2;
+					++lines;
+				}
+				else
 					break;
 			}
-			else if ( ch == '.' && ( strchr( numChars, lastChar ) || lastChar == '+' || lastChar == '-' ) )
+
+			size_t nameLength = scan_identifier( str + nameStart, length - nameStart );
+			const C *name = str + nameStart;
+			i = nameStart + nameLength;
+			lineStart = false;
+
+			if ( isDirective( name, nameLength, "if" ) || isDirective( name, nameLength, "ifdef" ) || isDirective( name, nameLength, "ifndef" ) )
+				++depth;
+			else if ( isDirective( name, nameLength, "endif" ) )
 			{
-				if ( containsDot )
+				if ( !depth-- )
 				{
-					set_error( error_type::syntax_error );
-					return false;
+					lines = linesAtCodeEnd;
+					return codeEnd;
 				}
-
-				containsDot = true;
 			}
-			else if ( ch == 'f' )
+			else if ( !depth && ( isDirective( name, nameLength, "else" ) || isDirective( name, nameLength, "elif" ) ) )
 			{
-				if ( !strchr( numDotChars, lastChar ) )
-				{
-					set_error( error_type::syntax_error );
-					return false;
-				}
-
-				break;
+				lines = linesAtCodeEnd;
+				return codeEnd;
 			}
-			else if ( !strchr( numChars, ch ) )
-				break;
 
-			if ( tokenLength < char_t_buffer_size - 1 )
-				buff[tokenLength] = ch;
-
-			lastChar = ch;
-			++tokenLength;
+			codeEnd = i;
+			linesAtCodeEnd = lines;
 		}
-	}
-	else if ( strchr( "'\"", ch ) )
-	{
-		result.type = token_type::string;
-		auto lastChar = ch;
-
-		while ( tokenLength < lipp::size( src ) )
+		else if ( ch == '"' || ch == '\'' )
 		{
-			auto c = src[tokenLength++];
-			if ( ch == c && lastChar != '\\' )
-				break;
+			// Unterminated literal ends at the end of line
+			for ( ++i; i < length && str[i] != ch && str[i] != '\n'; ++i )
+			{
+				if ( str[i] == '\\' && i + 1 < length )
+					++i;
+			}
 
-			lastChar = c;
+			i += ( i < length && str[i] == ch ) ? 1 : 0;
+			lineStart = false;
+			codeEnd = i;
+			linesAtCodeEnd = lines;
 		}
-
-		if ( tokenLength < 2 || src[tokenLength - 1] != ch )
+		else if ( ch == '\\' )
 		{
-			set_error( error_type::invalid_string );
-			return false;
+			// Line continuation does not start a new line
+			if ( i + 1 < length && str[i + 1] == '\n' )
+				++lines;
+
+			i += ( i + 1 < length && str[i + 1] == '\n' ) ? 2 : 1;
+			lineStart = false;
+			codeEnd = i;
+			linesAtCodeEnd = lines;
 		}
+		else
+		{
+			size_t start = i;
+			i += 1 + scan_plain_text( str + i + 1, length - i - 1 );
+			lineStart = false;
 
-		result.text = substr( src, 0, tokenLength );
-		src = substr( src, tokenLength );
-		_cursor += tokenLength;
-		return true;
-	}
-	else if ( strchr( "!@#$%^&*()[]{}<>.,:;+-/*=|?~", ch ) )
-	{
-		auto secondChar = lipp::char_at( src, 1 );
+			// Trailing blanks belong to the whitespace
+			for ( codeEnd = i; codeEnd > start + 1 && ( char_class_of( str[codeEnd - 1] ) & char_class::blank ); )
+				--codeEnd;
 
-		/**/ if ( ch == '(' ) result.type = token_type::parent_left;
-		else if ( ch == ')' ) result.type = token_type::parent_right;
-		else if ( ch == '{' ) result.type = token_type::brace_left;
-		else if ( ch == '}' ) result.type = token_type::brace_right;
-		else if ( ch == '+' ) result.type = token_type::add;
-		else if ( ch == '-' ) result.type = token_type::subtract;
-		else if ( ch == '/' ) result.type = token_type::divide;
-		else if ( ch == '*' ) result.type = token_type::multiply;
-		else if ( ch == ';' ) result.type = token_type::semicolon;
-		else if ( ch == '&' && secondChar == '&' )
-		{
-			result.type = token_type::logical_and;
-			++tokenLength;
-		}
-		else if ( ch == '|' && secondChar == '|' )
-		{
-			result.type = token_type::logical_or;
-			++tokenLength;
-		}
-		else if ( ch == '=' && secondChar == '=' )
-		{
-			result.type = token_type::equal;
-			++tokenLength;
-		}
-		else if ( ch == '!' && secondChar == '=' )
-		{
-			result.type = token_type::not_equal;
-			++tokenLength;
-		}
-		else if ( ch == '<' && secondChar == '=' )
-		{
-			result.type = token_type::less_equal;
-			++tokenLength;
-		}
-		else if ( ch == '>' && secondChar == '=' )
-		{
-			result.type = token_type::greater_equal;
-			++tokenLength;
+			linesAtCodeEnd = lines;
 		}
-		else if ( ch == '!' ) result.type = token_type::logical_not;
-		else if ( ch == '<' ) result.type = token_type::less;
-		else if ( ch == '>' ) result.type = token_type::greater;
-		else if ( ch == '=' ) result.type = token_type::assign;
 	}
 
-	result.text = substr( src, 0, tokenLength );
-	_cursor += tokenLength;
+	if ( disabledBlock )
+		return length;
 
-	if ( result.type == token_type::identifier && !!( flags & parsing_flags::expand_macros ) )
-	{
-		if ( const auto *value = find_macro( result.text ); value != nullptr )
-		{
-			_source = substr( _source, prevCursor, whitespaceLength ) + string_t( value ) + substr( _source, _cursor );
-			_cursor = 0;
-			_lineNumber = prevLineNumber;
+	lines = linesAtCodeEnd;
+	return codeEnd;
+}
 
-			result = token();
-			return parse_next_token( result, flags );
-		}
-	}
+template <class C>
+inline size_t skip_disabled_block( const C *str, size_t length, int &lines ) LIPP_NOEXCEPT
+{ return skip_code( str, length, lines, false, true ); }
 
-	return true;
-}
+// `lineStart` tells whether `str` starts at the beginning of a line
+template <class C>
+inline size_t skip_to_directive( const C *str, size_t length, int &lines, bool lineStart ) LIPP_NOEXCEPT
+{ return skip_code( str, length, lines, lineStart, false ); }
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline typename preprocessor<T>::string_t preprocessor<T>::read_all() LIPP_NOEXCEPT
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Bump allocator for text which lives until the end of a run. `reset` releases everything at once
+// but keeps the blocks, so following runs reuse the memory instead of allocating it again.
+template <class Char, template <class> class Vector>
+class text_arena
 {
-	string_t result = "";
+public:
+	static constexpr size_t block_size = 64 * 1024;
 
-	token t;
-	while ( next_token( t ) )
+	text_arena() = default;
+
+	text_arena( const text_arena & ) = delete;
+
+	text_arena &operator=( const text_arena & ) = delete;
+
+	~text_arena() LIPP_NOEXCEPT
 	{
-		result += t.whitespace;
-		result += t.text;
+		for ( size_t i = 0, S = lipp::size( _blocks ); i < S; ++i )
+			delete[] _blocks[i].text;
 	}
 
-	return result;
-}
+	// Room for `length` characters, not initialized
+	Char *allocate( size_t length ) LIPP_NOEXCEPT;
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::concat_remaining_tokens( string_t &result ) LIPP_NOEXCEPT
-{
-	token t;
-	while ( parse_next_token( t, parsing_flags::stop_at_eols ) )
+	// Extends the last allocation in place when it fits, otherwise moves it to a new place
+	Char *grow( const Char *text, size_t length, size_t newLength ) LIPP_NOEXCEPT;
+
+	void reset() LIPP_NOEXCEPT
+	{
+		_current = 0;
+		_used = 0;
+		_last = nullptr;
+	}
+
+	// Characters held in all blocks, used or not
+	size_t capacity() const LIPP_NOEXCEPT
 	{
-		if ( lipp::size( result ) )
-			result += " ";
+		size_t result = 0;
+		for ( size_t i = 0, S = lipp::size( _blocks ); i < S; ++i )
+			result += _blocks[i].size;
 
-		result += string_t( t.text );
+		return result;
 	}
 
-	return _error == error_type::none;
-}
+protected:
+	struct block
+	{
+		Char *text;
+		size_t size;
+	};
 
-//---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::return_line_directive( token &result ) LIPP_NOEXCEPT
-{
-	char_t buff[char_t_buffer_size] = { };
-	LIPP_SPRINTF( buff, "#line %d \"%s\"", _lineNumber + 1, data( _sourceName ) );
+	Vector<block> _blocks;
 
-	_tempString = buff;
-	result.text = _tempString;
-	return true;
-}
+	size_t _current = 0; // Block being filled, the following ones are free
+	size_t _used = 0;    // In the current block
+
+	const Char *_last = nullptr;
+};
 
 //---------------------------------------------------------------------------------------------------------------------
-template <class T> inline bool preprocessor<T>::process_directive( token &result ) LIPP_NOEXCEPT
+template <class C, template <class> class V> inline C *text_arena<C, V>::allocate( size_t length ) LIPP_NOEXCEPT
 {
-	auto nextIdentifier = [this]()->string_view_t
+	// Blocks too small for the request stay unused until `reset`
+	for ( ; _current < lipp::size( _blocks ); ++_current, _used = 0 )
 	{
-		if ( token t; parse_next_token( t, 0 ) )
-			return t.type == token_type::identifier ? t.text : string_view_t();
+		if ( _used + length <= _blocks[_current].size )
+		{
+			C *text = _blocks[_current].text + _used;
+			_used += length;
+			_last = text;
+			return text;
+		}
+	}
 
-		set_error( error_type::expected_identifier );
-		return string_view_t();
-	};
+	size_t size = length > block_size ? length : block_size;
+	push_back( _blocks, block{ new C[size], size } );
 
-	auto directiveName = nextIdentifier();
-	if ( !lipp::size( directiveName ) )
-		return false;
+	_used = length;
+	_last = _blocks[_current].text;
+	return _blocks[_current].text;
+}
 
-	/**/ if ( directiveName == "line" )
+//---------------------------------------------------------------------------------------------------------------------
+template <class C, template <class> class V>
+inline C *text_arena<C, V>::grow( const C *text, size_t length, size_t newLength ) LIPP_NOEXCEPT
+{
+	if ( text && text == _last )
 	{
-		token t;
-		if ( !parse_next_token( t, 0 ) || t.type != token_type::number )
+		const auto &b = _blocks[_current];
+		size_t offset = size_t( text - b.text );
+
+		if ( offset + newLength <= b.size )
 		{
-			set_error( error_type::syntax_error );
-			return false;
+			_used = offset + newLength;
+			return b.text + offset;
 		}
+	}
 
-		_lineNumber = atoi( data( t.text ) ) - 1;
+	// Room for twice the size, so text appended piece by piece is copied O(log n) times
+	size_t size = newLength < length * 2 ? length * 2 : newLength;
+	C *result = allocate( size );
+	_used -= size - newLength;
 
-		if ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::string )
-		{
-			set_error( error_type::syntax_error );
-			return false;
-		}
+	if ( length )
+		memcpy( result, text, length * sizeof( C ) );
 
-		_sourceName = remove_first_and_last( t.text );
+	return result;
+}
 
-		// Resolve current working directory
-		{
-			size_t slashPos = lipp::size( _sourceName ) - 1;
-			while ( slashPos < lipp::size( _sourceName ) && _sourceName[slashPos] != '/' && _sourceName[slashPos] != '\\' )
-				--slashPos;
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-			if ( slashPos < lipp::size( _sourceName ) )
-				_cwd = substr( string_view_t( _sourceName ), 0, slashPos );
-			else
-				_cwd = string_view_t();
-		}
+template <class Char, class String, class StringView, template <class> class Vector,
+          template <class, template <class> class> class Arena = text_arena>
+struct preprocessor_traits
+{
+	using char_t = Char;
+	using string_t = String;
+	using string_view_t = StringView;
+	template <typename T> using vector_t = Vector<T>;
+	using arena_t = Arena<Char, Vector>; // Text of one run, see `text_arena`
+};
 
-		return return_line_directive( result );
-	}
-	else if ( directiveName == "define" )
-	{
-		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
-		{
-			string_t value;
-			if ( !concat_remaining_tokens( value ) )
-				return false;
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-			define( macroName, value );
+template <class T>
+inline uint32_t hash_string( const T &str ) LIPP_NOEXCEPT
+{
+	uint32_t h = 2166136261u;
 
-			_tempString = "#define ";
-			_tempString += macroName;
-			_tempString += " ";
-			_tempString += value;
+	for ( size_t i = 0, S = lipp::size( str ); i < S; ++i )
+		h = ( h ^ uint32_t( str[i] ) ) * 16777619u;
 
-			result.text = _tempString;
-			return true;
-		}
+	return h;
+}
 
-		return false; // Error!
-	}
-	else if ( directiveName == "undef" )
-	{
-		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
-		{
-			undef( macroName );
+// Wider hash of whole file content, collisions would replay tokens of a different text
+template <class T>
+inline uint64_t hash_content( const T &str ) LIPP_NOEXCEPT
+{
+	uint64_t h = 14695981039346656037ull;
 
-			_tempString = "#undef ";
-			_tempString += macroName;
+	for ( size_t i = 0, S = lipp::size( str ); i < S; ++i )
+		h = ( h ^ uint64_t( str[i] ) ) * 1099511628211ull;
 
-			result.text = _tempString;
-			return true;
-		}
+	return h;
+}
 
-		return false;
-	}
-	else if ( directiveName == "ifdef" )
-	{
-		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
-		{
-			_ifBits = ( _ifBits << 3ull ) | ( ( find_macro( macroName ) != nullptr ) ? 0b111ull : 0b110ull );
-			return parse_next_token( result );
-		}
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		return false;
-	}
-	else if ( directiveName == "ifndef" )
+// Pre-tokenized macro body token, `offset` points either into the macro pool or into the expansion buffer
+struct macro_token
+{
+	enum : uint8_t
 	{
-		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
-		{
-			_ifBits = ( _ifBits << 3ull ) | ( ( find_macro( macroName ) == nullptr ) ? 0b111ull : 0b110ull );
-			return parse_next_token( result );
-		}
+		leading_space = 0b0000'0001,
+		parameter     = 0b0000'0010, // `param` is index of the substituted argument
+		stringize     = 0b0000'0100, // Parameter preceded by '#'
+		paste         = 0b0000'1000, // Followed by '##'
+		pooled        = 0b0001'0000, // Text lives in the macro pool
+		argument      = 0b0010'0000, // Came from an argument, not disabled by the macro being expanded
+	};
+
+	token_type type;
+	uint8_t flags;
+	uint16_t param;
+	uint32_t offset;
+	uint32_t length;
+};
+
+// Token recorded while lexing an included file, later includes of the same content replay it instead
+// of lexing the text again. Offsets are relative to the file content.
+struct file_token
+{
+	enum : uint8_t
+	{
+		end_of_line = 0b0000'0001, // Whitespace in front of the token ends a line, not only continues it
+	};
+
+	uint8_t type;        // token_type
+	uint8_t flags;
+	uint16_t lines;      // New lines in the whitespace in front of the token
+	uint32_t offset;     // Start of the whitespace in front of the token
+	uint32_t whitespace;
+	uint32_t length;
+};
+
+// Instruction of a compiled `#if` expression, which runs on a stack of `uintmax_t` values. Signed
+// operations reinterpret them as `intmax_t`, conversions between the two never change the bits.
+struct expression_op
+{
+	enum : uint8_t
+	{
+		push,          // `value`
+		negate,
+		bit_not,
+		logical_not,
+		to_bool,
+		multiply,
+		divide,
+		modulo,
+		add,
+		subtract,
+		shift_left,
+		shift_right,
+		less,
+		less_equal,
+		greater,
+		greater_equal,
+		equal,
+		not_equal,
+		bit_and,
+		bit_xor,
+		bit_or,
+		and_jump,      // Jumps to `value` when top is zero and leaves it there, pops it otherwise
+		or_jump,       // Jumps to `value` with one on top when top is not zero, pops it otherwise
+		jump_if_zero,  // Pops and jumps to `value` when it was zero
+		jump,
+		load_macro,    // Integer value of macro `value` of `compiled_expression::names`, zero when not defined
+		defined_macro, // One when macro `value` is defined
+	};
+
+	enum : uint8_t
+	{
+		is_unsigned = 0b0000'0001, // Operands have unsigned type
+	};
+
+	uint8_t code;
+	uint8_t flags;
+	uintmax_t value;
+};
+
+struct macro_flags
+{
+	enum : uint8_t
+	{
+		function_like = 0b0000'0001,
+		variadic      = 0b0000'0010,
+		substitute    = 0b0000'0100, // Needs argument substitution or token pasting, cannot be replayed in place
+	};
+};
+
+// Open addressing hash map of macros. Names are interned into a single character pool together with
+// values, each distinct name gets exactly one entry for the whole run and `undef` only marks it as
+// undefined, so slots never need tombstones. Pool offsets are used instead of pointers, because
+// the pool reallocates as it grows.
+template <class T>
+class macro_table
+{
+public:
+	using traits_t = T;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+
+	struct entry
+	{
+		uint32_t hash;
+		uint32_t name;
+		uint32_t nameLength;
+		uint32_t value;
+		uint32_t valueLength;
+		uint32_t valueCapacity;
+		uint32_t tokens;
+		uint32_t tokenCount;
+		uint32_t tokenCapacity;
+		uint16_t paramCount;
+		uint8_t flags;
+		bool defined;
+		uint32_t stamp;     // Value of `stamp()` after the last `define` or `undef` of this name
+	};
+
+	// Token offsets are relative to `value`
+	bool define( string_view_t name, string_view_t value,
+	             const macro_token *tokens = nullptr, size_t tokenCount = 0,
+	             size_t paramCount = 0, uint8_t flags = 0 ) LIPP_NOEXCEPT;
+
+	bool undef( string_view_t name ) LIPP_NOEXCEPT;
+
+	// Turns the table into a read only view of `snapshot` until the first `define` or `undef`, which
+	// copies it. Any number of tables, also on different threads, may share one snapshot as long as
+	// the snapshot itself does not change.
+	void share( const macro_table &snapshot ) LIPP_NOEXCEPT;
+
+	const entry *find( string_view_t name ) const LIPP_NOEXCEPT { return find( name, hash_string( name ) ); }
+
+	const entry *find( string_view_t name, uint32_t hash ) const LIPP_NOEXCEPT;
+
+	string_view_t name( const entry &e ) const LIPP_NOEXCEPT { return string_view_t( storage().pool_data() + e.name, e.nameLength ); }
+
+	string_view_t value( const entry &e ) const LIPP_NOEXCEPT { return string_view_t( storage().pool_data() + e.value, e.valueLength ); }
+
+	// Null terminated, valid until the next `define`
+	const char_t *c_value( const entry &e ) const LIPP_NOEXCEPT { return storage().pool_data() + e.value; }
+
+	const macro_token &token( size_t index ) const LIPP_NOEXCEPT { return storage().token_data()[index]; }
+
+	string_view_t text( const macro_token &t ) const LIPP_NOEXCEPT { return string_view_t( storage().pool_data() + t.offset, t.length ); }
+
+	uint32_t index( const entry &e ) const LIPP_NOEXCEPT { return uint32_t( &e - storage().entry_data() ); }
+
+	size_t size() const LIPP_NOEXCEPT { return storage()._count; }
+
+	// Changes with every `define` and `undef`
+	uint32_t stamp() const LIPP_NOEXCEPT { return storage()._stamp; }
+
+	// Both define the same names the same way, no matter in which order or how many times they changed
+	bool same_definitions( const macro_table &other ) const LIPP_NOEXCEPT;
+
+	// Name is undefined in both or defined the same way
+	bool same_definition( string_view_t name, const macro_table &other ) const LIPP_NOEXCEPT;
+
+	void clear() LIPP_NOEXCEPT;
+
+	// Writes the table in a form `attach_image` uses in place, returns bytes written (a multiple of 8) or zero
+	size_t write_image( FILE *file ) const LIPP_NOEXCEPT;
+
+	// Makes the table a read only view of an image written by the same build, until the first `define` or
+	// `undef`, which copies it. The image must be 8 byte aligned and outlive the table and tables sharing it.
+	// Returns size of the image, zero when it is not valid.
+	size_t attach_image( const void *image, size_t length ) LIPP_NOEXCEPT;
+
+protected:
+	static constexpr size_t initial_slot_count = 64;
+	static constexpr uint32_t image_magic = 0x4d50504c; // "LPPM"
+
+	struct image_header
+	{
+		uint32_t magic;
+		uint32_t charSize;
+		uint32_t entrySize;
+		uint32_t tokenSize;
+		uint32_t entryCount;
+		uint32_t slotCount;
+		uint32_t tokenCount;
+		uint32_t poolLength; // Including the terminating zero
+		uint32_t count;
+		uint32_t stamp;
+	};
+
+	// Arrays of an attached image, `pool` is null when there is none
+	struct image_view
+	{
+		const entry *entries;
+		const uint32_t *slots;
+		const macro_token *tokens;
+		const char_t *pool;
+		uint32_t entryCount;
+		uint32_t slotCount;
+		uint32_t tokenCount;
+		uint32_t poolLength;
+	};
+
+	const macro_table &storage() const LIPP_NOEXCEPT { return _shared ? *_shared : *this; }
+
+	// Storage arrays are either in the vectors or in an attached image
+	const entry *entry_data() const LIPP_NOEXCEPT
+	{ return _image.pool ? _image.entries : lipp::size( _entries ) ? &_entries[0] : nullptr; }
+
+	size_t entry_count() const LIPP_NOEXCEPT { return _image.pool ? _image.entryCount : lipp::size( _entries ); }
+
+	const uint32_t *slot_data() const LIPP_NOEXCEPT
+	{ return _image.pool ? _image.slots : lipp::size( _slots ) ? &_slots[0] : nullptr; }
+
+	size_t slot_count() const LIPP_NOEXCEPT { return _image.pool ? _image.slotCount : lipp::size( _slots ); }
+
+	const macro_token *token_data() const LIPP_NOEXCEPT
+	{ return _image.pool ? _image.tokens : lipp::size( _tokens ) ? &_tokens[0] : nullptr; }
+
+	size_t token_count() const LIPP_NOEXCEPT { return _image.pool ? _image.tokenCount : lipp::size( _tokens ); }
+
+	const char_t *pool_data() const LIPP_NOEXCEPT { return _image.pool ? _image.pool : _pool.c_str(); }
+
+	// Without the terminating zero
+	size_t pool_length() const LIPP_NOEXCEPT { return _image.pool ? _image.poolLength - 1 : lipp::size( _pool ); }
+
+	// Both entries are in storage tables
+	bool same_entry( const entry &e, const macro_table &other, const entry &o ) const LIPP_NOEXCEPT;
+
+	void detach() LIPP_NOEXCEPT;
+
+	entry *find_or_insert( string_view_t name ) LIPP_NOEXCEPT;
+
+	void rehash( size_t slotCount ) LIPP_NOEXCEPT;
+
+	uint32_t append( string_view_t str ) LIPP_NOEXCEPT;
+
+	vector_t<entry> _entries;
+
+	vector_t<uint32_t> _slots; // Index into `_entries` + 1, zero means empty
+
+	vector_t<macro_token> _tokens;
+
+	string_t _pool = string_t();
+
+	size_t _count = 0;
+
+	uint32_t _stamp = 0;
+
+	const macro_table *_shared = nullptr;
+
+	image_view _image = image_view();
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool macro_table<T>::define( string_view_t name, string_view_t value,
+                                                       const macro_token *tokens, size_t tokenCount,
+                                                       size_t paramCount, uint8_t flags ) LIPP_NOEXCEPT
+{
+	detach();
+
+	auto *e = find_or_insert( name );
+	bool wasDefined = e->defined;
+
+	if ( lipp::size( value ) <= e->valueCapacity )
+	{
+		// Reuse storage of the previous value
+		for ( size_t i = 0, S = lipp::size( value ); i < S; ++i )
+			_pool[e->value + i] = value[i];
+
+		_pool[e->value + lipp::size( value )] = 0;
+	}
+	else
+	{
+		e->value = append( value );
+		e->valueCapacity = uint32_t( lipp::size( value ) );
+	}
+
+	e->valueLength = uint32_t( lipp::size( value ) );
+
+	if ( tokenCount > e->tokenCapacity )
+	{
+		e->tokens = uint32_t( lipp::size( _tokens ) );
+		e->tokenCapacity = uint32_t( tokenCount );
+		resize( _tokens, lipp::size( _tokens ) + tokenCount );
+	}
+
+	for ( size_t i = 0; i < tokenCount; ++i )
+	{
+		auto &t = _tokens[e->tokens + i];
+		t = tokens[i];
+		t.offset += e->value;
+		t.flags |= macro_token::pooled;
+	}
+
+	e->tokenCount = uint32_t( tokenCount );
+	e->paramCount = uint16_t( paramCount );
+	e->flags = flags;
+	e->stamp = ++_stamp;
+
+	if ( !wasDefined )
+	{
+		e->defined = true;
+		++_count;
+	}
+
+	return wasDefined;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool macro_table<T>::undef( string_view_t name ) LIPP_NOEXCEPT
+{
+	if ( !find( name ) )
+		return false;
+
+	detach();
+
+	if ( auto *e = const_cast<entry *>( find( name ) ); e )
+	{
+		e->defined = false;
+		e->stamp = ++_stamp;
+		--_count;
+		return true;
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline
+const typename macro_table<T>::entry *macro_table<T>::find( string_view_t name, uint32_t hash ) const LIPP_NOEXCEPT
+{
+	if ( _shared )
+		return _shared->find( name, hash );
+
+	if ( !_count )
+		return nullptr;
+
+	const auto *slots = slot_data();
+	const auto *entries = entry_data();
+	size_t mask = slot_count() - 1;
+
+	for ( size_t i = hash & mask; slots[i]; i = ( i + 1 ) & mask )
+	{
+		const auto &e = entries[slots[i] - 1];
+
+		if ( e.hash == hash && this->name( e ) == name )
+			return e.defined ? &e : nullptr;
+	}
+
+	return nullptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool macro_table<T>::same_definitions( const macro_table &other ) const LIPP_NOEXCEPT
+{
+	const auto &a = storage();
+	const auto &b = other.storage();
+
+	if ( &a == &b )
+		return true;
+
+	// Counts only defined names
+	if ( a._count != b._count )
+		return false;
+
+	for ( size_t i = 0, S = a.entry_count(); i < S; ++i )
+	{
+		const auto &e = a.entry_data()[i];
+		if ( !e.defined )
+			continue;
+
+		const auto *o = b.find( a.name( e ), e.hash );
+
+		if ( !o || !a.same_entry( e, b, *o ) )
+			return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool macro_table<T>::same_definition( string_view_t name, const macro_table &other ) const LIPP_NOEXCEPT
+{
+	const auto *e = find( name );
+	const auto *o = other.find( name );
+
+	return e && o ? storage().same_entry( *e, other.storage(), *o ) : e == o;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool macro_table<T>::same_entry( const entry &e, const macro_table &other, const entry &o ) const LIPP_NOEXCEPT
+{
+	if ( o.paramCount != e.paramCount || o.flags != e.flags || o.tokenCount != e.tokenCount || value( e ) != other.value( o ) )
+		return false;
+
+	for ( size_t t = 0; t < e.tokenCount; ++t )
+	{
+		const auto &x = token_data()[e.tokens + t];
+		const auto &y = other.token_data()[o.tokens + t];
+
+		if ( x.type != y.type || x.flags != y.flags || x.param != y.param || text( x ) != other.text( y ) )
+			return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void macro_table<T>::clear() LIPP_NOEXCEPT
+{
+	lipp::clear( _entries );
+	lipp::clear( _slots );
+	lipp::clear( _tokens );
+	lipp::clear( _pool );
+	_count = 0;
+	_stamp = 0;
+	_shared = nullptr;
+	_image = image_view();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void macro_table<T>::share( const macro_table &snapshot ) LIPP_NOEXCEPT
+{
+	clear();
+	_shared = &snapshot.storage();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void macro_table<T>::detach() LIPP_NOEXCEPT
+{
+	if ( _shared && !_shared->_image.pool )
+	{
+		const auto &shared = *_shared;
+		_shared = nullptr;
+
+		_entries = shared._entries;
+		_slots = shared._slots;
+		_tokens = shared._tokens;
+		_pool = shared._pool;
+		_count = shared._count;
+		_stamp = shared._stamp;
+	}
+	else if ( _shared || _image.pool )
+	{
+		// Image of this table or of the shared one
+		const auto &source = storage();
+		auto image = source._image;
+		_count = source._count;
+		_stamp = source._stamp;
+		_shared = nullptr;
+		_image = image_view();
+
+		resize( _entries, image.entryCount );
+		resize( _slots, image.slotCount );
+		resize( _tokens, image.tokenCount );
+
+		for ( size_t i = 0; i < image.entryCount; ++i )
+			_entries[i] = image.entries[i];
+
+		for ( size_t i = 0; i < image.slotCount; ++i )
+			_slots[i] = image.slots[i];
+
+		for ( size_t i = 0; i < image.tokenCount; ++i )
+			_tokens[i] = image.tokens[i];
+
+		_pool = string_t( string_view_t( image.pool, image.poolLength - 1 ) );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline size_t macro_table<T>::write_image( FILE *file ) const LIPP_NOEXCEPT
+{
+	const auto &s = storage();
+
+	image_header header = { image_magic, uint32_t( sizeof( char_t ) ), uint32_t( sizeof( entry ) ), uint32_t( sizeof( macro_token ) ),
+	                        uint32_t( s.entry_count() ), uint32_t( s.slot_count() ), uint32_t( s.token_count() ),
+	                        uint32_t( s.pool_length() + 1 ), uint32_t( s._count ), s._stamp };
+
+	size_t size = sizeof( header ) + header.entryCount * sizeof( entry ) + header.slotCount * sizeof( uint32_t ) +
+	              header.tokenCount * sizeof( macro_token ) + header.poolLength * sizeof( char_t );
+	size_t padding = ( 8 - size % 8 ) % 8;
+	const uint64_t zero = 0;
+
+	bool ok = fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+	          fwrite( s.entry_data(), sizeof( entry ), header.entryCount, file ) == header.entryCount &&
+	          fwrite( s.slot_data(), sizeof( uint32_t ), header.slotCount, file ) == header.slotCount &&
+	          fwrite( s.token_data(), sizeof( macro_token ), header.tokenCount, file ) == header.tokenCount &&
+	          fwrite( s.pool_data(), sizeof( char_t ), header.poolLength, file ) == header.poolLength &&
+	          fwrite( &zero, 1, padding, file ) == padding;
+
+	return ok ? size + padding : 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline size_t macro_table<T>::attach_image( const void *image, size_t length ) LIPP_NOEXCEPT
+{
+	image_header header = { };
+
+	if ( length < sizeof( header ) || reinterpret_cast<uintptr_t>( image ) % 8 )
+		return 0;
+
+	memcpy( &header, image, sizeof( header ) );
+
+	size_t size = sizeof( header ) + size_t( header.entryCount ) * sizeof( entry ) + size_t( header.slotCount ) * sizeof( uint32_t ) +
+	              size_t( header.tokenCount ) * sizeof( macro_token ) + size_t( header.poolLength ) * sizeof( char_t );
+	size += ( 8 - size % 8 ) % 8;
+
+	// Lookups mask slot indices, so their count is a power of two
+	if ( header.magic != image_magic || header.charSize != sizeof( char_t ) || header.entrySize != sizeof( entry ) ||
+	     header.tokenSize != sizeof( macro_token ) || size > length || !header.poolLength ||
+	     ( header.slotCount & ( header.slotCount - 1 ) ) || ( header.count && !header.slotCount ) )
+		return 0;
+
+	const char *bytes = static_cast<const char *>( image ) + sizeof( header );
+	image_view view = { };
+
+	view.entries = reinterpret_cast<const entry *>( bytes );
+	bytes += header.entryCount * sizeof( entry );
+	view.slots = reinterpret_cast<const uint32_t *>( bytes );
+	bytes += header.slotCount * sizeof( uint32_t );
+	view.tokens = reinterpret_cast<const macro_token *>( bytes );
+	bytes += header.tokenCount * sizeof( macro_token );
+	view.pool = reinterpret_cast<const char_t *>( bytes );
+	view.entryCount = header.entryCount;
+	view.slotCount = header.slotCount;
+	view.tokenCount = header.tokenCount;
+	view.poolLength = header.poolLength;
+
+	if ( view.pool[view.poolLength - 1] != 0 )
+		return 0;
+
+	clear();
+	_image = view;
+	_count = header.count;
+	_stamp = header.stamp;
+
+	return size;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline
+typename macro_table<T>::entry *macro_table<T>::find_or_insert( string_view_t name ) LIPP_NOEXCEPT
+{
+	// Keep load factor below 1/2
+	if ( ( lipp::size( _entries ) + 1 ) * 2 > lipp::size( _slots ) )
+		rehash( lipp::size( _slots ) ? lipp::size( _slots ) * 2 : initial_slot_count );
+
+	auto hash = hash_string( name );
+	size_t mask = lipp::size( _slots ) - 1;
+	size_t i = hash & mask;
+
+	for ( ; _slots[i]; i = ( i + 1 ) & mask )
+	{
+		auto &e = _entries[_slots[i] - 1];
+
+		if ( e.hash == hash && this->name( e ) == name )
+			return &e;
+	}
+
+	auto nameOffset = append( name );
+
+	auto valueOffset = nameOffset + uint32_t( lipp::size( name ) );
+
+	push_back( _entries, { hash, nameOffset, uint32_t( lipp::size( name ) ), valueOffset, 0, 0, 0, 0, 0, 0, 0, false, 0 } );
+	_slots[i] = uint32_t( lipp::size( _entries ) );
+
+	return &_entries[lipp::size( _entries ) - 1];
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void macro_table<T>::rehash( size_t slotCount ) LIPP_NOEXCEPT
+{
+	lipp::clear( _slots );
+	resize( _slots, slotCount );
+
+	size_t mask = slotCount - 1;
+
+	for ( size_t index = 0, S = lipp::size( _entries ); index < S; ++index )
+	{
+		size_t i = _entries[index].hash & mask;
+		while ( _slots[i] )
+			i = ( i + 1 ) & mask;
+
+		_slots[i] = uint32_t( index + 1 );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline uint32_t macro_table<T>::append( string_view_t str ) LIPP_NOEXCEPT
+{
+	auto offset = uint32_t( lipp::size( _pool ) );
+
+	_pool += str;
+	_pool += char_t( 0 );
+
+	return offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+struct scoped_lock
+{
+	explicit scoped_lock( T &lockable ) LIPP_NOEXCEPT : _lockable( lockable ) { _lockable.lock(); }
+
+	scoped_lock( const scoped_lock & ) = delete;
+
+	~scoped_lock() { _lockable.unlock(); }
+
+	T &_lockable;
+};
+
+// Distinct strings in the order they were first inserted
+template <class T>
+class name_set
+{
+public:
+	using traits_t = T;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+
+	// False when the name is already there
+	bool insert( string_view_t name ) LIPP_NOEXCEPT;
+
+	// Index of the name, `size()` when it is not there
+	size_t find( string_view_t name ) const LIPP_NOEXCEPT;
+
+	string_view_t operator[]( size_t index ) const LIPP_NOEXCEPT { return _names[index]; }
+
+	uint32_t hash( size_t index ) const LIPP_NOEXCEPT { return _hashes[index]; }
+
+	size_t size() const LIPP_NOEXCEPT { return lipp::size( _names ); }
+
+	void clear() LIPP_NOEXCEPT
+	{
+		lipp::clear( _names );
+		lipp::clear( _hashes );
+		lipp::clear( _slots );
+	}
+
+protected:
+	static constexpr size_t initial_slot_count = 32;
+
+	size_t find_slot( string_view_t name, uint32_t hash ) const LIPP_NOEXCEPT;
+
+	vector_t<string_t> _names;
+
+	vector_t<uint32_t> _hashes;
+
+	vector_t<uint32_t> _slots; // Index into `_names` + 1, zero means empty
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool name_set<T>::insert( string_view_t name ) LIPP_NOEXCEPT
+{
+	if ( ( lipp::size( _names ) + 1 ) * 2 > lipp::size( _slots ) )
+	{
+		lipp::clear( _slots );
+		resize( _slots, ( lipp::size( _names ) + 1 ) * 4 < initial_slot_count ? initial_slot_count : lipp::size( _names ) * 4 );
+
+		for ( size_t index = 0, mask = lipp::size( _slots ) - 1, S = lipp::size( _names ); index < S; ++index )
+		{
+			size_t i = _hashes[index] & mask;
+			while ( _slots[i] )
+				i = ( i + 1 ) & mask;
+
+			_slots[i] = uint32_t( index + 1 );
+		}
+	}
+
+	auto hash = hash_string( name );
+	size_t i = find_slot( name, hash );
+
+	if ( _slots[i] )
+		return false;
+
+	push_back( _names, string_t( name ) );
+	push_back( _hashes, hash );
+	_slots[i] = uint32_t( lipp::size( _names ) );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline size_t name_set<T>::find( string_view_t name ) const LIPP_NOEXCEPT
+{
+	if ( !lipp::size( _slots ) )
+		return lipp::size( _names );
+
+	auto slot = _slots[find_slot( name, hash_string( name ) )];
+	return slot ? slot - 1 : lipp::size( _names );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline size_t name_set<T>::find_slot( string_view_t name, uint32_t hash ) const LIPP_NOEXCEPT
+{
+	size_t mask = lipp::size( _slots ) - 1;
+	size_t i = hash & mask;
+
+	while ( _slots[i] && ( _hashes[_slots[i] - 1] != hash || string_view_t( _names[_slots[i] - 1] ) != name ) )
+		i = ( i + 1 ) & mask;
+
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Contents of included files keyed by normalized path, together with what was learned about their
+// include guards and whether the include directory search found them. It is not cleared by
+// `preprocessor::reset`, so it can be kept across runs and handed to several preprocessors, files then
+// get read and scanned for guards only once.
+//
+// Entries live in blocks that never move, each twice the size of the previous one. When the cache is
+// shared between threads, everything must be done while holding `lock` (a no-op without STL), except
+// reading `text()` of an entry that was seen loaded before. Files are read without it into a
+// `loaded_file` and published after, so threads do not wait for each other's disk reads.
+template <class T>
+class include_cache
+{
+public:
+	using traits_t = T;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+
+	struct entry
+	{
+		uint32_t hash;
+		string_t path;
+		string_t content;       // Used when the file is not mapped
+		const char_t *mapped;
+		size_t mappedLength;
+		string_t guard;         // Macro wrapping the whole file in `#ifndef guard ... #endif`, empty when there is none
+		bool loaded;            // `text()` is valid
+		bool pragmaOnce;
+		bool hashed;            // `contentHash` is valid
+		uint64_t contentHash;
+		vector_t<file_token> tokens; // Recorded by the first include, kept across `invalidate` in case content did not change
+		uint64_t tokensHash;         // Content hash the tokens were recorded from
+		bool checked;           // Include directory search already looked for the file, `exists` is valid
+		bool exists;
+
+		string_view_t text() const LIPP_NOEXCEPT
+		{ return mapped ? string_view_t( mapped, mappedLength ) : string_view_t( content ); }
+	};
+
+	include_cache() = default;
+
+	include_cache( const include_cache & ) = delete;
+
+	include_cache &operator=( const include_cache & ) = delete;
+
+	~include_cache() { clear(); }
+
+	// Path must already be normalized
+	uint32_t find_or_insert( string_view_t path ) LIPP_NOEXCEPT;
+
+	const entry *find( string_view_t path ) const LIPP_NOEXCEPT;
+
+	entry &operator[]( size_t index ) LIPP_NOEXCEPT
+	{
+		auto block = bit_scan_reverse( uint32_t( index / first_block_size + 1 ) );
+		return _blocks[block][index - first_block_size * ( ( size_t( 1 ) << block ) - 1 )];
+	}
+
+	const entry &operator[]( size_t index ) const LIPP_NOEXCEPT { return ( *const_cast<include_cache *>( this ) )[index]; }
+
+	// Content read while not holding the lock
+	struct loaded_file
+	{
+		string_t content;
+		const char_t *mapped = nullptr;
+		size_t mappedLength = 0;
+
+		loaded_file() = default;
+
+		loaded_file( const loaded_file & ) = delete;
+
+		loaded_file &operator=( const loaded_file & ) = delete;
+
+		~loaded_file() { if ( mapped ) unmap_file( mapped, mappedLength ); }
+	};
+
+	// Memory maps a file, false when it has to be read instead
+	static bool map( const string_t &path, loaded_file &file ) LIPP_NOEXCEPT;
+
+	// Makes the content of an entry the one of `file`, unless another thread published it first
+	void publish_file( size_t index, loaded_file &file ) LIPP_NOEXCEPT;
+
+	// Forget content, guard and include search result of a file that changed on disk
+	void invalidate( string_view_t path ) LIPP_NOEXCEPT;
+
+	// Hash of loaded content, computed on first use
+	uint64_t content_hash( size_t index ) LIPP_NOEXCEPT;
+
+	// Hash computed from `text()` without holding the lock, kept when the entry has none yet
+	void set_content_hash( size_t index, uint64_t hash ) LIPP_NOEXCEPT;
+
+	// Recorded tokens of an entry, null when there are none for its current content
+	const vector_t<file_token> *recorded_tokens( size_t index ) LIPP_NOEXCEPT;
+
+	// Keeps the first tokens recorded for the current content, false when the entry already has them
+	bool publish_tokens( size_t index, vector_t<file_token> &tokens ) LIPP_NOEXCEPT;
+
+	size_t size() const LIPP_NOEXCEPT { return _count; }
+
+	void clear() LIPP_NOEXCEPT;
+
+#if !defined(LIPP_DO_NOT_USE_STL)
+	void lock() const LIPP_NOEXCEPT { _mutex.lock(); }
+
+	void unlock() const LIPP_NOEXCEPT { _mutex.unlock(); }
+#else
+	void lock() const LIPP_NOEXCEPT { }
+
+	void unlock() const LIPP_NOEXCEPT { }
+#endif
+
+protected:
+	static constexpr size_t initial_slot_count = 64;
+	static constexpr size_t first_block_size = 64;
+	static constexpr size_t max_block_count = 26;
+
+	static void unload( entry &e ) LIPP_NOEXCEPT;
+
+	void rehash( size_t slotCount ) LIPP_NOEXCEPT;
+
+	vector_t<entry> _blocks[max_block_count];
+
+	vector_t<uint32_t> _slots; // Entry index + 1, zero means empty
+
+	size_t _count = 0;
+
+#if !defined(LIPP_DO_NOT_USE_STL)
+	mutable std::mutex _mutex;
+#endif
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline uint32_t include_cache<T>::find_or_insert( string_view_t path ) LIPP_NOEXCEPT
+{
+	if ( ( _count + 1 ) * 2 > lipp::size( _slots ) )
+		rehash( lipp::size( _slots ) ? lipp::size( _slots ) * 2 : initial_slot_count );
+
+	auto hash = hash_string( path );
+	size_t mask = lipp::size( _slots ) - 1;
+	size_t i = hash & mask;
+
+	for ( ; _slots[i]; i = ( i + 1 ) & mask )
+	{
+		const auto &e = ( *this )[_slots[i] - 1];
+
+		if ( e.hash == hash && string_view_t( e.path ) == path )
+			return _slots[i] - 1;
+	}
+
+	// Blocks are allocated whole, so growing never moves existing entries
+	if ( auto block = bit_scan_reverse( uint32_t( _count / first_block_size + 1 ) ); !lipp::size( _blocks[block] ) )
+		resize( _blocks[block], first_block_size << block );
+
+	( *this )[_count] = { hash, string_t( path ), string_t(), nullptr, 0, string_t(), false, false, false, 0, vector_t<file_token>(), 0, false, false };
+	_slots[i] = uint32_t( ++_count );
+
+	return _slots[i] - 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline
+const typename include_cache<T>::entry *include_cache<T>::find( string_view_t path ) const LIPP_NOEXCEPT
+{
+	if ( !lipp::size( _slots ) )
+		return nullptr;
+
+	auto hash = hash_string( path );
+	size_t mask = lipp::size( _slots ) - 1;
+
+	for ( size_t i = hash & mask; _slots[i]; i = ( i + 1 ) & mask )
+	{
+		const auto &e = ( *this )[_slots[i] - 1];
+
+		if ( e.hash == hash && string_view_t( e.path ) == path )
+			return &e;
+	}
+
+	return nullptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::invalidate( string_view_t path ) LIPP_NOEXCEPT
+{
+	if ( auto *e = const_cast<entry *>( find( path ) ); e )
+		unload( *e );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline uint64_t include_cache<T>::content_hash( size_t index ) LIPP_NOEXCEPT
+{
+	auto &e = ( *this )[index];
+
+	if ( !e.hashed && e.loaded )
+	{
+		e.contentHash = hash_content( e.text() );
+		e.hashed = true;
+	}
+
+	return e.contentHash;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::set_content_hash( size_t index, uint64_t hash ) LIPP_NOEXCEPT
+{
+	auto &e = ( *this )[index];
+
+	if ( !e.hashed && e.loaded )
+	{
+		e.contentHash = hash;
+		e.hashed = true;
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline
+const typename T::template vector_t<file_token> *include_cache<T>::recorded_tokens( size_t index ) LIPP_NOEXCEPT
+{
+	const auto &e = ( *this )[index];
+
+	if ( !e.loaded || !lipp::size( e.tokens ) || e.tokensHash != content_hash( index ) )
+		return nullptr;
+
+	return &e.tokens;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool include_cache<T>::publish_tokens( size_t index, vector_t<file_token> &tokens ) LIPP_NOEXCEPT
+{
+	// Tokens already published stay, other preprocessors may be replaying them
+	if ( !( *this )[index].loaded || recorded_tokens( index ) )
+		return false;
+
+	auto &e = ( *this )[index];
+	e.tokens = static_cast<vector_t<file_token> &&>( tokens );
+	e.tokensHash = content_hash( index );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool include_cache<T>::map( const string_t &path, loaded_file &file ) LIPP_NOEXCEPT
+{
+	// Mapping is a view of raw bytes
+	if constexpr ( sizeof( char_t ) == 1 )
+	{
+		size_t length = 0;
+
+		if ( const void *mapping = map_file( path.c_str(), length ); mapping )
+		{
+			file.mapped = static_cast<const char_t *>( mapping );
+			file.mappedLength = length;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::publish_file( size_t index, loaded_file &file ) LIPP_NOEXCEPT
+{
+	auto &e = ( *this )[index];
+
+	// The loser of a race drops its copy, `text()` of the first one may be in use already
+	if ( e.loaded )
+		return;
+
+	e.content = static_cast<string_t &&>( file.content );
+	e.mapped = file.mapped;
+	e.mappedLength = file.mappedLength;
+	e.loaded = true;
+
+	file.mapped = nullptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::clear() LIPP_NOEXCEPT
+{
+	for ( size_t i = 0; i < _count; ++i )
+		unload( ( *this )[i] );
+
+	for ( size_t i = 0; i < max_block_count; ++i )
+		lipp::clear( _blocks[i] );
+
+	lipp::clear( _slots );
+	_count = 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::unload( entry &e ) LIPP_NOEXCEPT
+{
+	if ( e.mapped )
+		unmap_file( e.mapped, e.mappedLength );
+
+	e.content = string_t();
+	e.mapped = nullptr;
+	e.mappedLength = 0;
+	e.guard = string_t();
+	e.loaded = false;
+	e.pragmaOnce = false;
+	e.hashed = false;
+	e.checked = false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void include_cache<T>::rehash( size_t slotCount ) LIPP_NOEXCEPT
+{
+	lipp::clear( _slots );
+	resize( _slots, slotCount );
+
+	size_t mask = slotCount - 1;
+
+	for ( size_t index = 0; index < _count; ++index )
+	{
+		size_t i = ( *this )[index].hash & mask;
+		while ( _slots[i] )
+			i = ( i + 1 ) & mask;
+
+		_slots[i] = uint32_t( index + 1 );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(LIPP_STATISTICS)
+
+// Counters of one run of a preprocessor, collected only when `LIPP_STATISTICS` is defined. Times are in
+// microseconds. File times count only time spent in `next_token`: exclusive while the file is on top,
+// inclusive also while files it includes are. Spans for trace events are wall time between entering and
+// leaving the file, so they include the time the caller spent with the tokens.
+template <class T>
+class preprocessor_statistics
+{
+public:
+	using traits_t = T;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	using names_t = name_set<traits_t>;
+
+	struct file_counters
+	{
+		uint64_t includes;  // Requests, also those skipped because of an include guard or `#pragma once`
+		uint64_t entered;   // Times the text was actually read
+		double inclusiveTime;
+		double exclusiveTime;
+	};
+
+	// One inclusion of a file
+	struct span
+	{
+		uint32_t file;
+		uint32_t depth;
+		double begin;
+		double end;
+	};
+
+	uint64_t bytesLexed = 0;      // Whitespace and tokens read by the lexer
+	uint64_t bytesReplayed = 0;   // Covered by recorded tokens instead, see `preprocessor::set_token_replay`
+	uint64_t bytesSkipped = 0;    // Jumped over in disabled blocks
+	uint64_t tokensEmitted = 0;
+	uint64_t macroLookups = 0;    // Searches of the macro table
+	uint64_t macroExpansions = 0;
+	size_t peakChunkDepth = 0;
+	size_t peakExpansionText = 0; // Characters of substituted macro bodies held at once
+	size_t arenaCapacity = 0;     // Characters in the text arena blocks
+
+	names_t files;                // Indices of `fileCounters`
+	vector_t<file_counters> fileCounters;
+
+	names_t macros;               // Indices of `macroCounters`, only macros expanded at least once
+	vector_t<uint64_t> macroCounters;
+
+	vector_t<span> spans;
+
+	void clear() LIPP_NOEXCEPT;
+
+	// Hooks called by the preprocessor
+	void count_include( string_view_t name ) LIPP_NOEXCEPT { fileCounters[file_index( name )].includes++; }
+
+	void enter_file( string_view_t name, size_t chunk ) LIPP_NOEXCEPT;
+
+	// Leaves the innermost file if `chunk` holds its text, all files when `chunk` is `SIZE_MAX`
+	void leave_file( size_t chunk ) LIPP_NOEXCEPT;
+
+	void count_expansion( string_view_t name, size_t macroIndex ) LIPP_NOEXCEPT;
+
+	void resume() LIPP_NOEXCEPT { _last = now(); _running = true; }
+
+	void pause() LIPP_NOEXCEPT { charge(); _running = false; }
+
+	bool write_json( FILE *file ) const LIPP_NOEXCEPT;
+
+	// Trace Event Format, opens in chrome://tracing or Perfetto
+	bool write_chrome_trace( FILE *file ) const LIPP_NOEXCEPT;
+
+protected:
+	struct open_file
+	{
+		uint32_t file;
+		size_t chunk;
+		size_t span;
+		double exclusiveTime;
+		double childTime;
+	};
+
+	double now() const LIPP_NOEXCEPT
+	{ return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - _start ).count(); }
+
+	// Time since the last charge goes to the innermost file
+	void charge() LIPP_NOEXCEPT;
+
+	uint32_t file_index( string_view_t name ) LIPP_NOEXCEPT
+	{
+		if ( files.insert( name ) )
+			push_back( fileCounters, file_counters{ 0, 0, 0.0, 0.0 } );
+
+		return uint32_t( files.find( name ) );
+	}
+
+	static void write_string( FILE *file, string_view_t str ) LIPP_NOEXCEPT;
+
+	vector_t<open_file> _open;
+
+	vector_t<uint32_t> _macroSlots; // Macro table index to index + 1 into `macros`
+
+	std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+	double _last = 0;
+
+	bool _running = false;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::clear() LIPP_NOEXCEPT
+{
+	*this = preprocessor_statistics();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::charge() LIPP_NOEXCEPT
+{
+	if ( !_running )
+		return;
+
+	double time = now();
+
+	if ( size_t count = lipp::size( _open ); count )
+		_open[count - 1].exclusiveTime += time - _last;
+
+	_last = time;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::enter_file( string_view_t name, size_t chunk ) LIPP_NOEXCEPT
+{
+	charge();
+
+	uint32_t file = file_index( name );
+	fileCounters[file].entered++;
+
+	push_back( spans, span{ file, uint32_t( lipp::size( _open ) ), now(), 0.0 } );
+	push_back( _open, open_file{ file, chunk, lipp::size( spans ) - 1, 0.0, 0.0 } );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::leave_file( size_t chunk ) LIPP_NOEXCEPT
+{
+	charge();
+
+	while ( size_t count = lipp::size( _open ) )
+	{
+		auto f = _open[count - 1];
+		if ( chunk != SIZE_MAX && f.chunk != chunk )
+			return;
+
+		pop_back( _open );
+
+		// A file included more than once in its own inclusion counts only once into inclusive time
+		double inclusiveTime = f.exclusiveTime + f.childTime;
+		bool nested = false;
+
+		for ( size_t i = 0, S = lipp::size( _open ); i < S; ++i )
+			nested = nested || _open[i].file == f.file;
+
+		auto &counters = fileCounters[f.file];
+		counters.exclusiveTime += f.exclusiveTime;
+
+		if ( !nested )
+			counters.inclusiveTime += inclusiveTime;
+
+		spans[f.span].end = now();
+
+		if ( count > 1 )
+			_open[count - 2].childTime += inclusiveTime;
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::count_expansion( string_view_t name, size_t macroIndex ) LIPP_NOEXCEPT
+{
+	macroExpansions++;
+
+	if ( macroIndex >= lipp::size( _macroSlots ) )
+		resize( _macroSlots, macroIndex + 1 );
+
+	if ( !_macroSlots[macroIndex] )
+	{
+		// Index differs from the one of the macro table, which reuses an entry for each redefinition
+		if ( macros.insert( name ) )
+			push_back( macroCounters, uint64_t( 0 ) );
+
+		_macroSlots[macroIndex] = uint32_t( macros.find( name ) + 1 );
+	}
+
+	macroCounters[_macroSlots[macroIndex] - 1]++;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline void preprocessor_statistics<T>::write_string( FILE *file, string_view_t str ) LIPP_NOEXCEPT
+{
+	fputc( '"', file );
+
+	for ( size_t i = 0, S = lipp::size( str ); i < S; ++i )
+	{
+		auto c = uint8_t( str[i] );
+
+		/**/ if ( c == '"' || c == '\\' ) fprintf( file, "\\%c", char( c ) );
+		else if ( c < 0x20 ) fprintf( file, "\\u%04x", unsigned( c ) );
+		else fputc( char( c ), file );
+	}
+
+	fputc( '"', file );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool preprocessor_statistics<T>::write_json( FILE *file ) const LIPP_NOEXCEPT
+{
+	fprintf( file, "{\n\t\"bytes_lexed\": %llu,\n\t\"bytes_replayed\": %llu,\n\t\"bytes_skipped\": %llu,\n",
+	         (unsigned long long)bytesLexed, (unsigned long long)bytesReplayed, (unsigned long long)bytesSkipped );
+	fprintf( file, "\t\"tokens_emitted\": %llu,\n\t\"macro_lookups\": %llu,\n\t\"macro_expansions\": %llu,\n",
+	         (unsigned long long)tokensEmitted, (unsigned long long)macroLookups, (unsigned long long)macroExpansions );
+	fprintf( file, "\t\"peak_chunk_depth\": %zu,\n\t\"peak_expansion_text\": %zu,\n\t\"arena_capacity\": %zu,\n",
+	         peakChunkDepth, peakExpansionText, arenaCapacity );
+
+	fprintf( file, "\t\"files\": [" );
+	for ( size_t i = 0, S = lipp::size( files ); i < S; ++i )
+	{
+		fprintf( file, "%s\n\t\t{ \"path\": ", i ? "," : "" );
+		write_string( file, files[i] );
+		fprintf( file, ", \"includes\": %llu, \"entered\": %llu, \"inclusive_us\": %.3f, \"exclusive_us\": %.3f }",
+		         (unsigned long long)fileCounters[i].includes, (unsigned long long)fileCounters[i].entered,
+		         fileCounters[i].inclusiveTime, fileCounters[i].exclusiveTime );
+	}
+
+	fprintf( file, "\n\t],\n\t\"macros\": [" );
+	for ( size_t i = 0, S = lipp::size( macros ); i < S; ++i )
+	{
+		fprintf( file, "%s\n\t\t{ \"name\": ", i ? "," : "" );
+		write_string( file, macros[i] );
+		fprintf( file, ", \"expansions\": %llu }", (unsigned long long)macroCounters[i] );
+	}
+
+	fprintf( file, "\n\t]\n}\n" );
+	return !ferror( file );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool preprocessor_statistics<T>::write_chrome_trace( FILE *file ) const LIPP_NOEXCEPT
+{
+	fprintf( file, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [" );
+
+	// Files still open end at the last one that was left
+	double last = 0;
+	for ( size_t i = 0, S = lipp::size( spans ); i < S; ++i )
+		last = spans[i].end > last ? spans[i].end : last;
+
+	for ( size_t i = 0, S = lipp::size( spans ); i < S; ++i )
+	{
+		const auto &s = spans[i];
+		double end = s.end > 0 ? s.end : last;
+
+		fprintf( file, "%s\n\t{ \"name\": ", i ? "," : "" );
+		write_string( file, files[s.file] );
+		fprintf( file, ", \"cat\": \"include\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"depth\": %u } }",
+		         s.begin, end > s.begin ? end - s.begin : 0.0, s.depth );
+	}
+
+	fprintf( file, "\n] }\n" );
+	return !ferror( file );
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// `Derived` of a CRTP base, the base itself for `void`
+template <class Derived, class Base> struct derived_type { using type = Derived; };
+template <class Base> struct derived_type<void, Base> { using type = Base; };
+
+template <class A, class B> struct same_type { static constexpr bool value = false; };
+template <class A> struct same_type<A, A> { static constexpr bool value = true; };
+
+// Hooks, which are `define`, `undef`, `find_macro`, `reset`, `include_string`, `include_file`, `set_error`,
+// `read_file`, `file_exists` and `process_unknown_directive`, are called on `Derived`, which can hide any of
+// them. Calls are resolved at compile time and inline, a protected hook needs `basic_preprocessor` as a
+// friend. `preprocessor` turns them into virtual functions.
+template <class T, class Derived = void>
+class basic_preprocessor
+{
+public:
+	using traits_t = T;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+
+	basic_preprocessor() = default;
+
+	~basic_preprocessor() { release_state(); }
+
+	bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT;
+
+	bool define( string_view_t name ) LIPP_NOEXCEPT { return self().define( name, "" ); }
+
+	bool undef( string_view_t name ) LIPP_NOEXCEPT;
+
+	const char_t *find_macro( string_view_t name ) const LIPP_NOEXCEPT;
+
+	void reset() LIPP_NOEXCEPT;
+
+	bool include_string( string_view_t src, string_view_t sourceName ) LIPP_NOEXCEPT;
+
+	bool include_string( string_view_t src ) LIPP_NOEXCEPT { return self().include_string( src, "" ); }
+
+	bool include_file( string_view_t fileName, bool isSystemPath ) LIPP_NOEXCEPT;
+
+	bool include_file( string_view_t fileName ) LIPP_NOEXCEPT { return self().include_file( fileName, false ); }
+
+	// Searched in the order they were added, user directories before system ones. "..." includes look
+	// next to the including file first, <...> ones only in the directories. Without any directories names
+	// are used as they are, relative to the including file for "..." includes.
+	void add_include_directory( string_view_t directory, bool isSystem = false ) LIPP_NOEXCEPT;
+
+	void clear_include_directories() LIPP_NOEXCEPT;
+
+	const vector_t<string_t> &include_directories( bool isSystem = false ) const LIPP_NOEXCEPT
+	{ return isSystem ? _systemDirectories : _userDirectories; }
+
+	using macros_t = macro_table<traits_t>;
+
+	const macros_t &macros() const LIPP_NOEXCEPT { return _macros; }
+
+	// Starts from the macros of `snapshot` without copying them, until the first `define` or `undef`
+	void share_macros( const macros_t &snapshot ) LIPP_NOEXCEPT
+	{
+		_macros.share( snapshot );
+
+		// Macro stamps of another table say nothing about these
+		_expressionTexts.clear();
+		clear( _expressions );
+	}
+
+	using include_cache_t = include_cache<traits_t>;
+
+	// Shared cache must outlive the preprocessor, null switches back to the preprocessor's own one
+	void set_include_cache( include_cache_t *cache ) LIPP_NOEXCEPT { _includeCache = cache; }
+
+	include_cache_t &get_include_cache() LIPP_NOEXCEPT { return _includeCache ? *_includeCache : _ownIncludeCache; }
+
+	// Included files are lexed once, their tokens are recorded into the include cache and later
+	// includes of the same content replay them instead of lexing the text again
+	void set_token_replay( bool enable ) LIPP_NOEXCEPT { _tokenReplay = enable; }
+
+	// Output gets `#line` directives where included files begin and end and after conditional blocks,
+	// on by default. Locations are tracked either way, see `track_locations`.
+	void set_line_directives( bool enable ) LIPP_NOEXCEPT { _lineDirectives = enable; }
+
+	// A hidden `find_macro` is asked by `#ifdef` and `defined`. With this on, off by default, macro expansion
+	// and `#if` values ask it too instead of reading the table, at the cost of a call per identifier.
+	void set_find_macro_hook( bool enable ) LIPP_NOEXCEPT { _findMacroHook = enable; }
+
+	// Minified output has no `#line` directives either, whatever `set_line_directives` says
+	void set_output_mode( output_mode mode ) LIPP_NOEXCEPT { _outputMode = mode; }
+
+	output_mode get_output_mode() const LIPP_NOEXCEPT { return _outputMode; }
+
+	// Whether the output gets `#line` directives, with both settings above applied
+	bool line_directives() const LIPP_NOEXCEPT { return _lineDirectives && _outputMode == output_mode::full; }
+
+	using names_t = name_set<traits_t>;
+
+	// Collects names of macros looked up and paths of files included while enabled, the output depends
+	// only on those and on the initial macros. Enabling clears what was collected before.
+	void record_dependencies( bool enable ) LIPP_NOEXCEPT
+	{
+		if ( enable && !_recordDependencies )
+		{
+			_queriedMacros.clear();
+			_includedFiles.clear();
+			clear( _includeEdges );
+		}
+
+		_recordDependencies = enable;
+	}
+
+	const names_t &queried_macros() const LIPP_NOEXCEPT { return _queriedMacros; }
+
+	const names_t &included_files() const LIPP_NOEXCEPT { return _includedFiles; }
+
+	// One for each include while dependencies are recorded, files are indices of `included_files`
+	struct include_edge
+	{
+		uint32_t from; // `no_file` for files included directly by `include_file`
+		uint32_t to;
+		int line;      // Of the `#include` directive
+	};
+
+	static constexpr uint32_t no_file = UINT32_MAX;
+
+	const vector_t<include_edge> &include_graph() const LIPP_NOEXCEPT { return _includeEdges; }
+
+	// Names of source files and of `#line` directives since the last `reset`, ids are their indices
+	const names_t &file_names() const LIPP_NOEXCEPT { return _fileNames; }
+
+	// Where a range of the output comes from, it lasts up to the next one
+	struct location
+	{
+		size_t offset; // Of the first output character of the range
+		uint32_t file; // Index of `file_names`
+		int line;      // Of that character, every newline in the range is one more
+	};
+
+	// Builds `locations` from the tokens `next_token` returns while enabled. Offsets are counted from the
+	// last `reset` or from enabling, which clears what was collected before.
+	void track_locations( bool enable ) LIPP_NOEXCEPT
+	{
+		if ( enable && !_trackLocations )
+		{
+			clear( _locations );
+			_outputOffset = 0;
+			_outputFile = no_file;
+		}
+
+		_trackLocations = enable;
+	}
+
+	const vector_t<location> &locations() const LIPP_NOEXCEPT { return _locations; }
+
+	// File and line of `offset` in `output`, the text read while locations were tracked. False when the
+	// offset is in front of the first range.
+	bool find_location( string_view_t output, size_t offset, uint32_t &file, int &line ) const LIPP_NOEXCEPT;
+
+	// Processes only directives, so conditionals, macro definitions and includes, text between them is
+	// skipped without being tokenized and no output is produced. With `record_dependencies` enabled,
+	// `included_files` and `include_graph` get the files the input pulls in. Returns false on error.
+	bool scan_dependencies() LIPP_NOEXCEPT;
+
+	// State between two lines of the main source, see `checkpoint_offset`
+	struct checkpoint;
+
+	// Offset in the main source when the next token would be lexed from the end of one of its lines, outside
+	// of included files, macro expansions and comments. State can be saved as a checkpoint then and `resume`
+	// continues from it. `SIZE_MAX` otherwise.
+	size_t checkpoint_offset() const LIPP_NOEXCEPT;
+
+	void save_checkpoint( checkpoint &result ) const LIPP_NOEXCEPT;
+
+	// Same macros, conditional blocks and source name as at the checkpoint, line numbers may differ
+	bool same_state( const checkpoint &other ) const LIPP_NOEXCEPT;
+
+	// Like `reset` and `include_string`, but continues from a checkpoint saved at the same offset of a source
+	// with the same text in front of it. `src` is not copied and must outlive the run.
+	void resume( string_view_t src, const checkpoint &from ) LIPP_NOEXCEPT;
+
+	// Writes macros, open conditional blocks and files included with `#pragma once`, for example after
+	// processing a prelude. The file is only valid for the same build of the library.
+	bool save_state( string_view_t fileName ) LIPP_NOEXCEPT;
+
+	// Like `reset`, then continues from a state written by `save_state`. The file is memory mapped and macros
+	// are used in place until the first `define` or `undef`, so loading does not depend on how many there are.
+	// The mapping lives until the next `load_state` or the destruction of the preprocessor, also when other
+	// preprocessors share these macros.
+	bool load_state( string_view_t fileName ) LIPP_NOEXCEPT;
+
+#if defined(LIPP_STATISTICS)
+	using statistics_t = preprocessor_statistics<traits_t>;
+
+	// Counters since the last `reset`
+	const statistics_t &statistics() const LIPP_NOEXCEPT { return _statistics; }
+#endif
+
+	bool is_inside_true_block() const LIPP_NOEXCEPT { return _trueBlock; }
+
+	string_view_t current_source_name() const LIPP_NOEXCEPT { return _sourceName; }
+
+	// Index of `current_source_name` in `file_names`
+	uint32_t current_file() const LIPP_NOEXCEPT { return _fileId; }
+
+	int current_line_number() const LIPP_NOEXCEPT { return _lineNumber; }
+
+	error_type error() const LIPP_NOEXCEPT { return _error; }
+
+	struct token
+	{
+		token_type type;
+		string_view_t whitespace;
+		string_view_t text;
+	};
+
+	bool next_token( token &result, int flags = parsing_flags::default_parsing_flags ) LIPP_NOEXCEPT;
+
+	string_t read_all() LIPP_NOEXCEPT;
+
+	// Hands every token to `sink( whitespace, text )` as soon as it is produced, instead of collecting
+	// the whole output. Returns false on error.
+	template <class Sink>
+	bool read_all( Sink &&sink ) LIPP_NOEXCEPT;
+
+protected:
+	using derived_t = typename derived_type<Derived, basic_preprocessor>::type;
+
+	derived_t &self() LIPP_NOEXCEPT { return static_cast<derived_t &>( *this ); }
+
+	const derived_t &self() const LIPP_NOEXCEPT { return static_cast<const derived_t &>( *this ); }
+
+	static constexpr size_t char_t_buffer_size = 256;
+	static constexpr size_t expression_inline_size = 16;
+
+	static string_view_t trim( string_view_t s ) LIPP_NOEXCEPT;
+
+	static size_t lex_token( string_view_t src, token_type &type, error_type &error ) LIPP_NOEXCEPT;
+
+	bool parse_next_token( token &result, int flags = parsing_flags::default_parsing_flags ) LIPP_NOEXCEPT;
+
+	void set_error( error_type e ) LIPP_NOEXCEPT { _error = e; }
+
+	// Used for files which cannot be memory mapped
+	bool read_file( string_view_t fileName, string_t &output ) LIPP_NOEXCEPT;
+
+	// Asked by the include directory search once for each candidate path, the include cache keeps the answer
+	bool file_exists( string_view_t fileName ) LIPP_NOEXCEPT { return lipp::file_exists( string_t( fileName ).c_str() ); }
+
+	// Normalized path of an included file, false when the directory search does not find it
+	bool resolve_include( string_view_t fileName, bool isSystemPath, string_t &path ) LIPP_NOEXCEPT;
+
+	int process_unknown_directive( string_view_t /*name*/ ) LIPP_NOEXCEPT { return 1; }
+
+	string_view_t current_text() const LIPP_NOEXCEPT;
+
+	void advance( size_t length ) LIPP_NOEXCEPT { _chunks[lipp::size( _chunks ) - 1].cursor += length; }
+
+	// Zero terminated copy which lives until `reset`
+	string_view_t store_text( string_view_t text ) LIPP_NOEXCEPT;
+
+	// Appends to the text last returned by `store_text` or `append_text`, which usually grows in place
+	void append_text( string_view_t &text, string_view_t tail ) LIPP_NOEXCEPT;
+
+	// Stores the name and resolves the current working directory from it
+	void set_source_name( string_view_t name ) LIPP_NOEXCEPT;
+
+	// `#line N "name"`, source names are not limited by the size of a buffer
+	string_view_t store_line_directive( int lineNumber, string_view_t sourceName ) LIPP_NOEXCEPT;
+
+	void note_macro_query( string_view_t name ) LIPP_NOEXCEPT
+	{
+		if ( _recordDependencies )
+			_queriedMacros.insert( name );
+	}
+
+	// Text is copied unless it comes from the include cache or `copy` is false
+	void push_source( string_view_t text, uint32_t cached = 0, bool copy = true ) LIPP_NOEXCEPT;
+
+	void push_file( string_view_t src, string_view_t sourceName, uint32_t cached ) LIPP_NOEXCEPT;
+
+	void pop_chunk() LIPP_NOEXCEPT;
+
+	void carry_whitespace( string_view_t whitespace ) LIPP_NOEXCEPT;
+
+	void apply_carried_whitespace( token &result ) LIPP_NOEXCEPT;
+
+	bool read_expansion_token( token &result, int flags ) LIPP_NOEXCEPT;
+
+	// Macro expansion and `#if` look names up here. With `set_find_macro_hook` a hidden `find_macro` is asked
+	// instead, a value it returns which is not the one of the table entry comes in `hookValue`. The table
+	// itself never changes.
+	const typename macro_table<T>::entry *lookup_macro( string_view_t name, uint32_t hash, const char_t **hookValue = nullptr ) LIPP_NOEXCEPT;
+
+	bool find_macro_hooked() const LIPP_NOEXCEPT
+	{
+		if constexpr ( !same_type<decltype( &derived_t::find_macro ), decltype( &basic_preprocessor::find_macro )>::value )
+			return _findMacroHook;
+		else
+			return false;
+	}
+
+	// Expands what the `find_macro` hook returned as an object-like macro, from scratch tokens
+	bool expand_hook_value( token &result, string_view_t name, string_view_t value, size_t activeChunks ) LIPP_NOEXCEPT;
+
+	bool expand_identifier( token &result, int flags, size_t activeChunks ) LIPP_NOEXCEPT;
+
+	bool peek_parent_left( bool stopAtEols ) const LIPP_NOEXCEPT;
+
+	bool collect_arguments( const typename macro_table<T>::entry &m, int flags ) LIPP_NOEXCEPT;
+
+	void expand_argument( size_t argIndex ) LIPP_NOEXCEPT;
+
+	void substitute( const typename macro_table<T>::entry &m, size_t argBase, size_t argTextBase ) LIPP_NOEXCEPT;
+
+	macro_token stringize_argument( size_t argIndex, bool leadingSpace ) LIPP_NOEXCEPT;
+
+	void paste_tokens( size_t left, size_t right ) LIPP_NOEXCEPT;
+
+	// Appends tokens separated by spaces, `result` must be the last text allocated from the arena
+	bool concat_remaining_tokens( string_view_t &result ) LIPP_NOEXCEPT;
+
+	bool return_line_directive( token &result ) LIPP_NOEXCEPT;
+
+	// Directive for a file beginning or ending, false when there is none
+	bool take_pending_line( token &result ) LIPP_NOEXCEPT;
+
+	// Shrinks whitespace of a token for minified output, false for tokens which are dropped
+	bool minify( token &result ) LIPP_NOEXCEPT;
+
+	// Text ending with `before` followed by `next` would lex differently when nothing separates them
+	static bool tokens_merge( char_t beforeLast, char_t before, bool afterNumber, string_view_t next ) LIPP_NOEXCEPT;
+
+	void note_location( const token &result ) LIPP_NOEXCEPT;
+
+	bool process_directive( token &result ) LIPP_NOEXCEPT;
+
+	template <typename U> using expression_stack_t = small_stack<U, expression_inline_size, vector_t<U>>;
+
+	struct compiled_expression
+	{
+		expression_stack_t<expression_op> code;
+		names_t names;   // Macros read when the code runs
+		bool isUnsigned; // Type of the result
+	};
+
+	// Reads the rest of the line, macros are expanded and identifiers left after that are zero. Macros
+	// defined to a single integer are read only when the code runs, so it stays valid when they change.
+	bool compile_expression( compiled_expression &expression ) LIPP_NOEXCEPT;
+
+	// False without an error when a macro read by the code is no longer an integer of the same type
+	bool run_expression( const compiled_expression &expression, uintmax_t &value ) LIPP_NOEXCEPT;
+
+	bool macro_value( const typename macro_table<T>::entry &m, uintmax_t &value, bool &isUnsigned ) const LIPP_NOEXCEPT;
+
+	// Compiled `#if` and `#elif` conditions are cached by their text
+	intmax_t evaluate_expression() LIPP_NOEXCEPT;
+
+	// Macro expanded while compiling a condition, which has to be compiled again once it changes
+	struct expression_dependency
+	{
+		string_t name;
+		uint32_t hash;
+		uint32_t stamp; // Zero when it was not defined
+	};
+
+	void add_expression_dependency( string_view_t name, uint32_t stamp ) LIPP_NOEXCEPT;
+
+	struct cached_expression
+	{
+		compiled_expression expression;
+		vector_t<expression_dependency> dependencies;
+		uint32_t stamp;  // Of the macro table when `value` was computed
+		uintmax_t value;
+	};
+
+	bool take_guard_candidate() LIPP_NOEXCEPT;
+
+	void push_conditional( bool value ) LIPP_NOEXCEPT;
+
+	void set_branch( bool value ) LIPP_NOEXCEPT;
+
+	bool check_conditions_closed() LIPP_NOEXCEPT;
+
+	bool parse_after_conditional( token &result ) LIPP_NOEXCEPT;
+
+	enum class chunk_kind : uint8_t
+	{
+		source,    // Text in `_buffers` or in the include cache
+		macro,     // Tokens replayed directly from the macro table
+		expansion, // Substituted tokens in `_expansion`
+		argument,  // Argument tokens in `_argTokens`, being expanded before substitution
+		barrier,   // Stops argument expansion from reading past the argument
+	};
+
+	// Source is kept as a stack of chunks instead of one contiguous string, so both macro expansion
+	// and file inclusion cost O(inserted length) instead of O(remaining source length). Chunks only
+	// store offsets, because buffers may move as they grow.
+	struct source_chunk
+	{
+		chunk_kind kind;
+		uint32_t macro;  // Index + 1 of the expanded macro, it is disabled while the chunk is on the stack
+		uint32_t cached; // Index + 1 of the include cache entry with source text, which is then not copied
+		size_t buffer;   // Index into `_buffers` for other source text
+		size_t cursor;   // Character offset for source text, token index otherwise
+		size_t end;
+		size_t base;     // Expansion: `_expansion` and `_expansionText` are truncated back here when popped
+		size_t textBase;
+	};
+
+	using chunks_t = vector_t<source_chunk>;
+
+	string_view_t chunk_text( const source_chunk &chunk ) const LIPP_NOEXCEPT;
+
+	void finish_file( const source_chunk &chunk ) LIPP_NOEXCEPT;
+
+	// Progress of include guard detection, a file is guarded when its first token starts
+	// `#ifndef X` and the matching `#endif` is followed only by whitespace
+	enum class guard_state : uint8_t
+	{
+		none,            // Not guarded or not a cached file
+		expect_ifndef,   // Nothing but whitespace seen yet
+		ifndef_pending,  // First token was '#', waiting for the directive name
+		inside,          // Inside of the guarding `#ifndef`
+		closed,          // Past its `#endif`
+	};
+
+	// One for each source chunk
+	struct file_state
+	{
+		guard_state guard;
+		size_t guardDepth;      // Depth of `#if` blocks outside of the guard
+		size_t conditionDepth;  // All `#if` blocks opened in the file must be closed in it too
+		string_t guardName;
+		const file_token *replay;       // Tokens recorded by an earlier include, sorted by offset
+		size_t replayCount;
+		size_t replayNext;              // Most likely the next one to be read
+		vector_t<file_token> recorded;  // Published to the include cache when the file ends
+		bool recording;
+		uint32_t includedFile;          // Index + 1 into `_includedFiles` while dependencies are recorded
+		bool returns;                   // Included, the location below is restored when it ends
+		bool endsWithNewline;
+		int returnLine;
+		uint32_t returnFile;
+	};
+
+	const file_token *find_replay_token( file_state &file, size_t offset ) LIPP_NOEXCEPT;
+
+	void record_token( file_state &file, size_t offset, size_t whitespace, int lines, size_t length, token_type type ) LIPP_NOEXCEPT;
+
+	const macro_token &expansion_token( const source_chunk &chunk, size_t index ) const LIPP_NOEXCEPT
+	{
+		return chunk.kind == chunk_kind::macro    ? _macros.token( index ) :
+		       chunk.kind == chunk_kind::argument ? _argTokens[index] : _expansion[index];
+	}
+
+	string_view_t expansion_text( const macro_token &t ) const LIPP_NOEXCEPT
+	{
+		return ( t.flags & macro_token::pooled ) ? _macros.text( t )
+		                                         : lipp::substr( string_view_t( _expansionText ), t.offset, t.length );
+	}
+
+	macros_t _macros;
+
+	using arena_t = typename traits_t::arena_t;
+
+	// Text of the current run: source given as strings, `#line` chunks, and text of directives returned as tokens
+	arena_t _arena;
+
+	vector_t<string_view_t> _buffers;
+
+	chunks_t _chunks;
+
+	vector_t<file_state> _files;
+
+	// Cache entries of files with `#pragma once`, which were already included in this run
+	vector_t<uint32_t> _onceIncluded;
+
+	// Guard of the file `include_file` is looking at, copied out of the shared cache
+	string_t _includeGuard = string_t();
+
+	include_cache_t _ownIncludeCache;
+
+	include_cache_t *_includeCache = nullptr;
+
+	bool _tokenReplay = false;
+
+	bool _recordDependencies = false;
+
+	static constexpr uint32_t state_magic = 0x53505043; // "CPPS"
+	static constexpr uint32_t state_version = 1;
+
+	struct state_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t conditionCount;
+		uint32_t onceCount;
+	};
+
+	void release_state() LIPP_NOEXCEPT;
+
+	// Loaded state, either mapped or read when it cannot be mapped
+	const void *_stateMapping = nullptr;
+
+	size_t _stateMappingLength = 0;
+
+	vector_t<uint64_t> _stateContent;
+
+	names_t _queriedMacros;
+
+	names_t _includedFiles;
+
+	vector_t<include_edge> _includeEdges;
+
+	bool _scanning = false;
+
+	// Include directories with a trailing '/'
+	vector_t<string_t> _userDirectories;
+
+	vector_t<string_t> _systemDirectories;
+
+	// Search results by directory of the including file (empty for <...> includes) and name, paths of
+	// files that were not found are empty. Kept across `reset` like the include cache.
+	names_t _includeLookups;
+
+	vector_t<string_t> _includeLookupPaths;
+
+#if defined(LIPP_STATISTICS)
+	mutable statistics_t _statistics; // Lookups are counted in const `find_macro` too
+#endif
+
+	bool _findMacroHook = false;
+
+	// Entry the last `find_macro` of this class returned the value of, see `lookup_macro`
+	mutable const typename macro_table<T>::entry *_foundMacro = nullptr;
+
+	// Names expanded from values of the `find_macro` hook, chunks disable them by `hook_macro | index`
+	names_t _hookNames;
+
+	static constexpr uint32_t hook_macro = 0x80000000u;
+
+	// Keys of `_expressions`
+	names_t _expressionTexts;
+
+	vector_t<cached_expression> _expressions;
+
+	// Set while a condition is compiled
+	vector_t<expression_dependency> *_expressionDependencies = nullptr;
+
+	bool _deferredValue = false;
+
+	vector_t<macro_token> _expansion;
+
+	string_t _expansionText = string_t();
+
+	// Scratch storage for macro definition
+	vector_t<string_view_t> _params;
+
+	vector_t<macro_token> _defineTokens;
+
+	// Token ranges in `_argTokens`, the expanded one is filled only for parameters that are not operands of '#' or '##'
+	struct argument_range
+	{
+		size_t begin;
+		size_t end;
+		size_t expandedBegin;
+		size_t expandedEnd;
+	};
+
+	// Arguments of nested invocations are stacked on top of each other while arguments get expanded
+	vector_t<argument_range> _args;
+
+	vector_t<macro_token> _argTokens;
+
+	string_t _argText = string_t();
+
+	string_t _pasteText = string_t();
+
+	string_t _whitespace = string_t();
+
+	string_view_t _sourceName = string_view_t(); // Zero terminated
+
+	string_view_t _cwd = string_view_t();
+
+	uint32_t _fileId = no_file;
+
+	names_t _fileNames;
+
+	vector_t<string_view_t> _fileNameTexts; // Zero terminated copies of `_fileNames` in the arena
+
+	// `#line` for a location change, returned by the next `parse_next_token`, and the newline following it
+	enum class pending_line : uint8_t
+	{
+		none,
+		directive,
+		newline_directive, // After an included file not ending with a newline
+		newline,
+	};
+
+	pending_line _pendingLine = pending_line::none;
+
+	bool _lineDirectives = true;
+
+	output_mode _outputMode = output_mode::full;
+
+	// Last two characters of the minified output, and whether they end a pp-number, which may span
+	// several tokens written together, like "0x1" "p"
+	char_t _minifiedTail[2] = { };
+	bool _minifiedNumber = false;
+
+	int _minifiedLine = 1; // Line of the output in `output_mode::minified_lines`
+
+	string_t _minifiedWhitespace = string_t();
+
+	bool _trackLocations = false;
+
+	vector_t<location> _locations;
+
+	size_t _outputOffset = 0;
+
+	uint32_t _outputFile = no_file; // Location the next output character would have without a new range
+	int _outputLine = 0;
+
+	int _lineNumber = 0;
+
+	error_type _error = error_type::none;
+
+	// One for each open `#if` block
+	struct conditional
+	{
+		int line;          // Of the opening directive
+		bool active;       // Current branch is the taken one
+		bool taken;        // One of the branches was already taken
+		bool parentActive;
+	};
+
+	static bool is_active( const conditional &c ) LIPP_NOEXCEPT { return c.active && c.parentActive; }
+
+	vector_t<conditional> _conditions;
+
+	// All conditions are active, kept up to date because it is checked for every token
+	bool _trueBlock = true;
+
+	bool _insideCommentBlock = false;
+
+	bool _carryWhitespace = false;
+
+public:
+	// Declared up front, defined after `conditional`
+	struct checkpoint
+	{
+		size_t offset = 0;
+		int lineNumber = 0;
+		bool trueBlock = true;
+		string_t sourceName = string_t();
+		macros_t macros;
+		vector_t<conditional> conditions;
+		vector_t<uint32_t> onceIncluded; // Include cache entries, so the cache must be the same when resuming
+	};
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT
+{
+	name = trim( name );
+	value = trim( value );
+
+	size_t nameLength = scan_identifier( data( name ), lipp::size( name ) );
+	uint8_t flags = 0;
+
+	clear( _params );
+	clear( _defineTokens );
+
+	// Function-like macro, name is followed by parameter list: "NAME(a, b, ...)"
+	if ( nameLength < lipp::size( name ) )
+	{
+		auto params = lipp::substr( name, nameLength );
+		if ( lipp::char_at( params, 0 ) != '(' || lipp::char_at( params, lipp::size( params ) - 1 ) != ')' )
+		{
+			self().set_error( error_type::syntax_error );
+			return false;
+		}
+
+		flags |= macro_flags::function_like | macro_flags::substitute;
+		params = trim( lipp::substr( params, 1, lipp::size( params ) - 2 ) );
+
+		for ( size_t i = 0, S = lipp::size( params ); i < S; )
+		{
+			if ( flags & macro_flags::variadic )
+			{
+				self().set_error( error_type::syntax_error );
+				return false;
+			}
+
+			auto param = lipp::substr( params, i );
+
+			if ( size_t length = scan_identifier( data( param ), lipp::size( param ) ); length )
+			{
+				// A name used twice, "(a, a)"
+				for ( const auto &p : _params )
+				{
+					if ( p == lipp::substr( param, 0, length ) )
+					{
+						self().set_error( error_type::syntax_error );
+						return false;
+					}
+				}
+
+				push_back( _params, lipp::substr( param, 0, length ) );
+			}
+			else if ( lipp::substr( param, 0, 3 ) == "..." )
+			{
+				push_back( _params, string_view_t( "__VA_ARGS__" ) );
+				flags |= macro_flags::variadic;
+			}
+			else
+			{
+				self().set_error( error_type::syntax_error );
+				return false;
+			}
+
+			i += ( flags & macro_flags::variadic ) ? 3 : lipp::size( _params[lipp::size( _params ) - 1] );
+			while ( i < S && ( params[i] == ',' || ( char_class_of( params[i] ) & char_class::blank ) ) )
+				++i;
+		}
+
+		name = lipp::substr( name, 0, nameLength );
+	}
+
+	// Pre-tokenize the value, so expansion never has to lex it again
+	for ( size_t i = 0, S = lipp::size( value ); i < S; )
+	{
+		int lines = 0;
+		bool insideCommentBlock = false, stoppedAtEol = false;
+
+		size_t whitespaceLength = skip_whitespace( data( value ) + i, S - i, false, lines, insideCommentBlock, stoppedAtEol );
+		if ( ( i += whitespaceLength ) >= S )
+			break;
+
+		macro_token mt = { token_type::unknown, uint8_t( whitespaceLength ? macro_token::leading_space : 0 ), 0, uint32_t( i ), 0 };
+
+		error_type error = error_type::none;
+		mt.length = uint32_t( lex_token( lipp::substr( value, i ), mt.type, error ) );
+		if ( !mt.length )
+		{
+			self().set_error( error );
+			return false;
+		}
+
+		i += mt.length;
+
+		if ( mt.type == token_type::hash_hash && lipp::size( _defineTokens ) )
+		{
+			_defineTokens[lipp::size( _defineTokens ) - 1].flags |= macro_token::paste;
+			flags |= macro_flags::substitute;
+			continue;
+		}
+
+		if ( mt.type == token_type::identifier )
+		{
+			auto text = lipp::substr( value, mt.offset, mt.length );
+
+			for ( size_t p = 0, P = lipp::size( _params ); p < P; ++p )
+			{
+				if ( _params[p] == text )
+				{
+					mt.flags |= macro_token::parameter;
+					mt.param = uint16_t( p );
+					break;
+				}
+			}
+
+			// '#' followed by a parameter turns into a string literal
+			if ( ( mt.flags & macro_token::parameter ) && lipp::size( _defineTokens ) )
+			{
+				const auto &prev = _defineTokens[lipp::size( _defineTokens ) - 1];
+
+				if ( prev.type == token_type::directive )
+				{
+					mt.flags = uint8_t( ( mt.flags & ~macro_token::leading_space ) | macro_token::stringize | ( prev.flags & macro_token::leading_space ) );
+					pop_back( _defineTokens );
+				}
+			}
+		}
+
+		push_back( _defineTokens, mt );
+	}
+
+	return _macros.define( name, value,
+	                       lipp::size( _defineTokens ) ? &_defineTokens[0] : nullptr, lipp::size( _defineTokens ),
+	                       lipp::size( _params ), flags );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::undef( string_view_t name ) LIPP_NOEXCEPT
+{
+	return _macros.undef( name );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline const typename T::char_t *basic_preprocessor<T, D>::find_macro( string_view_t name ) const LIPP_NOEXCEPT
+{
+#if defined(LIPP_STATISTICS)
+	_statistics.macroLookups++;
+#endif
+
+	const auto *m = _foundMacro = _macros.find( name );
+	return m ? _macros.c_value( *m ) : nullptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::reset() LIPP_NOEXCEPT
+{
+	_macros.clear();
+	clear( _buffers );
+	clear( _chunks );
+	clear( _files );
+	clear( _onceIncluded );
+	clear( _expansion );
+	_expansionText = string_t();
+	_whitespace = string_t();
+	_sourceName = string_view_t();
+	_cwd = string_view_t();
+	_fileId = no_file;
+	_fileNames.clear();
+	clear( _fileNameTexts );
+	_pendingLine = pending_line::none;
+	_minifiedTail[0] = _minifiedTail[1] = 0;
+	_minifiedNumber = false;
+	_minifiedLine = 1;
+	clear( _locations );
+	_outputOffset = 0;
+	_outputFile = no_file;
+	_lineNumber = 0;
+	_error = error_type::none;
+	clear( _conditions );
+	_trueBlock = true;
+	_insideCommentBlock = false;
+	_carryWhitespace = false;
+	_queriedMacros.clear();
+	_includedFiles.clear();
+	clear( _includeEdges );
+	_expressionTexts.clear();
+	clear( _expressions );
+	_hookNames.clear();
+	_arena.reset();
+
+#if defined(LIPP_STATISTICS)
+	_statistics.clear();
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::include_string( string_view_t src, string_view_t sourceName ) LIPP_NOEXCEPT
+{
+	if ( !lipp::size( src ) )
+		return true;
+
+	push_file( src, sourceName, 0 );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::include_file( string_view_t fileName, bool isSystemPath ) LIPP_NOEXCEPT
+{
+	string_t path;
+
+	if ( !resolve_include( fileName, isSystemPath, path ) )
+	{
+		self().set_error( error_type::read_failed );
+		return false;
+	}
+
+	uint32_t includedFile = 0;
+
+	if ( _recordDependencies )
+	{
+		uint32_t from = no_file;
+		for ( size_t i = lipp::size( _files ); i-- > 0 && from == no_file; )
+			from = _files[i].includedFile ? _files[i].includedFile - 1 : no_file;
+
+		_includedFiles.insert( path );
+		includedFile = uint32_t( _includedFiles.find( path ) ) + 1;
+		push_back( _includeEdges, { from, includedFile - 1, lipp::size( _files ) ? _lineNumber : 0 } );
+	}
+
+#if defined(LIPP_STATISTICS)
+	_statistics.count_include( path );
+#endif
+
+	auto &cache = get_include_cache();
+	uint32_t index = 0;
+	bool pragmaOnce = false, loaded = false, hashed = false;
+	const vector_t<file_token> *replay = nullptr;
+
+	// The lock is held only to look at and publish the entry, hooks and file reads run without it
+	{
+		scoped_lock<include_cache_t> lock( cache );
+		index = cache.find_or_insert( path );
+
+		const auto &e = cache[index];
+		pragmaOnce = e.pragmaOnce;
+		loaded = e.loaded;
+		hashed = e.hashed;
+		_includeGuard = e.guard;
+	}
+
+	if ( pragmaOnce )
+	{
+		for ( size_t i = 0, S = lipp::size( _onceIncluded ); i < S; ++i )
+		{
+			if ( _onceIncluded[i] == index )
+				return true;
+		}
+	}
+
+	// Guarded file would expand to nothing, so it is not even read again
+	if ( lipp::size( _includeGuard ) )
+	{
+		note_macro_query( _includeGuard );
+
+		if ( self().find_macro( _includeGuard ) )
+			return true;
+	}
+
+	if ( !loaded )
+	{
+		typename include_cache_t::loaded_file file;
+
+		if ( !include_cache_t::map( path, file ) && !self().read_file( path, file.content ) )
+		{
+			if ( _error == error_type::none )
+				self().set_error( error_type::read_failed );
+
+			return false;
+		}
+
+		scoped_lock<include_cache_t> lock( cache );
+		cache.publish_file( index, file );
+		hashed = cache[index].hashed;
+	}
+
+	if ( _tokenReplay )
+	{
+		// Loaded text is only read, hashing it needs no lock
+		uint64_t hash = hashed ? 0 : hash_content( cache[index].text() );
+
+		scoped_lock<include_cache_t> lock( cache );
+		cache.set_content_hash( index, hash );
+		replay = cache.recorded_tokens( index );
+	}
+
+	if ( !lipp::size( cache[index].text() ) )
+		return true;
+
+	push_file( cache[index].text(), path, index + 1 );
+
+	auto &file = _files[lipp::size( _files ) - 1];
+	file.includedFile = includedFile;
+
+	// A scan skips most of the tokens, recording them would leave gaps
+	if ( _tokenReplay )
+	{
+		file.replay = replay ? &( *replay )[0] : nullptr;
+		file.replayCount = replay ? lipp::size( *replay ) : 0;
+		file.recording = !replay && !_scanning;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::add_include_directory( string_view_t directory, bool isSystem ) LIPP_NOEXCEPT
+{
+	string_t dir( directory );
+	normalize_path( dir );
+
+	if ( lipp::size( dir ) && dir[lipp::size( dir ) - 1] != '/' )
+		dir += "/";
+
+	push_back( isSystem ? _systemDirectories : _userDirectories, dir );
+
+	_includeLookups.clear();
+	clear( _includeLookupPaths );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::clear_include_directories() LIPP_NOEXCEPT
+{
+	clear( _userDirectories );
+	clear( _systemDirectories );
+
+	_includeLookups.clear();
+	clear( _includeLookupPaths );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::resolve_include( string_view_t fileName, bool isSystemPath, string_t &path ) LIPP_NOEXCEPT
+{
+	bool isAbsolute = lipp::size( fileName ) && ( fileName[0] == '/' || fileName[0] == '\\' ||
+	                                              ( lipp::size( fileName ) > 1 && fileName[1] == ':' ) );
+
+	size_t userCount = lipp::size( _userDirectories );
+	size_t directoryCount = userCount + lipp::size( _systemDirectories );
+
+	path = string_t();
+
+	if ( !isSystemPath && !isAbsolute && lipp::size( _cwd ) )
+	{
+		path = _cwd;
+		path += "/";
+	}
+
+	path += fileName;
+
+	if ( isAbsolute || !directoryCount )
+	{
+		normalize_path( path );
+		return true;
+	}
+
+	// Key is the unnormalized "cwd/name" or "<name", same name from the same directory resolves the same way
+	if ( isSystemPath )
+	{
+		path = "<";
+		path += fileName;
+	}
+
+	if ( size_t index = _includeLookups.find( path ); index < _includeLookups.size() )
+	{
+		path = _includeLookupPaths[index];
+		return lipp::size( path ) > 0;
+	}
+
+	_includeLookups.insert( path );
+	push_back( _includeLookupPaths, string_t() );
+	auto &found = _includeLookupPaths[lipp::size( _includeLookupPaths ) - 1];
+
+	auto &cache = get_include_cache();
+
+	// Like reads in `include_file`, the `file_exists` hook runs without the lock
+	auto exists = [this, &cache]( string_t &candidate )
+	{
+		normalize_path( candidate );
+		uint32_t index = 0;
+
+		{
+			scoped_lock<include_cache_t> lock( cache );
+			index = cache.find_or_insert( candidate );
+
+			if ( const auto &e = cache[index]; e.checked || e.loaded )
+				return e.loaded || e.exists;
+		}
+
+		bool found = self().file_exists( candidate );
+
+		scoped_lock<include_cache_t> lock( cache );
+		auto &e = cache[index];
+
+		if ( !e.checked )
+		{
+			e.exists = e.loaded || found;
+			e.checked = true;
+		}
+
+		return e.exists;
+	};
+
+	if ( !isSystemPath && exists( path ) )
+	{
+		found = path;
+		return true;
+	}
+
+	for ( size_t i = 0; i < directoryCount; ++i )
+	{
+		path = i < userCount ? _userDirectories[i] : _systemDirectories[i - userCount];
+		path += fileName;
+
+		if ( exists( path ) )
+		{
+			found = path;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::read_file( string_view_t fileName, string_t &output ) LIPP_NOEXCEPT
+{
+	// Whole file in one read into a buffer of the right size
+	if ( FILE *file = fopen( string_t( fileName ).c_str(), "rb" ); file )
+	{
+		long length = fseek( file, 0, SEEK_END ) == 0 ? ftell( file ) : -1;
+		bool ok = length >= 0 && fseek( file, 0, SEEK_SET ) == 0;
+
+		if ( ok )
+		{
+			resize( output, size_t( length ) / sizeof( char_t ) );
+			ok = !lipp::size( output ) || fread( &output[0], sizeof( char_t ), lipp::size( output ), file ) == lipp::size( output );
+		}
+
+		fclose( file );
+
+		if ( ok )
+			return true;
+	}
+
+	self().set_error( error_type::read_failed );
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline
+typename T::string_view_t basic_preprocessor<T, D>::trim( string_view_t s ) LIPP_NOEXCEPT
+{
+	size_t start = 0;
+	size_t end = lipp::size( s );
+
+	while ( start < end && s[start] <= 32 ) ++start;
+	while ( end > start && s[end - 1] <= 32 ) --end;
+
+	return ( start < end ) ? lipp::substr( s, start, end - start ) : string_view_t();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline typename T::string_view_t basic_preprocessor<T, D>::current_text() const LIPP_NOEXCEPT
+{
+	if ( !lipp::size( _chunks ) || _chunks[lipp::size( _chunks ) - 1].kind != chunk_kind::source )
+		return string_view_t();
+
+	const auto &chunk = _chunks[lipp::size( _chunks ) - 1];
+	return lipp::substr( chunk_text( chunk ), chunk.cursor, chunk.end - chunk.cursor );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline typename T::string_view_t basic_preprocessor<T, D>::store_text( string_view_t text ) LIPP_NOEXCEPT
+{
+	size_t length = lipp::size( text );
+	char_t *result = _arena.allocate( length + 1 );
+
+	if ( length )
+		memcpy( result, data( text ), length * sizeof( char_t ) );
+
+	result[length] = 0;
+	return string_view_t( result, length );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::append_text( string_view_t &text, string_view_t tail ) LIPP_NOEXCEPT
+{
+	size_t length = lipp::size( text ), tailLength = lipp::size( tail );
+	char_t *result = _arena.grow( data( text ), length + 1, length + tailLength + 1 );
+
+	if ( tailLength )
+		memcpy( result + length, data( tail ), tailLength * sizeof( char_t ) );
+
+	result[length + tailLength] = 0;
+	text = string_view_t( result, length + tailLength );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline typename T::string_view_t basic_preprocessor<T, D>::chunk_text( const source_chunk &chunk ) const LIPP_NOEXCEPT
+{
+	// Cache entries may move as the cache grows, so views are never kept
+	if ( chunk.cached )
+		return ( _includeCache ? *_includeCache : _ownIncludeCache )[chunk.cached - 1].text();
+
+	return _buffers[chunk.buffer];
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::push_source( string_view_t text, uint32_t cached, bool copy ) LIPP_NOEXCEPT
+{
+	if ( !cached )
+		push_back( _buffers, copy ? store_text( text ) : text );
+
+	push_back( _chunks, { chunk_kind::source, 0, cached, cached ? 0 : lipp::size( _buffers ) - 1, 0, lipp::size( text ), 0, 0 } );
+
+	// Blocks restored by `load_state` are closed by the main source
+	push_back( _files, { cached ? guard_state::expect_ifndef : guard_state::none, 0, lipp::size( _files ) ? lipp::size( _conditions ) : 0, string_t(),
+	                     nullptr, 0, 0, vector_t<file_token>(), false, 0u, false, false, 0, no_file } );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::set_source_name( string_view_t name ) LIPP_NOEXCEPT
+{
+	size_t id = _fileNames.find( name );
+
+	if ( id == _fileNames.size() )
+	{
+		_fileNames.insert( name );
+		push_back( _fileNameTexts, store_text( name ) );
+	}
+
+	_fileId = uint32_t( id );
+	_sourceName = _fileNameTexts[id];
+
+	size_t slashPos = lipp::size( _sourceName ) - 1;
+	while ( slashPos < lipp::size( _sourceName ) && _sourceName[slashPos] != '/' && _sourceName[slashPos] != '\\' )
+		--slashPos;
+
+	if ( slashPos < lipp::size( _sourceName ) )
+		_cwd = substr( _sourceName, 0, slashPos );
+	else
+		_cwd = string_view_t();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline typename T::string_view_t basic_preprocessor<T, D>::store_line_directive( int lineNumber,
+                                                                                          string_view_t sourceName ) LIPP_NOEXCEPT
+{
+	char_t buff[32] = { };
+	LIPP_SPRINTF( buff, "#line %d \"", lineNumber );
+
+	auto text = store_text( buff );
+	append_text( text, sourceName );
+	append_text( text, "\"" );
+	return text;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::push_file( string_view_t src, string_view_t sourceName, uint32_t cached ) LIPP_NOEXCEPT
+{
+	bool returns = !!lipp::size( _chunks );
+	int returnLine = _lineNumber;
+	uint32_t returnFile = _fileId;
+
+	push_source( src, cached );
+
+	// Location of the includer comes back when the file ends, see `pop_chunk`
+	auto &file = _files[lipp::size( _files ) - 1];
+	file.returns = returns;
+	file.endsWithNewline = src[lipp::size( src ) - 1] == '\n';
+	file.returnLine = returnLine;
+	file.returnFile = returnFile;
+
+#if defined(LIPP_STATISTICS)
+	_statistics.enter_file( sourceName, lipp::size( _chunks ) - 1 );
+#endif
+
+	set_source_name( sourceName );
+	_lineNumber = 1;
+	_pendingLine = line_directives() ? pending_line::directive : pending_line::none;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::pop_chunk() LIPP_NOEXCEPT
+{
+	auto chunk = _chunks[lipp::size( _chunks ) - 1];
+
+#if defined(LIPP_STATISTICS)
+	if ( lipp::size( _chunks ) > _statistics.peakChunkDepth )
+		_statistics.peakChunkDepth = lipp::size( _chunks );
+
+	if ( lipp::size( _expansionText ) > _statistics.peakExpansionText )
+		_statistics.peakExpansionText = lipp::size( _expansionText );
+#endif
+
+	pop_back( _chunks );
+
+	if ( chunk.kind == chunk_kind::source )
+	{
+		finish_file( chunk );
+
+		if ( const auto &file = _files[lipp::size( _files ) - 1]; file.returns )
+		{
+			if ( file.returnFile != no_file )
+				set_source_name( _fileNameTexts[file.returnFile] );
+
+			_lineNumber = file.returnLine;
+
+			if ( line_directives() )
+				_pendingLine = file.endsWithNewline ? pending_line::directive : pending_line::newline_directive;
+		}
+
+		pop_back( _files );
+
+		if ( !chunk.cached )
+			pop_back( _buffers );
+
+#if defined(LIPP_STATISTICS)
+		_statistics.arenaCapacity = _arena.capacity();
+		_statistics.leave_file( lipp::size( _chunks ) );
+#endif
+	}
+	else if ( chunk.kind == chunk_kind::expansion )
+	{
+		resize( _expansion, chunk.base );
+		resize( _expansionText, chunk.textBase );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::carry_whitespace( string_view_t whitespace ) LIPP_NOEXCEPT
+{
+	if ( !_carryWhitespace )
+	{
+		_carryWhitespace = true;
+
+		// Whitespace of the last returned token might already live in the carry buffer
+		if ( lipp::size( whitespace ) && data( whitespace ) == data( _whitespace ) )
+			return;
+
+		clear( _whitespace );
+	}
+
+	_whitespace += whitespace;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::apply_carried_whitespace( token &result ) LIPP_NOEXCEPT
+{
+	if ( _carryWhitespace )
+	{
+		_whitespace += result.whitespace;
+		result.whitespace = _whitespace;
+		_carryWhitespace = false;
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::next_token( token &result, int flags ) LIPP_NOEXCEPT
+{
+	result = token();
+
+#if defined(LIPP_STATISTICS)
+	_statistics.resume();
+
+	bool produced = false;
+	while ( !produced && parse_next_token( result, flags ) )
+		produced = is_inside_true_block() && ( _outputMode == output_mode::full || minify( result ) );
+
+	if ( produced && _trackLocations )
+		note_location( result );
+
+	_statistics.tokensEmitted += produced;
+	_statistics.pause();
+	return produced;
+#else
+	while ( parse_next_token( result, flags ) )
+	{
+		if ( is_inside_true_block() && ( _outputMode == output_mode::full || minify( result ) ) )
+		{
+			if ( _trackLocations )
+				note_location( result );
+
+			return true;
+		}
+	}
+
+	return false;
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline size_t basic_preprocessor<T, D>::lex_token( string_view_t src, token_type &type, error_type &error ) LIPP_NOEXCEPT
+{
+	type = token_type::unknown;
+
+	size_t tokenLength = 1;
+
+	auto isDigitOrDot = []( char_t c ) { return ( char_class_of( c ) & char_class::digit ) || c == '.'; };
+
+	/**/ if ( auto ch = lipp::char_at( src, 0 ); ch == '#' )
+	{
+		if ( lipp::char_at( src, 1 ) == '#' )
+		{
+			type = token_type::hash_hash;
+			++tokenLength;
+		}
+		else
+			type = token_type::directive;
+	}
+	else if ( char_class_of( ch ) & char_class::alpha )
+	{
+		type = token_type::identifier;
+		tokenLength += scan_identifier( data( src ) + 1, lipp::size( src ) - 1 );
+	}
+	else if ( char_class_of( ch ) & char_class::digit )
+	{
+		type = token_type::number;
+		auto lastChar = ch;
+		bool containsDot = false;
+		bool containsExponent = false;
+
+		auto isHexDigit = []( char_t c ) { return ( c >= '0' && c <= '9' ) || ( c >= 'a' && c <= 'f' ) || ( c >= 'A' && c <= 'F' ); };
+		auto isIntegerSuffix = []( char_t c ) { return c == 'u' || c == 'U' || c == 'l' || c == 'L'; };
+
+		if ( ch == '0' && ( lipp::char_at( src, 1 ) == 'x' || lipp::char_at( src, 1 ) == 'X' ) && isHexDigit( lipp::char_at( src, 2 ) ) )
+		{
+			for ( tokenLength = 3; tokenLength < lipp::size( src ) && isHexDigit( src[tokenLength] ); ++tokenLength ) { }
+
+			while ( tokenLength < lipp::size( src ) && isIntegerSuffix( src[tokenLength] ) )
+				++tokenLength;
+
+			return tokenLength;
+		}
+
+		while ( tokenLength < lipp::size( src ) )
+		{
+			auto ch = src[tokenLength];
+
+			/**/ if ( ch == 'e' && isDigitOrDot( lastChar ) )
+			{
+				if ( containsExponent )
+				{
+					error = error_type::syntax_error;
+					return 0;
+				}
+
+				containsExponent = true;
+			}
+			else if ( ch == '+' || ch == '-' )
+			{
+				if ( lastChar != 'e' )
+					break;
+			}
+			else if ( ch == '.' && ( ( char_class_of( lastChar ) & char_class::digit ) || lastChar == '+' || lastChar == '-' ) )
+			{
+				if ( containsDot )
+				{
+					error = error_type::syntax_error;
+					return 0;
+				}
+
+				containsDot = true;
+			}
+			else if ( ch == 'f' )
+			{
+				if ( !isDigitOrDot( lastChar ) )
+				{
+					error = error_type::syntax_error;
+					return 0;
+				}
+
+				break;
+			}
+			else if ( !( char_class_of( ch ) & char_class::digit ) )
+				break;
+
+			lastChar = ch;
+			++tokenLength;
+		}
+
+		if ( !containsDot && !containsExponent )
+		{
+			while ( tokenLength < lipp::size( src ) && isIntegerSuffix( src[tokenLength] ) )
+				++tokenLength;
+		}
+	}
+	else if ( char_class_of( ch ) & char_class::quote )
+	{
+		type = token_type::string;
+
+		while ( tokenLength < lipp::size( src ) )
+		{
+			auto c = src[tokenLength++];
+			if ( ch == c )
+				break;
+
+			// Escaped character, also a backslash, never ends the literal
+			if ( c == '\\' && tokenLength < lipp::size( src ) )
+				++tokenLength;
+		}
+
+		if ( tokenLength < 2 || src[tokenLength - 1] != ch )
+		{
+			error = error_type::invalid_string;
+			return 0;
+		}
+	}
+	else if ( char_class_of( ch ) & char_class::punct )
+	{
+		auto secondChar = lipp::char_at( src, 1 );
+
+		/**/ if ( ch == '(' ) type = token_type::parent_left;
+		else if ( ch == ')' ) type = token_type::parent_right;
+		else if ( ch == '{' ) type = token_type::brace_left;
+		else if ( ch == '}' ) type = token_type::brace_right;
+		else if ( ch == '+' ) type = token_type::add;
+		else if ( ch == '-' ) type = token_type::subtract;
+		else if ( ch == '/' ) type = token_type::divide;
+		else if ( ch == '*' ) type = token_type::multiply;
+		else if ( ch == ';' ) type = token_type::semicolon;
+		else if ( ch == ',' ) type = token_type::comma;
+		else if ( ch == '.' && secondChar == '.' && lipp::char_at( src, 2 ) == '.' )
+		{
+			type = token_type::ellipsis;
+			tokenLength += 2;
+		}
+		else if ( ch == '&' && secondChar == '&' )
+		{
+			type = token_type::logical_and;
+			++tokenLength;
+		}
+		else if ( ch == '|' && secondChar == '|' )
+		{
+			type = token_type::logical_or;
+			++tokenLength;
+		}
+		else if ( ch == '<' && secondChar == '<' )
+		{
+			type = token_type::shift_left;
+			++tokenLength;
+		}
+		else if ( ch == '>' && secondChar == '>' )
+		{
+			type = token_type::shift_right;
+			++tokenLength;
+		}
+		else if ( ch == '=' && secondChar == '=' )
+		{
+			type = token_type::equal;
+			++tokenLength;
+		}
+		else if ( ch == '!' && secondChar == '=' )
+		{
+			type = token_type::not_equal;
+			++tokenLength;
+		}
+		else if ( ch == '<' && secondChar == '=' )
+		{
+			type = token_type::less_equal;
+			++tokenLength;
+		}
+		else if ( ch == '>' && secondChar == '=' )
+		{
+			type = token_type::greater_equal;
+			++tokenLength;
+		}
+		else if ( ch == '!' ) type = token_type::logical_not;
+		else if ( ch == '<' ) type = token_type::less;
+		else if ( ch == '>' ) type = token_type::greater;
+		else if ( ch == '=' ) type = token_type::assign;
+		else if ( ch == '%' ) type = token_type::modulo;
+		else if ( ch == '&' ) type = token_type::bit_and;
+		else if ( ch == '|' ) type = token_type::bit_or;
+		else if ( ch == '^' ) type = token_type::bit_xor;
+		else if ( ch == '~' ) type = token_type::bit_not;
+		else if ( ch == '?' ) type = token_type::question;
+		else if ( ch == ':' ) type = token_type::colon;
+	}
+
+
+	return tokenLength;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::parse_next_token( token &result, int flags ) LIPP_NOEXCEPT
+{
+	if ( !lipp::size( _chunks ) )
+	{
+		result.type = token_type::eof;
+		return false;
+	}
+
+	string_view_t src;
+	size_t whitespaceLength = 0;
+	bool prevInsideCommentBlock = _insideCommentBlock;
+	bool stopAtEols = !!( flags & parsing_flags::stop_at_eols );
+	const file_token *replayed = nullptr;
+	size_t offset = 0;
+	int lineNumber = 0;
+
+	for ( ;; )
+	{
+		if ( _pendingLine != pending_line::none && take_pending_line( result ) )
+			return true;
+
+		const auto &chunk = _chunks[lipp::size( _chunks ) - 1];
+
+		if ( chunk.kind == chunk_kind::barrier )
+		{
+			result.type = token_type::eof;
+			return false;
+		}
+		else if ( chunk.kind != chunk_kind::source )
+		{
+			// End of macro expansion is transparent
+			if ( chunk.cursor < chunk.end )
+				return read_expansion_token( result, flags );
+		}
+		else
+		{
+			src = current_text();
+			offset = chunk.cursor;
+			lineNumber = _lineNumber;
+
+			if ( auto &file = _files[lipp::size( _files ) - 1]; file.replay && !_insideCommentBlock )
+			{
+				if ( replayed = find_replay_token( file, offset ); replayed )
+				{
+					if ( stopAtEols && ( replayed->flags & file_token::end_of_line ) )
+						return false;
+
+					whitespaceLength = replayed->whitespace;
+					_lineNumber += replayed->lines;
+					break;
+				}
+			}
+
+			bool stoppedAtEol = false;
+			whitespaceLength = skip_whitespace( data( src ), lipp::size( src ), stopAtEols, _lineNumber, _insideCommentBlock, stoppedAtEol );
+
+			if ( stoppedAtEol )
+			{
+				_insideCommentBlock = prevInsideCommentBlock;
+				return false;
+			}
+
+			if ( whitespaceLength < lipp::size( src ) || lipp::size( _chunks ) < 2 )
+				break;
+
+			// End of an included file behaves like an end of line
+			if ( stopAtEols )
+				break;
+
+			if ( !check_conditions_closed() )
+				return false;
+
+			carry_whitespace( src );
+		}
+
+		pop_chunk();
+	}
+
+	if ( stopAtEols && whitespaceLength == lipp::size( src ) )
+	{
+		_insideCommentBlock = prevInsideCommentBlock;
+		return false;
+	}
+
+	result.whitespace = lipp::substr( src, 0, whitespaceLength );
+	src = lipp::substr( src, whitespaceLength );
+	advance( whitespaceLength );
+	apply_carried_whitespace( result );
+
+	if ( lipp::size( src ) == 0 )
+	{
+		if ( _insideCommentBlock )
+		{
+			self().set_error( error_type::unexpected_eof );
+			return false;
+		}
+
+		if ( !check_conditions_closed() )
+			return false;
+
+		// Last file is never popped
+		finish_file( _chunks[lipp::size( _chunks ) - 1] );
+
+#if defined(LIPP_STATISTICS)
+		_statistics.arenaCapacity = _arena.capacity();
+		_statistics.leave_file( SIZE_MAX );
+#endif
+
+		result.type = token_type::eof;
+		return false;
+	}
+
+	size_t tokenLength = 0;
+
+	if ( replayed )
+	{
+		result.type = token_type( replayed->type );
+		tokenLength = replayed->length;
+
+#if defined(LIPP_STATISTICS)
+		_statistics.bytesReplayed += whitespaceLength + tokenLength;
+#endif
+	}
+	else
+	{
+		error_type error = error_type::none;
+		tokenLength = lex_token( src, result.type, error );
+
+		if ( !tokenLength )
+		{
+			self().set_error( error );
+			return false;
+		}
+
+		if ( auto &file = _files[lipp::size( _files ) - 1]; file.recording && !prevInsideCommentBlock )
+			record_token( file, offset, whitespaceLength, _lineNumber - lineNumber, tokenLength, result.type );
+
+#if defined(LIPP_STATISTICS)
+		_statistics.bytesLexed += whitespaceLength + tokenLength;
+#endif
+	}
+
+	if ( auto &file = _files[lipp::size( _files ) - 1]; file.guard == guard_state::expect_ifndef || file.guard == guard_state::closed )
+	{
+		bool maybeGuard = file.guard == guard_state::expect_ifndef && result.type == token_type::directive;
+		file.guard = maybeGuard ? guard_state::ifndef_pending : guard_state::none;
+	}
+
+	if ( result.type == token_type::directive && !( flags & parsing_flags::no_directives ) )
+	{
+		advance( 1 ); // Cut away '#'
+		return process_directive( result );
+	}
+
+	result.text = substr( src, 0, tokenLength );
+	advance( tokenLength );
+
+	if ( result.type == token_type::identifier && !!( flags & parsing_flags::expand_macros ) )
+	{
+		if ( expand_identifier( result, flags, lipp::size( _chunks ) ) )
+			return _error == error_type::none && parse_next_token( result, flags );
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::read_expansion_token( token &result, int flags ) LIPP_NOEXCEPT
+{
+	size_t chunkIndex = lipp::size( _chunks ) - 1;
+	const auto &chunk = _chunks[chunkIndex];
+	const auto &mt = expansion_token( chunk, _chunks[chunkIndex].cursor++ );
+
+	result.type = mt.type;
+	result.whitespace = ( mt.flags & macro_token::leading_space ) ? string_view_t( " " ) : string_view_t();
+	result.text = ( chunk.kind == chunk_kind::argument ) ? lipp::substr( string_view_t( _argText ), mt.offset, mt.length )
+	                                                     : expansion_text( mt );
+	apply_carried_whitespace( result );
+
+	if ( result.type == token_type::identifier && !!( flags & parsing_flags::expand_macros ) )
+	{
+		// Tokens coming from arguments are not disabled by the macro they were substituted into
+		size_t activeChunks = ( mt.flags & macro_token::argument ) ? chunkIndex : chunkIndex + 1;
+
+		if ( expand_identifier( result, flags, activeChunks ) )
+			return _error == error_type::none && parse_next_token( result, flags );
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline const typename macro_table<T>::entry *basic_preprocessor<T, D>::lookup_macro( string_view_t name, uint32_t hash,
+                                                                                                         const char_t **hookValue ) LIPP_NOEXCEPT
+{
+	if ( find_macro_hooked() )
+	{
+		_foundMacro = nullptr;
+		const char_t *value = self().find_macro( name );
+
+		// Answer of this class, possibly passed on by the override
+		if ( _foundMacro && value == _macros.c_value( *_foundMacro ) && _macros.name( *_foundMacro ) == name )
+			return _foundMacro;
+
+		if ( hookValue )
+			*hookValue = value;
+
+		return nullptr;
+	}
+
+	// `find_macro` counts the searches it does itself
+#if defined(LIPP_STATISTICS)
+	_statistics.macroLookups++;
+#endif
+
+	return _macros.find( name, hash );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::expand_hook_value( token &result, string_view_t name, string_view_t value,
+                                                                   size_t activeChunks ) LIPP_NOEXCEPT
+{
+	size_t nameIndex = _hookNames.find( name );
+	if ( nameIndex == lipp::size( _hookNames ) )
+		_hookNames.insert( name );
+
+	uint32_t id = hook_macro | uint32_t( nameIndex );
+
+	for ( size_t i = 0; i < activeChunks; ++i )
+		if ( _chunks[i].macro == id )
+			return false; // Already being expanded
+
+	size_t base = lipp::size( _expansion );
+	size_t textBase = lipp::size( _expansionText );
+	_expansionText += value;
+
+	for ( size_t i = 0, S = lipp::size( value ); i < S; )
+	{
+		int lines = 0;
+		bool insideCommentBlock = false, stoppedAtEol = false;
+
+		size_t whitespaceLength = skip_whitespace( data( value ) + i, S - i, false, lines, insideCommentBlock, stoppedAtEol );
+		if ( ( i += whitespaceLength ) >= S )
+			break;
+
+		macro_token mt = { token_type::unknown, uint8_t( whitespaceLength ? macro_token::leading_space : 0 ), 0, uint32_t( textBase + i ), 0 };
+
+		error_type error = error_type::none;
+		mt.length = uint32_t( lex_token( lipp::substr( value, i ), mt.type, error ) );
+		if ( !mt.length )
+		{
+			resize( _expansion, base );
+			resize( _expansionText, textBase );
+			self().set_error( error );
+			return true;
+		}
+
+		i += mt.length;
+		push_back( _expansion, mt );
+	}
+
+	carry_whitespace( result.whitespace );
+	push_back( _chunks, { chunk_kind::expansion, id, 0u, size_t( 0 ), base, lipp::size( _expansion ), base, textBase } );
+
+	result = token();
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::expand_identifier( token &result, int flags, size_t activeChunks ) LIPP_NOEXCEPT
+{
+	note_macro_query( result.text );
+
+	const char_t *hookValue = nullptr;
+	const auto *m = lookup_macro( result.text, hash_string( result.text ), &hookValue );
+
+	if ( flags & parsing_flags::defer_values )
+	{
+		uintmax_t value = 0;
+		bool isUnsigned = false;
+
+		if ( ( !m && !hookValue ) || ( m && macro_value( *m, value, isUnsigned ) ) )
+		{
+			_deferredValue = true;
+			return false;
+		}
+	}
+
+	if ( _expressionDependencies )
+		add_expression_dependency( result.text, m ? m->stamp : 0 );
+
+	if ( !m )
+		return hookValue && expand_hook_value( result, result.text, trim( hookValue ), activeChunks );
+
+	uint32_t macroIndex = _macros.index( *m ) + 1;
+
+	for ( size_t i = 0; i < activeChunks; ++i )
+		if ( _chunks[i].macro == macroIndex )
+			return false; // Already being expanded
+
+	if ( !( m->flags & macro_flags::substitute ) )
+	{
+#if defined(LIPP_STATISTICS)
+		_statistics.count_expansion( result.text, macroIndex - 1 );
+#endif
+
+		carry_whitespace( result.whitespace );
+		push_back( _chunks, { chunk_kind::macro, macroIndex, 0u, size_t( 0 ), size_t( m->tokens ), size_t( m->tokens + m->tokenCount ), size_t( 0 ), size_t( 0 ) } );
+
+		result = token();
+		return true;
+	}
+
+	// Name of function-like macro not followed by '(' is just an identifier
+	if ( ( m->flags & macro_flags::function_like ) && !peek_parent_left( !!( flags & parsing_flags::stop_at_eols ) ) )
+		return false;
+
+#if defined(LIPP_STATISTICS)
+	_statistics.count_expansion( result.text, macroIndex - 1 );
+#endif
+
+	size_t argBase = lipp::size( _args );
+	size_t argTokenBase = lipp::size( _argTokens );
+	size_t argTextBase = lipp::size( _argText );
+
+	// Whitespace in front of the macro name goes to the arguments stack, it would not survive their expansion
+	size_t whitespaceLength = lipp::size( result.whitespace );
+	_argText += result.whitespace;
+	result = token();
+
+	if ( ( m->flags & macro_flags::function_like ) && !collect_arguments( *m, flags ) )
+		return true;
+
+	// Arguments that are not operands of '#' or '##' are fully expanded before substitution
+	for ( size_t i = 0, prevPaste = 0; i < m->tokenCount; ++i )
+	{
+		const auto &bt = _macros.token( m->tokens + i );
+
+		if ( ( bt.flags & macro_token::parameter ) && !( bt.flags & ( macro_token::stringize | macro_token::paste ) ) && !prevPaste &&
+		     _args[argBase + bt.param].expandedBegin == size_t( -1 ) )
+		{
+			expand_argument( argBase + bt.param );
+		}
+
+		prevPaste = bt.flags & macro_token::paste;
+	}
+
+	_carryWhitespace = false;
+	carry_whitespace( lipp::substr( string_view_t( _argText ), argTextBase, whitespaceLength ) );
+
+	if ( _error == error_type::none )
+		substitute( *m, argBase, argTextBase );
+
+	resize( _args, argBase );
+	resize( _argTokens, argTokenBase );
+	resize( _argText, argTextBase );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::peek_parent_left( bool stopAtEols ) const LIPP_NOEXCEPT
+{
+	for ( size_t i = lipp::size( _chunks ); i-- > 0; )
+	{
+		const auto &chunk = _chunks[i];
+
+		if ( chunk.kind != chunk_kind::source )
+		{
+			if ( chunk.cursor < chunk.end )
+				return expansion_token( chunk, chunk.cursor ).type == token_type::parent_left;
+
+			continue;
+		}
+
+		auto text = lipp::substr( chunk_text( chunk ), chunk.cursor, chunk.end - chunk.cursor );
+
+		int lines = 0;
+		bool insideCommentBlock = false, stoppedAtEol = false;
+
+		size_t whitespaceLength = skip_whitespace( data( text ), lipp::size( text ), stopAtEols, lines, insideCommentBlock, stoppedAtEol );
+		if ( stoppedAtEol )
+			return false;
+		else if ( whitespaceLength < lipp::size( text ) )
+			return text[whitespaceLength] == '(';
+
+		// Invocation does not continue past the end of an included file
+		return false;
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::collect_arguments( const typename macro_table<T>::entry &m, int flags ) LIPP_NOEXCEPT
+{
+	static constexpr size_t none = size_t( -1 );
+
+	int collectFlags = ( flags & parsing_flags::stop_at_eols ) | parsing_flags::no_directives;
+	size_t argBase = lipp::size( _args );
+
+	token t;
+	parse_next_token( t, collectFlags ); // Opening '(', already checked by `peek_parent_left`
+	push_back( _args, { lipp::size( _argTokens ), none, none, none } );
+
+	for ( int depth = 0; ; )
+	{
+		t = token();
+		if ( !parse_next_token( t, collectFlags ) )
+		{
+			if ( _error == error_type::none )
+				self().set_error( error_type::invalid_macro_arguments );
+
+			return false;
+		}
+
+		if ( t.type == token_type::parent_left )
+			++depth;
+		else if ( t.type == token_type::parent_right )
+		{
+			if ( !depth-- )
+				break;
+		}
+		else if ( t.type == token_type::comma && !depth )
+		{
+			// Variadic parameter takes all remaining arguments including commas
+			if ( !( m.flags & macro_flags::variadic ) || lipp::size( _args ) - argBase < m.paramCount )
+			{
+				_args[lipp::size( _args ) - 1].end = lipp::size( _argTokens );
+				push_back( _args, { lipp::size( _argTokens ), none, none, none } );
+				continue;
+			}
+		}
+
+		uint8_t tokenFlags = macro_token::argument | ( lipp::size( t.whitespace ) ? macro_token::leading_space : 0 );
+		push_back( _argTokens, { t.type, tokenFlags, uint16_t( 0 ), uint32_t( lipp::size( _argText ) ), uint32_t( lipp::size( t.text ) ) } );
+		_argText += t.text;
+	}
+
+	_args[lipp::size( _args ) - 1].end = lipp::size( _argTokens );
+
+	// "F()" passes no arguments to a macro without parameters, not a single empty one
+	if ( m.paramCount == 0 && lipp::size( _args ) - argBase == 1 && _args[argBase].begin == _args[argBase].end )
+		pop_back( _args );
+
+	// Variadic arguments may be omitted completely
+	if ( ( m.flags & macro_flags::variadic ) && lipp::size( _args ) - argBase + 1 == m.paramCount )
+		push_back( _args, { lipp::size( _argTokens ), lipp::size( _argTokens ), none, none } );
+
+	if ( lipp::size( _args ) - argBase != m.paramCount )
+	{
+		self().set_error( error_type::invalid_macro_arguments );
+		return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::expand_argument( size_t argIndex ) LIPP_NOEXCEPT
+{
+	// Barrier makes the expansion see the argument as the whole input
+	push_back( _chunks, { chunk_kind::barrier, 0u, 0u, size_t( 0 ), size_t( 0 ), size_t( 0 ), size_t( 0 ), size_t( 0 ) } );
+	push_back( _chunks, { chunk_kind::argument, 0u, 0u, size_t( 0 ), _args[argIndex].begin, _args[argIndex].end, size_t( 0 ), size_t( 0 ) } );
+
+	size_t expandedBegin = lipp::size( _argTokens );
+
+	token t;
+	while ( parse_next_token( t, parsing_flags::expand_macros | parsing_flags::no_directives ) )
+	{
+		uint8_t tokenFlags = macro_token::argument | ( lipp::size( t.whitespace ) ? macro_token::leading_space : 0 );
+		push_back( _argTokens, { t.type, tokenFlags, uint16_t( 0 ), uint32_t( lipp::size( _argText ) ), uint32_t( lipp::size( t.text ) ) } );
+		_argText += t.text;
+		t = token();
+	}
+
+	while ( _chunks[lipp::size( _chunks ) - 1].kind != chunk_kind::barrier )
+		pop_chunk();
+
+	pop_chunk();
+
+	_args[argIndex].expandedBegin = expandedBegin;
+	_args[argIndex].expandedEnd = lipp::size( _argTokens );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::substitute( const typename macro_table<T>::entry &m, size_t argBase, size_t argTextBase ) LIPP_NOEXCEPT
+{
+	static constexpr size_t none = size_t( -1 );
+
+	size_t base = lipp::size( _expansion );
+	size_t textBase = lipp::size( _expansionText );
+
+	// Argument text is referenced by substituted tokens, copy it next to them
+	_expansionText += lipp::substr( string_view_t( _argText ), argTextBase );
+
+	bool pastePending = false;
+	bool prevLeadingSpace = false;
+	size_t left = none;
+
+	for ( size_t i = 0; i < m.tokenCount; ++i )
+	{
+		const auto &bt = _macros.token( m.tokens + i );
+		size_t before = lipp::size( _expansion );
+		bool leadingSpace = !!( bt.flags & macro_token::leading_space );
+
+		if ( !( bt.flags & macro_token::parameter ) )
+			push_back( _expansion, bt );
+		else if ( bt.flags & macro_token::stringize )
+			push_back( _expansion, stringize_argument( argBase + bt.param, leadingSpace ) );
+		else
+		{
+			const auto &arg = _args[argBase + bt.param];
+			bool expanded = arg.expandedBegin != none && !pastePending && !( bt.flags & macro_token::paste );
+			size_t argBegin = expanded ? arg.expandedBegin : arg.begin;
+			size_t argEnd = expanded ? arg.expandedEnd : arg.end;
+
+			// GNU extension, ", ## __VA_ARGS__" removes the comma when there are no variadic arguments
+			if ( pastePending && left != none && _expansion[left].type == token_type::comma &&
+			     ( m.flags & macro_flags::variadic ) && bt.param + 1u == m.paramCount )
+			{
+				if ( argBegin == argEnd && left + 1 == lipp::size( _expansion ) )
+				{
+					pop_back( _expansion );
+					left = none;
+				}
+
+				pastePending = false;
+			}
+
+			// Right operand of '##' pasted to an empty argument keeps spacing of the left one
+			if ( pastePending && left == none )
+				leadingSpace = prevLeadingSpace;
+
+			for ( size_t a = argBegin; a < argEnd; ++a )
+			{
+				auto at = _argTokens[a];
+				at.offset = uint32_t( at.offset - argTextBase + textBase );
+
+				if ( a == argBegin )
+					at.flags = uint8_t( ( at.flags & ~macro_token::leading_space ) | ( leadingSpace ? macro_token::leading_space : 0 ) );
+
+				push_back( _expansion, at );
+			}
+		}
+
+		bool produced = lipp::size( _expansion ) > before;
+
+		if ( pastePending && produced && left != none )
+			paste_tokens( left, before );
+
+		if ( produced )
+			left = lipp::size( _expansion ) - 1;
+		else if ( !pastePending )
+			left = none; // Empty argument acts as a placemarker
+
+		if ( !pastePending || produced )
+			prevLeadingSpace = leadingSpace;
+
+		pastePending = !!( bt.flags & macro_token::paste );
+	}
+
+	push_back( _chunks, { chunk_kind::expansion, _macros.index( m ) + 1, 0u, size_t( 0 ), base, lipp::size( _expansion ), base, textBase } );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline macro_token basic_preprocessor<T, D>::stringize_argument( size_t argIndex, bool leadingSpace ) LIPP_NOEXCEPT
+{
+	const auto &arg = _args[argIndex];
+	size_t offset = lipp::size( _expansionText );
+
+	_expansionText += "\"";
+
+	for ( size_t a = arg.begin; a < arg.end; ++a )
+	{
+		const auto &at = _argTokens[a];
+		auto text = lipp::substr( string_view_t( _argText ), at.offset, at.length );
+
+		if ( a > arg.begin && ( at.flags & macro_token::leading_space ) )
+			_expansionText += " ";
+
+		if ( at.type != token_type::string )
+		{
+			_expansionText += text;
+			continue;
+		}
+
+		for ( size_t i = 0, S = lipp::size( text ); i < S; ++i )
+		{
+			if ( text[i] == '"' || text[i] == '\\' )
+				_expansionText += "\\";
+
+			_expansionText += lipp::substr( text, i, 1 );
+		}
+	}
+
+	_expansionText += "\"";
+
+	return { token_type::string, uint8_t( leadingSpace ? macro_token::leading_space : 0 ), uint16_t( 0 ),
+	         uint32_t( offset ), uint32_t( lipp::size( _expansionText ) - offset ) };
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::paste_tokens( size_t left, size_t right ) LIPP_NOEXCEPT
+{
+	_pasteText = expansion_text( _expansion[left] );
+	_pasteText += expansion_text( _expansion[right] );
+
+	size_t offset = lipp::size( _expansionText );
+	_expansionText += _pasteText;
+
+	auto &pasted = _expansion[left];
+	pasted.flags &= macro_token::leading_space;
+	pasted.param = 0;
+	pasted.offset = uint32_t( offset );
+	pasted.length = uint32_t( lipp::size( _pasteText ) );
+
+	// Result that does not form a single valid token is kept glued together anyway
+	error_type error = error_type::none;
+	if ( lex_token( _pasteText, pasted.type, error ) != lipp::size( _pasteText ) )
+		pasted.type = token_type::unknown;
+
+	for ( size_t i = right; i + 1 < lipp::size( _expansion ); ++i )
+		_expansion[i] = _expansion[i + 1];
+
+	pop_back( _expansion );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline typename basic_preprocessor<T, D>::string_t basic_preprocessor<T, D>::read_all() LIPP_NOEXCEPT
+{
+	string_t result = "";
+
+	read_all( [&result]( string_view_t whitespace, string_view_t text )
+	{
+		result += whitespace;
+		result += text;
+	} );
+
+	return result;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> template <class Sink> inline bool basic_preprocessor<T, D>::read_all( Sink &&sink ) LIPP_NOEXCEPT
+{
+	token t;
+	while ( next_token( t ) )
+		sink( t.whitespace, t.text );
+
+	return _error == error_type::none;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::scan_dependencies() LIPP_NOEXCEPT
+{
+	_scanning = true;
+
+	token t;
+	do
+	{
+		size_t count = lipp::size( _chunks );
+		if ( !count || _chunks[count - 1].kind != chunk_kind::source || _insideCommentBlock )
+			continue;
+
+		// Rest of the line after a directive and expansions are read as tokens, everything else is jumped over
+		const auto &chunk = _chunks[count - 1];
+		bool lineStart = !chunk.cursor || lipp::char_at( chunk_text( chunk ), chunk.cursor - 1 ) == '\n';
+
+		auto src = current_text();
+		size_t skipped = skip_to_directive( data( src ), lipp::size( src ), _lineNumber, lineStart );
+		advance( skipped );
+
+		// Skipped code after the `#endif` of a guard candidate means it is not guarded
+		if ( auto &file = _files[lipp::size( _files ) - 1]; skipped && ( file.guard == guard_state::expect_ifndef || file.guard == guard_state::closed ) )
+			file.guard = guard_state::none;
+	}
+	while ( next_token( t ) );
+
+	_scanning = false;
+	return _error == error_type::none;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline size_t basic_preprocessor<T, D>::checkpoint_offset() const LIPP_NOEXCEPT
+{
+	// Main source is the only chunk, its `#line` prefix was already returned
+	if ( lipp::size( _chunks ) != 1 || _pendingLine != pending_line::none || _insideCommentBlock || _carryWhitespace ||
+	     _error != error_type::none )
+		return SIZE_MAX;
+
+	const auto &chunk = _chunks[0];
+	auto src = chunk_text( chunk );
+
+	// Only spaces up to the end of the line, the next token starts on a line of its own
+	for ( size_t i = chunk.cursor, S = lipp::size( src ); i < S; ++i )
+	{
+		if ( src[i] == '\n' )
+			return chunk.cursor;
+
+		if ( src[i] != ' ' && src[i] != '\t' && src[i] != '\r' )
+			break;
+	}
+
+	return SIZE_MAX;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::save_checkpoint( checkpoint &result ) const LIPP_NOEXCEPT
+{
+	result.offset = _chunks[0].cursor;
+	result.lineNumber = _lineNumber;
+	result.trueBlock = _trueBlock;
+	result.sourceName = _sourceName;
+	result.macros = _macros;
+	result.conditions = _conditions;
+	result.onceIncluded = _onceIncluded;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::same_state( const checkpoint &other ) const LIPP_NOEXCEPT
+{
+	if ( _trueBlock != other.trueBlock || _sourceName != string_view_t( other.sourceName ) ||
+	     lipp::size( _conditions ) != lipp::size( other.conditions ) || lipp::size( _onceIncluded ) != lipp::size( other.onceIncluded ) )
+		return false;
+
+	for ( size_t i = 0, S = lipp::size( _conditions ); i < S; ++i )
+	{
+		const auto &a = _conditions[i];
+		const auto &b = other.conditions[i];
+
+		if ( a.active != b.active || a.taken != b.taken || a.parentActive != b.parentActive )
+			return false;
+	}
+
+	for ( size_t i = 0, S = lipp::size( _onceIncluded ); i < S; ++i )
+	{
+		if ( _onceIncluded[i] != other.onceIncluded[i] )
+			return false;
+	}
+
+	return _macros.same_definitions( other.macros );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::resume( string_view_t src, const checkpoint &from ) LIPP_NOEXCEPT
+{
+	self().reset();
+
+	// Text in front of the checkpoint is not read again, so it needs no copy
+	push_source( src, 0, false );
+	_chunks[0].cursor = from.offset;
+
+	_macros = from.macros;
+	_conditions = from.conditions;
+	_onceIncluded = from.onceIncluded;
+	_trueBlock = from.trueBlock;
+	_lineNumber = from.lineNumber;
+	set_source_name( from.sourceName );
+
+#if defined(LIPP_STATISTICS)
+	_statistics.enter_file( _sourceName, 0 );
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::save_state( string_view_t fileName ) LIPP_NOEXCEPT
+{
+	FILE *file = fopen( string_t( fileName ).c_str(), "wb" );
+	if ( !file )
+		return false;
+
+	state_header header = { state_magic, state_version, uint32_t( lipp::size( _conditions ) ), uint32_t( lipp::size( _onceIncluded ) ) };
+	const uint32_t zero = 0;
+
+	bool ok = fwrite( &header, sizeof( header ), 1, file ) == 1 && _macros.write_image( file ) &&
+	          ( !header.conditionCount || fwrite( &_conditions[0], sizeof( conditional ), header.conditionCount, file ) == header.conditionCount );
+
+	// Paths, as cache indices mean nothing to another run
+	auto &cache = get_include_cache();
+	scoped_lock<include_cache_t> lock( cache );
+
+	for ( size_t i = 0; ok && i < header.onceCount; ++i )
+	{
+		string_view_t path = cache[_onceIncluded[i]].path;
+		uint32_t length = uint32_t( lipp::size( path ) );
+		size_t padding = ( 4 - length * sizeof( char_t ) % 4 ) % 4;
+
+		ok = fwrite( &length, sizeof( length ), 1, file ) == 1 && fwrite( data( path ), sizeof( char_t ), length, file ) == length &&
+		     fwrite( &zero, 1, padding, file ) == padding;
+	}
+
+	return fclose( file ) == 0 && ok;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::load_state( string_view_t fileName ) LIPP_NOEXCEPT
+{
+	self().reset();
+	release_state();
+
+	string_t path = string_t( fileName );
+	size_t length = 0;
+	const char *data = static_cast<const char *>( map_file( path.c_str(), length ) );
+
+	if ( data )
+	{
+		_stateMapping = data;
+		_stateMappingLength = length;
+	}
+	// Read into 64 bit words, the macro image has to be aligned
+	else if ( FILE *file = fopen( path.c_str(), "rb" ); file )
+	{
+		long size = fseek( file, 0, SEEK_END ) == 0 ? ftell( file ) : -1;
+		bool ok = size > 0 && fseek( file, 0, SEEK_SET ) == 0;
+
+		if ( ok )
+		{
+			resize( _stateContent, ( size_t( size ) + 7 ) / 8 );
+			ok = fread( &_stateContent[0], 1, size_t( size ), file ) == size_t( size );
+		}
+
+		fclose( file );
+
+		if ( ok )
+		{
+			data = reinterpret_cast<const char *>( &_stateContent[0] );
+			length = size_t( size );
+		}
+	}
+
+	state_header header = { };
+	size_t offset = sizeof( header );
+
+	if ( !data || length < sizeof( header ) || ( memcpy( &header, data, sizeof( header ) ), header.magic != state_magic ) ||
+	     header.version != state_version )
+	{
+		self().set_error( error_type::read_failed );
+		return false;
+	}
+
+	size_t imageLength = _macros.attach_image( data + offset, length - offset );
+	offset += imageLength;
+
+	if ( !imageLength || length - offset < header.conditionCount * sizeof( conditional ) )
+	{
+		_macros.clear();
+		self().set_error( error_type::read_failed );
+		return false;
+	}
+
+	resize( _conditions, header.conditionCount );
+
+	for ( size_t i = 0; i < header.conditionCount; ++i, offset += sizeof( conditional ) )
+	{
+		memcpy( &_conditions[i], data + offset, sizeof( conditional ) );
+		_trueBlock = _trueBlock && is_active( _conditions[i] );
+	}
+
+	auto &cache = get_include_cache();
+	bool ok = true;
+
+	// No hooks while holding the lock, an error is reported after
+	{
+		scoped_lock<include_cache_t> lock( cache );
+
+		for ( size_t i = 0; ok && i < header.onceCount; ++i )
+		{
+			uint32_t pathLength = 0;
+
+			if ( length - offset < sizeof( pathLength ) ||
+			     ( memcpy( &pathLength, data + offset, sizeof( pathLength ) ), length - offset - sizeof( pathLength ) < pathLength * sizeof( char_t ) ) )
+			{
+				ok = false;
+				break;
+			}
+
+			offset += sizeof( pathLength );
+			auto index = cache.find_or_insert( string_view_t( reinterpret_cast<const char_t *>( data + offset ), pathLength ) );
+			cache[index].pragmaOnce = true;
+			push_back( _onceIncluded, index );
+
+			offset += pathLength * sizeof( char_t );
+			offset += ( 4 - offset % 4 ) % 4;
+		}
+	}
+
+	if ( !ok )
+	{
+		self().set_error( error_type::read_failed );
+		return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::release_state() LIPP_NOEXCEPT
+{
+	if ( _stateMapping )
+		unmap_file( _stateMapping, _stateMappingLength );
+
+	_stateMapping = nullptr;
+	_stateMappingLength = 0;
+	clear( _stateContent );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::concat_remaining_tokens( string_view_t &result ) LIPP_NOEXCEPT
+{
+	token t;
+	for ( bool first = true; parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::no_directives ); first = false )
+	{
+		if ( !first )
+			append_text( result, " " );
+
+		append_text( result, t.text );
+	}
+
+	return _error == error_type::none;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::return_line_directive( token &result ) LIPP_NOEXCEPT
+{
+	if ( !line_directives() )
+	{
+		carry_whitespace( result.whitespace );
+		return parse_next_token( result );
+	}
+
+	result.text = store_line_directive( _lineNumber + 1, _sourceName );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::take_pending_line( token &result ) LIPP_NOEXCEPT
+{
+	// Newline ending the directive is whitespace in front of the next token
+	if ( _pendingLine == pending_line::newline )
+	{
+		_pendingLine = pending_line::none;
+		carry_whitespace( "\n" );
+		return false;
+	}
+
+	result.type = token_type::directive;
+	result.whitespace = _pendingLine == pending_line::newline_directive ? string_view_t( "\n" ) : string_view_t();
+	apply_carried_whitespace( result );
+	result.text = store_line_directive( _lineNumber, _sourceName );
+
+	_pendingLine = pending_line::newline;
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::minify( token &result ) LIPP_NOEXCEPT
+{
+	// Echoed `#define` and `#undef`, and unknown directives
+	if ( result.type == token_type::directive )
+		return false;
+
+	// Line continuation, the new line after it is whitespace of the next token
+	if ( result.text == "\\" )
+	{
+		string_view_t rest = current_text();
+
+		if ( lipp::size( rest ) && data( rest ) == data( result.text ) + 1 &&
+		     ( rest[0] == '\n' || ( rest[0] == '\r' && lipp::char_at( rest, 1 ) == '\n' ) ) )
+			return false;
+	}
+
+	// Output only moves forward, an included file usually ends up on the line of its `#include`
+	int lines = 0;
+
+	if ( _outputMode == output_mode::minified_lines && _lineNumber > _minifiedLine )
+	{
+		lines = _lineNumber - _minifiedLine;
+		_minifiedLine = _lineNumber;
+	}
+
+	if ( lines )
+	{
+		resize( _minifiedWhitespace, size_t( lines ) );
+		for ( int i = 0; i < lines; ++i )
+			_minifiedWhitespace[i] = '\n';
+
+		result.whitespace = _minifiedWhitespace;
+	}
+	// Tokens written together stay together, the lexer splits some which must not be separated, like "1.0f"
+	else if ( lipp::size( result.whitespace ) && tokens_merge( _minifiedTail[0], _minifiedTail[1], _minifiedNumber, result.text ) )
+		result.whitespace = " ";
+	else
+		result.whitespace = string_view_t();
+
+	size_t length = lipp::size( result.text );
+	bool glued = !lipp::size( result.whitespace );
+
+	// Words, dots and exponent signs written right after a number continue it
+	if ( result.type == token_type::number )
+		_minifiedNumber = true;
+	else if ( _minifiedNumber && glued && ( result.type == token_type::identifier || result.text == "." ) )
+		_minifiedNumber = true;
+	else
+	{
+		char_t last = _minifiedTail[1];
+		_minifiedNumber = _minifiedNumber && glued && ( result.text == "+" || result.text == "-" ) &&
+		                  ( last == 'e' || last == 'E' || last == 'p' || last == 'P' );
+	}
+
+	_minifiedTail[0] = length > 1 ? result.text[length - 2] : glued ? _minifiedTail[1] : 0;
+	_minifiedTail[1] = result.text[length - 1];
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::tokens_merge( char_t beforeLast, char_t before, bool afterNumber,
+                                                              string_view_t next ) LIPP_NOEXCEPT
+{
+	// Two character punctuators of C, C++ and GLSL including digraphs, and comments
+	static constexpr const char pairs[] = "->++--<<>>&&||^^<=>===!=*=/=%=+=-=&=^=|=##::...*<::><%%>%:/*//";
+
+	char_t after = lipp::char_at( next, 0 );
+	auto isWord = []( char_t c ) { return !!( char_class_of( c ) & char_class::identifier ); };
+
+	if ( !before )
+		return false;
+
+	// A pp-number takes in anything like an identifier, dots, exponent signs and digit separators
+	if ( afterNumber && ( isWord( after ) || after == '.' || ( char_class_of( after ) & char_class::quote ) ||
+	                      ( ( before == 'e' || before == 'E' || before == 'p' || before == 'P' ) && ( after == '+' || after == '-' ) ) ) )
+		return true;
+
+	// Identifiers, string prefixes like `L"..."`, and user-defined literal suffixes of C++11
+	if ( isWord( before ) )
+		return isWord( after ) || after == '.' || ( char_class_of( after ) & char_class::quote );
+
+	if ( ( char_class_of( before ) & char_class::quote ) && isWord( after ) )
+		return true;
+
+	if ( before == '.' && ( char_class_of( after ) & char_class::digit ) )
+		return true;
+
+	if ( beforeLast == '-' && before == '>' && after == '*' )
+		return true;
+
+	for ( size_t i = 0; i + 1 < sizeof( pairs ); i += 2 )
+	{
+		if ( pairs[i] == before && pairs[i + 1] == after )
+			return true;
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::note_location( const token &result ) LIPP_NOEXCEPT
+{
+	auto countLines = []( string_view_t text )
+	{
+		int lines = 0;
+		for ( size_t i = 0, S = lipp::size( text ); i < S; ++i )
+			lines += text[i] == '\n';
+
+		return lines;
+	};
+
+	_outputLine += countLines( result.whitespace );
+	_outputOffset += lipp::size( result.whitespace );
+
+	// New range only where the output stops following the source line by line. `#line` directives are
+	// not from the source, others like a `#define` kept in the output are.
+	bool lineDirective = result.type == token_type::directive && lipp::substr( result.text, 0, 5 ) == "#line";
+
+	if ( !lineDirective && ( _outputFile != _fileId || _outputLine != _lineNumber ) )
+	{
+		push_back( _locations, { _outputOffset, _fileId, _lineNumber } );
+		_outputFile = _fileId;
+		_outputLine = _lineNumber;
+	}
+
+	_outputLine += countLines( result.text );
+	_outputOffset += lipp::size( result.text );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::find_location( string_view_t output, size_t offset, uint32_t &file,
+                                                               int &line ) const LIPP_NOEXCEPT
+{
+	// Last range starting at or in front of the offset
+	size_t low = 0, high = lipp::size( _locations );
+	while ( low < high )
+	{
+		size_t middle = ( low + high ) / 2;
+
+		if ( _locations[middle].offset <= offset )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if ( !low )
+		return false;
+
+	const auto &range = _locations[low - 1];
+	file = range.file;
+	line = range.line;
+
+	for ( size_t i = range.offset; i < offset && i < lipp::size( output ); ++i )
+		line += output[i] == '\n';
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::process_directive( token &result ) LIPP_NOEXCEPT
+{
+	auto nextIdentifier = [this]()->string_view_t
+	{
+		if ( token t; parse_next_token( t, 0 ) )
+			return t.type == token_type::identifier ? t.text : string_view_t();
+
+		self().set_error( error_type::expected_identifier );
+		return string_view_t();
+	};
+
+	bool guardCandidate = take_guard_candidate();
+
+	auto directiveName = nextIdentifier();
+	if ( !lipp::size( directiveName ) )
+		return false;
+
+	/**/ if ( directiveName == "line" )
+	{
+		token t;
+		if ( !parse_next_token( t, 0 ) || t.type != token_type::number )
+		{
+			self().set_error( error_type::syntax_error );
+			return false;
+		}
+
+		_lineNumber = to_int( t.text ) - 1;
+
+		if ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::string )
+		{
+			self().set_error( error_type::syntax_error );
+			return false;
+		}
+
+		set_source_name( remove_first_and_last( t.text ) );
+		return return_line_directive( result );
+	}
+	else if ( directiveName == "define" )
+	{
+		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
+		{
+			// Directive is returned as "#define NAME VALUE", name and value are parts of it
+			constexpr size_t nameBegin = 8;
+			string_view_t text = store_text( "#define " );
+			append_text( text, macroName );
+
+			// Parameter list must follow the name without any whitespace
+			if ( lipp::char_at( current_text(), 0 ) == '(' )
+			{
+				token t;
+				do
+				{
+					if ( !parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::no_directives ) )
+					{
+						self().set_error( error_type::syntax_error );
+						return false;
+					}
+
+					append_text( text, t.text );
+					if ( t.type == token_type::comma )
+						append_text( text, " " );
+				}
+				while ( t.type != token_type::parent_right );
+			}
+
+			size_t nameEnd = lipp::size( text );
+			append_text( text, " " );
+
+			if ( !concat_remaining_tokens( text ) )
+				return false;
+
+			self().define( lipp::substr( text, nameBegin, nameEnd - nameBegin ), lipp::substr( text, nameEnd + 1 ) );
+
+			result.text = text;
+			return true;
+		}
+
+		return false; // Error!
+	}
+	else if ( directiveName == "undef" )
+	{
+		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
+		{
+			self().undef( macroName );
+
+			string_view_t text = store_text( "#undef " );
+			append_text( text, macroName );
+
+			result.text = text;
+			return true;
+		}
+
+		return false;
+	}
+	else if ( directiveName == "ifdef" )
+	{
+		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
+		{
+			note_macro_query( macroName );
+			push_conditional( self().find_macro( macroName ) != nullptr );
+			return parse_after_conditional( result );
+		}
+
+		return false;
+	}
+	else if ( directiveName == "ifndef" )
+	{
+		if ( auto macroName = nextIdentifier(); lipp::size( macroName ) )
+		{
+			if ( guardCandidate )
+			{
+				auto &file = _files[lipp::size( _files ) - 1];
+				file.guard = guard_state::inside;
+				file.guardDepth = lipp::size( _conditions );
+				file.guardName = macroName;
+			}
+
+			note_macro_query( macroName );
+			push_conditional( self().find_macro( macroName ) == nullptr );
+			return parse_after_conditional( result );
+		}
 
 		return false;
 	}
@@ -836,349 +5236,1138 @@ template <class T> inline bool preprocessor<T>::process_directive( token &result
 		if ( _error != error_type::none )
 			return false;
 
-		_ifBits = ( _ifBits << 3ull ) | ( ( evalResult != 0 ) ? 0b111ull : 0b110ull );
+		push_conditional( evalResult != 0 );
+		return parse_after_conditional( result );
+	}
+	else if ( directiveName == "else" )
+	{
+		if ( lipp::size( _conditions ) )
+		{
+			// Guarded part has an alternative
+			if ( auto &file = _files[lipp::size( _files ) - 1]; file.guard == guard_state::inside && file.guardDepth + 1 == lipp::size( _conditions ) )
+				file.guard = guard_state::none;
+
+			auto &c = _conditions[lipp::size( _conditions ) - 1];
+			set_branch( !c.taken );
+
+			if ( is_inside_true_block() )
+				return return_line_directive( result );
+			else
+				return parse_after_conditional( result );
+		}
+
+		self().set_error( error_type::mismatch_if );
+		return false;
+	}
+	else if ( directiveName == "elif" )
+	{
+		if ( lipp::size( _conditions ) )
+		{
+			if ( auto &file = _files[lipp::size( _files ) - 1]; file.guard == guard_state::inside && file.guardDepth + 1 == lipp::size( _conditions ) )
+				file.guard = guard_state::none;
+
+			// Previous block was true, all upcomming "elif" blocks must be false
+			if ( _conditions[lipp::size( _conditions ) - 1].taken )
+			{
+				token t;
+				while ( parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::no_directives ) ) { }
+
+				if ( _error != error_type::none )
+					return false;
+
+				set_branch( false );
+				return parse_after_conditional( result );
+			}
+			else
+			{
+				auto evalResult = evaluate_expression();
+				if ( _error != error_type::none )
+					return false;
+
+				set_branch( evalResult != 0 );
+
+				if ( is_inside_true_block() )
+					return return_line_directive( result );
+				else
+					return parse_after_conditional( result );
+			}
+		}
+
+		self().set_error( error_type::mismatch_if );
+		return false;
+	}
+	else if ( directiveName == "endif" )
+	{
+		if ( lipp::size( _conditions ) > _files[lipp::size( _files ) - 1].conditionDepth )
+		{
+			pop_back( _conditions );
+			_trueBlock = !lipp::size( _conditions ) || is_active( _conditions[lipp::size( _conditions ) - 1] );
+
+			if ( auto &file = _files[lipp::size( _files ) - 1]; file.guard == guard_state::inside && file.guardDepth == lipp::size( _conditions ) )
+				file.guard = guard_state::closed;
+
+			if ( is_inside_true_block() )
+				return return_line_directive( result );
+			else
+				return parse_after_conditional( result );
+		}
+
+		self().set_error( error_type::mismatch_if );
+		return false;
+	}
+	else if ( directiveName == "eval" )
+	{
+		auto whitespace = store_text( result.whitespace );
+
+		compiled_expression expression;
+		uintmax_t value = 0;
+
+		if ( !compile_expression( expression ) || !run_expression( expression, value ) )
+			return false;
+
+		result.type = token_type::number;
+		result.whitespace = whitespace;
+
+		char_t buff[char_t_buffer_size] = { };
+
+		if ( expression.isUnsigned )
+		{
+			LIPP_SPRINTF( buff, "%llu", static_cast<unsigned long long>( value ) );
+		}
+		else
+		{
+			LIPP_SPRINTF( buff, "%lld", static_cast<long long>( intmax_t( value ) ) );
+		}
+
+		result.text = store_text( buff );
+		return true;
+	}
+	else if ( directiveName == "error" )
+	{
+		if ( is_inside_true_block() )
+		{
+			self().set_error( error_type::error_directive );
+			return false;
+		}
+
 		return parse_next_token( result );
 	}
-	else if ( directiveName == "else" )
+	else if ( directiveName == "include" )
 	{
-		if ( _ifBits )
+		token t;
+		if ( !parse_next_token( t, parsing_flags::stop_at_eols ) )
 		{
-			_ifBits ^= 1; // Flip first bit
-
-			if ( is_inside_true_block() )
-				return return_line_directive( result );
-			else
-				return parse_next_token( result );
+			self().set_error( error_type::syntax_error );
+			return false;
 		}
 
-		set_error( error_type::mismatch_if );
-		return false;
-	}
-	else if ( directiveName == "elif" )
-	{
-		if ( _ifBits )
+		bool isSystemPath = t.type == token_type::less;
+		string_t fileName;
+
+		if ( t.type == token_type::string )
+			fileName = remove_first_and_last( t.text );
+		else if ( t.type == token_type::less )
 		{
-			// Previous block was true, all upcomming "elif" blocks must be false
-			if ( is_inside_true_block() || ( _ifBits & 2ull ) == 0 )
+			while ( parse_next_token( t, parsing_flags::stop_at_eols ) )
 			{
-				string_t exprTokens;
-				if ( !concat_remaining_tokens( exprTokens ) )
-					return false;
+				if ( t.type == token_type::greater || t.type == token_type::string )
+					break;
 
-				// Clear first and second bit
-				_ifBits &= ~3ull;
-				return parse_next_token( result );
+				fileName += t.whitespace;
+				fileName += t.text;
 			}
-			else
+
+			if ( _error != error_type::none )
+				return false;
+			else if ( t.type != token_type::greater )
 			{
-				auto evalResult = evaluate_expression();
-				if ( _error != error_type::none )
-					return false;
+				self().set_error( error_type::invalid_path );
+				return false;
+			}
+		}
+		else
+		{
+			self().set_error( error_type::invalid_path );
+			return false;
+		}
 
-				if ( evalResult )
-					_ifBits |= 0b111ull;
+		// Already consumed whitespace goes in front of the included source
+		carry_whitespace( result.whitespace );
 
-				return parse_next_token( result );
-			}
+		if ( !self().include_file( fileName, isSystemPath ) )
+		{
+			self().set_error( error_type::include_error );
+			return false;
 		}
 
-		set_error( error_type::mismatch_if );
-		return false;
+		return parse_next_token( result );
 	}
-	else if ( directiveName == "endif" )
+	else if ( directiveName == "pragma" )
 	{
-		if ( _ifBits )
+		// Only "once" is handled here, the name of any other pragma is put back
+		auto chunk = _chunks[lipp::size( _chunks ) - 1];
+		auto lineNumber = _lineNumber;
+		auto insideCommentBlock = _insideCommentBlock;
+
+		if ( token t; parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::no_directives ) && t.text == "once" )
 		{
-			_ifBits >>= 3;
+			if ( chunk.cached && is_inside_true_block() )
+			{
+				scoped_lock<include_cache_t> lock( get_include_cache() );
+				get_include_cache()[chunk.cached - 1].pragmaOnce = true;
+				push_back( _onceIncluded, chunk.cached - 1 );
+			}
 
-			if ( is_inside_true_block() )
-				return return_line_directive( result );
-			else
-				return parse_next_token( result );
+			return parse_next_token( result );
 		}
 
-		set_error( error_type::mismatch_if );
-		return false;
+		if ( _error != error_type::none )
+			return false;
+
+		_chunks[lipp::size( _chunks ) - 1] = chunk;
+		_lineNumber = lineNumber;
+		_insideCommentBlock = insideCommentBlock;
+
+		return self().process_unknown_directive( directiveName );
 	}
-	else if ( directiveName == "eval" )
+	else
 	{
-		_tempString = result.whitespace;
+		return self().process_unknown_directive( directiveName );
+	}
 
-		auto evalResult = evaluate_expression();
-		if ( _error != error_type::none )
-			return false;
+	return true;
+}
 
-		result.type = token_type::number;
-		result.whitespace = _tempString;
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::push_conditional( bool value ) LIPP_NOEXCEPT
+{
+	push_back( _conditions, { _lineNumber, value, value, _trueBlock } );
+	_trueBlock = _trueBlock && value;
+}
 
-		char_t buff[char_t_buffer_size] = { };
-		LIPP_SPRINTF( buff, "%d", evalResult );
-		result.text = buff;
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::set_branch( bool value ) LIPP_NOEXCEPT
+{
+	auto &c = _conditions[lipp::size( _conditions ) - 1];
+	c.active = value;
+	c.taken = c.taken || value;
+	_trueBlock = is_active( c );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::check_conditions_closed() LIPP_NOEXCEPT
+{
+	if ( lipp::size( _conditions ) <= _files[lipp::size( _files ) - 1].conditionDepth )
 		return true;
+
+	// Error points at the unterminated directive
+	_lineNumber = _conditions[lipp::size( _conditions ) - 1].line;
+	self().set_error( error_type::mismatch_if );
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::parse_after_conditional( token &result ) LIPP_NOEXCEPT
+{
+	// Disabled code is jumped over without being tokenized or expanded, up to the directive ending it
+	if ( !_trueBlock && _chunks[lipp::size( _chunks ) - 1].kind == chunk_kind::source )
+	{
+		auto src = current_text();
+		size_t skipped = skip_disabled_block( data( src ), lipp::size( src ), _lineNumber );
+		advance( skipped );
+
+#if defined(LIPP_STATISTICS)
+		_statistics.bytesSkipped += skipped;
+#endif
 	}
-	else if ( directiveName == "error" )
+
+	return parse_next_token( result );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::take_guard_candidate() LIPP_NOEXCEPT
+{
+	auto &file = _files[lipp::size( _files ) - 1];
+	if ( file.guard != guard_state::ifndef_pending )
+		return false;
+
+	file.guard = guard_state::none;
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::finish_file( const source_chunk &chunk ) LIPP_NOEXCEPT
+{
+	auto &file = _files[lipp::size( _files ) - 1];
+
+	if ( chunk.cached && ( file.guard == guard_state::closed || lipp::size( file.recorded ) ) )
 	{
-		if ( is_inside_true_block() )
+		scoped_lock<include_cache_t> lock( get_include_cache() );
+
+		if ( file.guard == guard_state::closed )
+			get_include_cache()[chunk.cached - 1].guard = file.guardName;
+
+		if ( lipp::size( file.recorded ) )
+			get_include_cache().publish_tokens( chunk.cached - 1, file.recorded );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline const file_token *basic_preprocessor<T, D>::find_replay_token( file_state &file, size_t offset ) LIPP_NOEXCEPT
+{
+	if ( file.replayNext < file.replayCount && file.replay[file.replayNext].offset == offset )
+		return &file.replay[file.replayNext++];
+
+	// Cursor jumped, for example over a skipped block, which may not have been recorded
+	size_t low = 0, high = file.replayCount;
+	while ( low < high )
+	{
+		size_t middle = ( low + high ) / 2;
+
+		if ( file.replay[middle].offset < offset )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if ( low == file.replayCount || file.replay[low].offset != offset )
+		return nullptr;
+
+	file.replayNext = low + 1;
+	return &file.replay[low];
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::record_token( file_state &file, size_t offset, size_t whitespace, int lines,
+                                                              size_t length, token_type type ) LIPP_NOEXCEPT
+{
+	// Only forward progress is recorded, directives like `#pragma` may read the same tokens again
+	if ( size_t count = lipp::size( file.recorded ); count && file.recorded[count - 1].offset >= offset )
+		return;
+
+	if ( offset + whitespace + length > UINT32_MAX || lines > UINT16_MAX )
+	{
+		file.recording = false;
+		lipp::clear( file.recorded );
+		return;
+	}
+
+	uint8_t flags = 0;
+
+	// A line continuation counts as a new line too, but does not end the line
+	if ( lines )
+	{
+		string_view_t text = lipp::substr( chunk_text( _chunks[lipp::size( _chunks ) - 1] ), offset, whitespace );
+		int l = 0;
+		bool insideCommentBlock = false, stoppedAtEol = false;
+
+		skip_whitespace( data( text ), lipp::size( text ), true, l, insideCommentBlock, stoppedAtEol );
+		flags = stoppedAtEol ? file_token::end_of_line : 0;
+	}
+
+	push_back( file.recorded, { uint8_t( type ), flags, uint16_t( lines ), uint32_t( offset ), uint32_t( whitespace ), uint32_t( length ) } );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::compile_expression( compiled_expression &expression ) LIPP_NOEXCEPT
+{
+	// Operator waiting for its right operand, or an open parenthesis
+	struct pending
+	{
+		token_type type;
+		bool unary;
+		bool leftUnsigned; // Of the middle operand for ':'
+		size_t jump;       // Instruction to patch once the operator is applied
+	};
+
+	auto precedence = []( const pending &p ) -> int
+	{
+		if ( p.unary )
+			return 14;
+
+		switch ( p.type )
+		{
+		case token_type::multiply: case token_type::divide: case token_type::modulo: return 13;
+		case token_type::add: case token_type::subtract: return 12;
+		case token_type::shift_left: case token_type::shift_right: return 11;
+		case token_type::less: case token_type::less_equal: case token_type::greater: case token_type::greater_equal: return 10;
+		case token_type::equal: case token_type::not_equal: return 9;
+		case token_type::bit_and: return 8;
+		case token_type::bit_xor: return 7;
+		case token_type::bit_or: return 6;
+		case token_type::logical_and: return 5;
+		case token_type::logical_or: return 4;
+		case token_type::question: case token_type::colon: return 3;
+		default: return 0;
+		}
+	};
+
+	auto &code = expression.code;
+	code.clear();
+	expression.names.clear();
+
+	expression_stack_t<pending> operators;
+	expression_stack_t<uint8_t> operands; // Whether each operand is unsigned
+
+	auto emit = [&code]( uint8_t op, bool isUnsigned, uintmax_t value = 0 )
+	{
+		code.push( { op, uint8_t( isUnsigned ? expression_op::is_unsigned : 0 ), value } );
+		return lipp::size( code ) - 1;
+	};
+
+	auto popOperand = [&]( bool &isUnsigned )->bool
+	{
+		if ( !lipp::size( operands ) )
 		{
-			set_error( error_type::error_directive );
+			self().set_error( error_type::invalid_expression );
 			return false;
 		}
 
-		return parse_next_token( result );
-	}
-	else if ( directiveName == "include" )
+		isUnsigned = !!operands.back();
+		operands.pop();
+		return true;
+	};
+
+	auto apply = [&]( const pending &p )->bool
 	{
-		token t;
-		if ( !parse_next_token( t, parsing_flags::stop_at_eols ) )
+		bool x = false, y = false;
+
+		if ( p.type == token_type::parent_left || p.type == token_type::question || !popOperand( y ) )
+		{
+			self().set_error( error_type::invalid_expression );
+			return false;
+		}
+
+		if ( p.unary )
+		{
+			/**/ if ( p.type == token_type::subtract ) emit( expression_op::negate, y );
+			else if ( p.type == token_type::bit_not ) emit( expression_op::bit_not, y );
+			else if ( p.type == token_type::logical_not ) emit( expression_op::logical_not, y );
+
+			operands.push( p.type != token_type::logical_not && y );
+			return true;
+		}
+
+		// Left operand of these was already consumed by the jump
+		if ( p.type == token_type::logical_and || p.type == token_type::logical_or )
+		{
+			emit( expression_op::to_bool, y );
+			code[p.jump].value = lipp::size( code );
+			operands.push( false );
+			return true;
+		}
+
+		if ( p.type == token_type::colon )
+		{
+			code[p.jump].value = lipp::size( code );
+			operands.push( p.leftUnsigned || y );
+			return true;
+		}
+
+		if ( !popOperand( x ) )
+			return false;
+
+		bool isUnsigned = x || y;
+		bool resultUnsigned = isUnsigned;
+		uint8_t op = expression_op::push;
+
+		switch ( p.type )
 		{
-			set_error( error_type::syntax_error );
+		case token_type::multiply: op = expression_op::multiply; break;
+		case token_type::divide: op = expression_op::divide; break;
+		case token_type::modulo: op = expression_op::modulo; break;
+		case token_type::add: op = expression_op::add; break;
+		case token_type::subtract: op = expression_op::subtract; break;
+		case token_type::shift_left: op = expression_op::shift_left; isUnsigned = resultUnsigned = x; break;
+		case token_type::shift_right: op = expression_op::shift_right; isUnsigned = resultUnsigned = x; break;
+		case token_type::less: op = expression_op::less; resultUnsigned = false; break;
+		case token_type::less_equal: op = expression_op::less_equal; resultUnsigned = false; break;
+		case token_type::greater: op = expression_op::greater; resultUnsigned = false; break;
+		case token_type::greater_equal: op = expression_op::greater_equal; resultUnsigned = false; break;
+		case token_type::equal: op = expression_op::equal; resultUnsigned = false; break;
+		case token_type::not_equal: op = expression_op::not_equal; resultUnsigned = false; break;
+		case token_type::bit_and: op = expression_op::bit_and; break;
+		case token_type::bit_xor: op = expression_op::bit_xor; break;
+		case token_type::bit_or: op = expression_op::bit_or; break;
+		default:
+			self().set_error( error_type::invalid_expression );
 			return false;
 		}
 
-		bool isSystemPath = t.type == token_type::less;
-		string_t fileName;
+		emit( op, isUnsigned );
+		operands.push( resultUnsigned );
+		return true;
+	};
+
+	// Applies operators on the stack that bind at least as tight as `minPrecedence`
+	auto reduce = [&]( int minPrecedence )->bool
+	{
+		while ( lipp::size( operators ) && operators.back().type != token_type::parent_left &&
+		        precedence( operators.back() ) >= minPrecedence && operators.back().type != token_type::question )
+		{
+			auto p = operators.back();
+			operators.pop();
+
+			if ( !apply( p ) )
+				return false;
+		}
+
+		return true;
+	};
+
+	auto pushValue = [&]( uintmax_t value, bool isUnsigned )
+	{
+		emit( expression_op::push, isUnsigned, value );
+		operands.push( isUnsigned );
+	};
+
+	auto nameIndex = [&expression]( string_view_t name )
+	{
+		expression.names.insert( name );
+		return expression.names.find( name );
+	};
+
+	bool expectOperand = true;
+	token t;
+
+	for ( ;; )
+	{
+		_deferredValue = false;
+
+		if ( !parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::expand_macros | parsing_flags::defer_values ) )
+			break;
+
+		if ( expectOperand )
+		{
+			expectOperand = false;
+
+			if ( t.type == token_type::number )
+			{
+				uintmax_t value = 0;
+				bool isUnsigned = false;
+
+				if ( !parse_integer_literal( t.text, value, isUnsigned ) )
+				{
+					self().set_error( error_type::invalid_expression );
+					return false;
+				}
+
+				pushValue( value, isUnsigned );
+			}
+			else if ( t.type == token_type::string && lipp::char_at( t.text, 0 ) == '\'' )
+			{
+				uintmax_t value = 0;
+
+				if ( !parse_char_literal( t.text, value ) )
+				{
+					self().set_error( error_type::invalid_expression );
+					return false;
+				}
+
+				pushValue( value, false );
+			}
+			else if ( t.type == token_type::identifier && t.text == "defined" )
+			{
+				if ( !parse_next_token( t, parsing_flags::stop_at_eols ) )
+				{
+					self().set_error( error_type::expected_identifier );
+					return false;
+				}
+
+				bool parenthesized = t.type == token_type::parent_left;
+
+				if ( parenthesized && !parse_next_token( t, parsing_flags::stop_at_eols ) )
+				{
+					self().set_error( error_type::expected_identifier );
+					return false;
+				}
+
+				if ( t.type != token_type::identifier )
+				{
+					self().set_error( error_type::expected_identifier );
+					return false;
+				}
+
+				note_macro_query( t.text );
+				emit( expression_op::defined_macro, false, nameIndex( t.text ) );
+				operands.push( false );
+
+				if ( parenthesized && ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::parent_right ) )
+				{
+					self().set_error( error_type::syntax_error );
+					return false;
+				}
+			}
+			else if ( t.type == token_type::identifier && _deferredValue )
+			{
+				uintmax_t value = 0;
+				bool isUnsigned = false;
+
+				if ( const auto *m = lookup_macro( t.text, hash_string( t.text ) ); m )
+					macro_value( *m, value, isUnsigned );
+
+				emit( expression_op::load_macro, isUnsigned, nameIndex( t.text ) );
+				operands.push( isUnsigned );
+			}
+			else if ( t.type == token_type::identifier )
+			{
+				// Not a macro, or one which cannot be expanded here
+				pushValue( 0, false );
+			}
+			else if ( t.type == token_type::parent_left )
+			{
+				operators.push( { t.type, false, false, 0 } );
+				expectOperand = true;
+			}
+			else if ( t.type == token_type::add || t.type == token_type::subtract ||
+			          t.type == token_type::logical_not || t.type == token_type::bit_not )
+			{
+				operators.push( { t.type, true, false, 0 } );
+				expectOperand = true;
+			}
+			else
+			{
+				self().set_error( error_type::syntax_error );
+				return false;
+			}
+		}
+		else if ( t.type == token_type::parent_right )
+		{
+			if ( !reduce( 0 ) )
+				return false;
+
+			if ( !lipp::size( operators ) || operators.back().type != token_type::parent_left )
+			{
+				self().set_error( error_type::invalid_expression );
+				return false;
+			}
 
-		if ( t.type == token_type::string )
-			fileName = remove_first_and_last( t.text );
-		else if ( t.type == token_type::less )
+			operators.pop();
+		}
+		else if ( t.type == token_type::question )
 		{
-			while ( parse_next_token( t, parsing_flags::stop_at_eols ) )
-			{
-				if ( t.type == token_type::greater || t.type == token_type::string )
-					break;
+			// Right associative, a pending ':' belongs to an outer conditional
+			bool condition = false;
 
-				fileName += t.whitespace;
-				fileName += t.text;
-			}
+			if ( !reduce( 4 ) || !popOperand( condition ) )
+				return false;
 
-			if ( _error != error_type::none )
+			operators.push( { t.type, false, false, emit( expression_op::jump_if_zero, false ) } );
+			expectOperand = true;
+		}
+		else if ( t.type == token_type::colon )
+		{
+			bool isUnsigned = false;
+
+			if ( !reduce( 3 ) )
 				return false;
-			else if ( t.type != token_type::greater )
+
+			if ( !lipp::size( operators ) || operators.back().type != token_type::question || !popOperand( isUnsigned ) )
 			{
-				set_error( error_type::invalid_path );
+				self().set_error( error_type::invalid_expression );
 				return false;
 			}
+
+			// Middle operand skips the last one, false condition jumps right behind this
+			size_t jump = emit( expression_op::jump, false );
+			code[operators.back().jump].value = lipp::size( code );
+			operators.back() = { t.type, false, isUnsigned, jump };
+			expectOperand = true;
 		}
 		else
 		{
-			set_error( error_type::invalid_path );
-			return false;
-		}
-
-		// Remember already consumed whitespace from current source
-		_tempString = result.whitespace;
+			pending p = { t.type, false, false, 0 };
 
-		_source = substr( _source, _cursor );
-		_cursor = 0;
+			if ( !precedence( p ) )
+			{
+				self().set_error( error_type::syntax_error );
+				return false;
+			}
 
-		if ( !include_file( fileName, isSystemPath ) )
-		{
-			set_error( error_type::include_error );
-			return false;
-		}
+			if ( !reduce( precedence( p ) ) )
+				return false;
 
-		// Revert all counted lines
-		for ( size_t i = 0, S = lipp::size( _tempString ); i < S; ++i )
-			if ( _tempString[i] == '\n' )
-				--_lineNumber;
+			if ( t.type == token_type::logical_and || t.type == token_type::logical_or )
+			{
+				bool isUnsigned = false;
+				if ( !popOperand( isUnsigned ) )
+					return false;
 
-		_source = _tempString + _source;
+				p.jump = emit( t.type == token_type::logical_and ? expression_op::and_jump : expression_op::or_jump, isUnsigned );
+			}
 
-		return parse_next_token( result );
+			operators.push( p );
+			expectOperand = true;
+		}
 	}
-	else
+
+	if ( _error != error_type::none )
+		return false;
+
+	if ( expectOperand || !reduce( 0 ) || lipp::size( operators ) || lipp::size( operands ) != 1 )
 	{
-		return process_unknown_directive( directiveName );
+		self().set_error( error_type::invalid_expression );
+		return false;
 	}
 
+	expression.isUnsigned = !!operands.back();
 	return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-template <class T> inline int preprocessor<T>::evaluate_expression() LIPP_NOEXCEPT
+template <class T, class D> inline bool basic_preprocessor<T, D>::run_expression( const compiled_expression &expression, uintmax_t &value ) LIPP_NOEXCEPT
 {
-	token_type operatorStack[expression_stack_size] = { };
-	size_t operatorStackSize = 0;
+	const auto &code = expression.code;
+	expression_stack_t<uintmax_t> stack;
+
+	// Every load is checked up front, also those a jump would skip, because any of them changing into
+	// something else than an integer may change how the line parses
+	for ( size_t pc = 0, S = lipp::size( code ); pc < S; ++pc )
+	{
+		if ( code[pc].code != expression_op::load_macro )
+			continue;
+
+		uintmax_t x = 0;
+		bool xUnsigned = false;
+		size_t name = size_t( code[pc].value );
+
+		if ( const auto *m = lookup_macro( expression.names[name], expression.names.hash( name ) ); m && !macro_value( *m, x, xUnsigned ) )
+			return false;
 
-	int valueStack[expression_stack_size] = { };
-	size_t valueStackSize = 0;
+		if ( xUnsigned != !!( code[pc].flags & expression_op::is_unsigned ) )
+			return false;
+	}
 
-	auto popOperator = [&]()->bool
+	// Arithmetic is done on unsigned values, so signed overflow wraps instead of being undefined
+	for ( size_t pc = 0, S = lipp::size( code ); pc < S; )
 	{
-		if ( !operatorStackSize || !valueStackSize )
+		const auto &op = code[pc++];
+		bool isUnsigned = !!( op.flags & expression_op::is_unsigned );
+
+		switch ( op.code )
 		{
-			set_error( error_type::invalid_expression );
-			return false;
-		}
+		case expression_op::push: stack.push( op.value ); continue;
+		case expression_op::load_macro:
+		{
+			uintmax_t x = 0;
+			bool xUnsigned = false;
 
-		auto op = operatorStack[--operatorStackSize];
-		auto y = valueStack[--valueStackSize];
+			if ( const auto *m = lookup_macro( expression.names[size_t( op.value )], expression.names.hash( size_t( op.value ) ) ); m )
+				macro_value( *m, x, xUnsigned );
 
-		if ( op != token_type::logical_not )
+			stack.push( x );
+			continue;
+		}
+		case expression_op::defined_macro:
+			stack.push( self().find_macro( expression.names[size_t( op.value )] ) ? 1 : 0 );
+			continue;
+		case expression_op::jump: pc = size_t( op.value ); continue;
+		case expression_op::jump_if_zero:
 		{
-			if ( !valueStackSize )
-			{
-				set_error( error_type::invalid_expression );
-				return false;
-			}
+			auto x = stack.back();
+			stack.pop();
 
-			auto x = valueStack[--valueStackSize];
-			decltype( x ) z = 0;
+			if ( !x )
+				pc = size_t( op.value );
 
-			/**/ if ( op == token_type::add )
-				z = x + y;
-			else if ( op == token_type::subtract )
-				z = x - y;
-			else if ( op == token_type::multiply )
-				z = x * y;
-			else if ( op == token_type::divide )
+			continue;
+		}
+		case expression_op::and_jump:
+		case expression_op::or_jump:
+			if ( ( stack.back() != 0 ) == ( op.code == expression_op::or_jump ) )
 			{
-				if ( y == 0 )
-				{
-					set_error( error_type::division_by_zero );
-					return false;
-				}
-
-				z = x / y;
+				stack.back() = stack.back() != 0;
+				pc = size_t( op.value );
 			}
-			else if ( op == token_type::less )
-				z = ( x < y ) ? 1 : 0;
-			else if ( op == token_type::less_equal )
-				z = ( x <= y ) ? 1 : 0;
-			else if ( op == token_type::greater )
-				z = ( x > y ) ? 1 : 0;
-			else if ( op == token_type::greater_equal )
-				z = ( x >= y ) ? 1 : 0;
-			else if ( op == token_type::equal )
-				z = ( x == y ) ? 1 : 0;
-			else if ( op == token_type::not_equal )
-				z = ( x != y ) ? 1 : 0;
-			else if ( op == token_type::logical_and )
-				z = ( x && y ) ? 1 : 0;
-			else if ( op == token_type::logical_or )
-				z = ( x || y ) ? 1 : 0;
 			else
+				stack.pop();
+
+			continue;
+		case expression_op::negate: stack.back() = 0 - stack.back(); continue;
+		case expression_op::bit_not: stack.back() = ~stack.back(); continue;
+		case expression_op::logical_not: stack.back() = stack.back() == 0; continue;
+		case expression_op::to_bool: stack.back() = stack.back() != 0; continue;
+		default: break;
+		}
+
+		auto y = stack.back();
+		stack.pop();
+
+		auto &x = stack.back();
+		auto sx = intmax_t( x ), sy = intmax_t( y );
+
+		switch ( op.code )
+		{
+		case expression_op::multiply: x = x * y; break;
+		case expression_op::divide:
+		case expression_op::modulo:
+			if ( !y )
 			{
-				set_error( error_type::invalid_expression );
+				self().set_error( error_type::division_by_zero );
 				return false;
 			}
 
-			valueStack[valueStackSize++] = z;
-			valueStack[valueStackSize] = 0;
-		}
-		else
-		{
-			valueStack[valueStackSize++] = ( y == 0 ) ? 1 : 0;
+			// INTMAX_MIN / -1 overflows, it wraps like the other operations
+			/**/ if ( isUnsigned ) x = op.code == expression_op::divide ? x / y : x % y;
+			else if ( sy == -1 ) x = op.code == expression_op::divide ? 0 - x : 0;
+			else x = uintmax_t( op.code == expression_op::divide ? sx / sy : sx % sy );
+			break;
+		case expression_op::add: x = x + y; break;
+		case expression_op::subtract: x = x - y; break;
+		case expression_op::shift_left: x = y < sizeof( uintmax_t ) * 8 ? x << y : 0; break;
+		case expression_op::shift_right:
+			if ( y >= sizeof( uintmax_t ) * 8 )
+				x = ( isUnsigned || sx >= 0 ) ? 0 : ~uintmax_t( 0 );
+			else
+				x = isUnsigned ? x >> y : uintmax_t( sx >> y );
+			break;
+		case expression_op::less: x = isUnsigned ? x < y : sx < sy; break;
+		case expression_op::less_equal: x = isUnsigned ? x <= y : sx <= sy; break;
+		case expression_op::greater: x = isUnsigned ? x > y : sx > sy; break;
+		case expression_op::greater_equal: x = isUnsigned ? x >= y : sx >= sy; break;
+		case expression_op::equal: x = x == y; break;
+		case expression_op::not_equal: x = x != y; break;
+		case expression_op::bit_and: x = x & y; break;
+		case expression_op::bit_xor: x = x ^ y; break;
+		case expression_op::bit_or: x = x | y; break;
+		default:
+			self().set_error( error_type::invalid_expression );
+			return false;
 		}
+	}
 
-		return true;
-	};
+	value = stack[0];
+	return true;
+}
 
-	token t;
-	while ( parse_next_token( t, parsing_flags::stop_at_eols | parsing_flags::expand_macros ) )
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline bool basic_preprocessor<T, D>::macro_value( const typename macro_table<T>::entry &m, uintmax_t &value,
+                                                             bool &isUnsigned ) const LIPP_NOEXCEPT
+{
+	if ( ( m.flags & macro_flags::function_like ) || m.tokenCount != 1 )
+		return false;
+
+	const auto &t = _macros.token( m.tokens );
+	return t.type == token_type::number && parse_integer_literal( _macros.text( t ), value, isUnsigned );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline void basic_preprocessor<T, D>::add_expression_dependency( string_view_t name, uint32_t stamp ) LIPP_NOEXCEPT
+{
+	for ( const auto &d : *_expressionDependencies )
+		if ( string_view_t( d.name ) == name )
+			return;
+
+	push_back( *_expressionDependencies, { string_t( name ), hash_string( name ), stamp } );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T, class D> inline intmax_t basic_preprocessor<T, D>::evaluate_expression() LIPP_NOEXCEPT
+{
+	// Lines with comments or continuations are compiled every time, they are rare and would need the lexer to compare
+	string_view_t line = current_text();
+	size_t lineLength = scan_line( data( line ), lipp::size( line ) );
+	size_t begin = 0;
+
+	while ( begin < lineLength && uint8_t( lipp::char_at( line, begin ) ) <= ' ' )
+		++begin;
+
+	while ( lineLength > begin && uint8_t( lipp::char_at( line, lineLength - 1 ) ) <= ' ' )
+		--lineLength;
+
+	line = lipp::substr( line, begin, lineLength - begin );
+
+	// Answers of the `find_macro` hook have no stamps, conditions are not cached while it is on
+	bool cacheable = lipp::size( line ) && lipp::char_at( line, lipp::size( line ) - 1 ) != '\\' && !find_macro_hooked();
+	for ( size_t i = 1, S = lipp::size( line ); cacheable && i < S; ++i )
+		if ( lipp::char_at( line, i - 1 ) == '/' && ( lipp::char_at( line, i ) == '/' || lipp::char_at( line, i ) == '*' ) )
+			cacheable = false;
+
+	size_t index = cacheable ? _expressionTexts.find( line ) : lipp::size( _expressionTexts );
+
+	if ( index < lipp::size( _expressionTexts ) )
 	{
-		bool addOperator = false;
+		auto &cached = _expressions[index];
+		bool valid = true;
 
-		if ( t.type == token_type::number )
+		if ( cached.stamp != _macros.stamp() )
 		{
-			if ( valueStackSize == expression_stack_size )
+			for ( const auto &d : cached.dependencies )
 			{
-				set_error( error_type::expression_too_complex );
-				return 0;
+				const auto *m = _macros.find( d.name, d.hash );
+				if ( ( m ? m->stamp : 0 ) != d.stamp )
+				{
+					valid = false;
+					break;
+				}
 			}
 
-			valueStack[valueStackSize++] = atoi( data( t.text ) );
+			valid = valid && run_expression( cached.expression, cached.value );
+			if ( _error != error_type::none )
+				return 0;
 		}
-		else if ( t.type == token_type::identifier && t.text == "defined" )
+
+		if ( valid )
 		{
-			if ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::parent_left )
-			{
-				set_error( error_type::syntax_error );
-				return 0;
-			}
+			cached.stamp = _macros.stamp();
+			advance( begin + lipp::size( line ) );
 
-			if ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::identifier )
+			if ( _recordDependencies )
 			{
-				set_error( error_type::expected_identifier );
-				return 0;
-			}
+				for ( const auto &d : cached.dependencies )
+					_queriedMacros.insert( d.name );
 
-			if ( valueStackSize == expression_stack_size )
-			{
-				set_error( error_type::expression_too_complex );
-				return 0;
+				for ( size_t i = 0, S = lipp::size( cached.expression.names ); i < S; ++i )
+					_queriedMacros.insert( cached.expression.names[i] );
 			}
 
-			if ( find_macro( t.text ) )
-				valueStack[valueStackSize++] = 1;
-			else
-				valueStack[valueStackSize++] = 0;
-
-			if ( !parse_next_token( t, parsing_flags::stop_at_eols ) || t.type != token_type::parent_right )
-			{
-				set_error( error_type::syntax_error );
-				return 0;
-			}
+			return intmax_t( cached.value );
 		}
-		else if ( t.type == token_type::parent_right )
-		{
-			while ( operatorStackSize > 0 && operatorStack[operatorStackSize - 1] != token_type::parent_left )
-			{
-				if ( !popOperator() )
-					return 0;
-			}
+	}
 
-			if ( !operatorStackSize || operatorStack[operatorStackSize - 1] != token_type::parent_left )
-			{
-				set_error( error_type::invalid_expression );
-				return 0;
-			}
+	// Text may move while the line is read
+	string_t key = cacheable ? string_t( line ) : string_t();
+
+	cached_expression compiled;
+	_expressionDependencies = &compiled.dependencies;
+	bool ok = compile_expression( compiled.expression );
+	_expressionDependencies = nullptr;
+
+	if ( !ok || !run_expression( compiled.expression, compiled.value ) )
+		return 0;
+
+	if ( cacheable )
+	{
+		compiled.stamp = _macros.stamp();
 
-			--operatorStackSize;
+		if ( index == lipp::size( _expressionTexts ) )
+		{
+			_expressionTexts.insert( key );
+			push_back( _expressions, static_cast<cached_expression &&>( compiled ) );
 		}
-		else if ( t.type >= token_type::parent_left && t.type <= token_type::assign )
-			addOperator = true;
 		else
+			_expressions[index] = static_cast<cached_expression &&>( compiled );
+
+		return intmax_t( _expressions[index].value );
+	}
+
+	return intmax_t( compiled.value );
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Hooks of `basic_preprocessor` as virtual functions, to be overridden without templates
+template <class T>
+class preprocessor : public basic_preprocessor<T, preprocessor<T>>
+{
+	using base_t = basic_preprocessor<T, preprocessor<T>>;
+	friend base_t;
+
+public:
+	using traits_t = T;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+
+	preprocessor() = default;
+
+	virtual ~preprocessor() = default;
+
+	using base_t::define;
+
+	virtual bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT { return base_t::define( name, value ); }
+
+	virtual bool undef( string_view_t name ) LIPP_NOEXCEPT { return base_t::undef( name ); }
+
+	virtual const char_t *find_macro( string_view_t name ) const LIPP_NOEXCEPT { return base_t::find_macro( name ); }
+
+	virtual void reset() LIPP_NOEXCEPT { base_t::reset(); }
+
+	using base_t::include_string;
+
+	virtual bool include_string( string_view_t src, string_view_t sourceName ) LIPP_NOEXCEPT
+	{ return base_t::include_string( src, sourceName ); }
+
+	using base_t::include_file;
+
+	virtual bool include_file( string_view_t fileName, bool isSystemPath ) LIPP_NOEXCEPT
+	{ return base_t::include_file( fileName, isSystemPath ); }
+
+protected:
+	virtual void set_error( error_type e ) LIPP_NOEXCEPT { base_t::set_error( e ); }
+
+	virtual bool read_file( string_view_t fileName, string_t &output ) LIPP_NOEXCEPT { return base_t::read_file( fileName, output ); }
+
+	virtual bool file_exists( string_view_t fileName ) LIPP_NOEXCEPT { return base_t::file_exists( fileName ); }
+
+	virtual int process_unknown_directive( string_view_t name ) LIPP_NOEXCEPT { return base_t::process_unknown_directive( name ); }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes `target: prerequisites` in the format of `gcc -MD`, which both Make and Ninja read. With
+// `phonyTargets`, every prerequisite except the first one gets an empty rule too, like `gcc -MP`
+// adds, so Make does not stop when a header is deleted.
+template <class T>
+inline bool write_depfile( FILE *file, typename T::string_view_t target, const name_set<T> &files,
+                           bool phonyTargets = false ) LIPP_NOEXCEPT
+{
+	auto writePath = [file]( typename T::string_view_t path )
+	{
+		for ( size_t i = 0, S = lipp::size( path ); i < S; ++i )
 		{
-			set_error( error_type::syntax_error );
-			return 0;
+			auto c = path[i];
+
+			/**/ if ( c == ' ' || c == '#' ) fputc( '\\', file );
+			else if ( c == '$' ) fputc( '$', file );
+
+			fputc( char( c ), file );
 		}
+	};
 
-		if ( addOperator )
-		{
-			while ( operatorStackSize > 0 )
-			{
-				auto topOperator = operatorStack[operatorStackSize - 1];
-				if ( topOperator >= t.type || topOperator == token_type::parent_left )
-					break;
+	writePath( target );
+	fputc( ':', file );
 
-				if ( !popOperator() )
-					return 0;
-			}
+	for ( size_t i = 0, S = lipp::size( files ); i < S; ++i )
+	{
+		fputs( " \\\n  ", file );
+		writePath( files[i] );
+	}
 
-			if ( operatorStackSize == expression_stack_size )
-			{
-				set_error( error_type::expression_too_complex );
-				return 0;
-			}
+	fputc( '\n', file );
 
-			operatorStack[operatorStackSize++] = t.type;
-		}
+	for ( size_t i = 1, S = lipp::size( files ); phonyTargets && i < S; ++i )
+	{
+		fputc( '\n', file );
+		writePath( files[i] );
+		fputs( ":\n", file );
 	}
 
-	while ( operatorStackSize > 0 )
+	return !ferror( file );
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Token sink for `preprocessor::read_all`, output is gathered in a fixed size block which is written
+// to a `FILE *` or a file descriptor once full, so memory stays bounded whatever the output size is.
+template <class T>
+class file_writer
+{
+public:
+	using traits_t = T;
+	using char_t = typename traits_t::char_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+
+	static constexpr size_t default_block_size = 1 << 20;
+
+	explicit file_writer( FILE *file, size_t blockSize = default_block_size ) LIPP_NOEXCEPT
+		: _file( file ) { resize( _block, blockSize ); }
+
+	explicit file_writer( int fd, size_t blockSize = default_block_size ) LIPP_NOEXCEPT
+		: _fd( fd ) { resize( _block, blockSize ); }
+
+	file_writer( const file_writer & ) = delete;
+
+	file_writer &operator=( const file_writer & ) = delete;
+
+	~file_writer() { flush(); }
+
+	void operator()( string_view_t whitespace, string_view_t text ) LIPP_NOEXCEPT
 	{
-		if ( !popOperator() )
-			return 0;
+		write( whitespace );
+		write( text );
+	}
+
+	bool write( string_view_t str ) LIPP_NOEXCEPT;
+
+	bool flush() LIPP_NOEXCEPT;
+
+	// Some write did not go through, rest of the output is dropped
+	bool failed() const LIPP_NOEXCEPT { return _failed; }
+
+protected:
+	bool write_out( const char_t *str, size_t length ) LIPP_NOEXCEPT;
+
+	vector_t<char_t> _block;
+
+	size_t _used = 0;
+
+	FILE *_file = nullptr;
+
+	int _fd = -1;
+
+	bool _failed = false;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool file_writer<T>::write( string_view_t str ) LIPP_NOEXCEPT
+{
+	size_t length = lipp::size( str );
+	if ( !length )
+		return !_failed;
+
+	if ( _used + length > lipp::size( _block ) )
+	{
+		if ( !flush() )
+			return false;
+
+		// Does not fit even into an empty block
+		if ( length > lipp::size( _block ) )
+			return write_out( data( str ), length );
+	}
+
+	memcpy( &_block[_used], data( str ), length * sizeof( char_t ) );
+	_used += length;
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool file_writer<T>::flush() LIPP_NOEXCEPT
+{
+	if ( !_used )
+		return !_failed;
+
+	size_t used = _used;
+	_used = 0;
+
+	return write_out( &_block[0], used );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class T> inline bool file_writer<T>::write_out( const char_t *str, size_t length ) LIPP_NOEXCEPT
+{
+	if ( _failed )
+		return false;
+
+	if ( _file )
+	{
+		_failed = fwrite( str, sizeof( char_t ), length, _file ) != length;
+		return !_failed;
 	}
 
-	if ( valueStackSize != 1 )
+	// Descriptor writes may be partial
+	const char *bytes = reinterpret_cast<const char *>( str );
+	size_t remaining = length * sizeof( char_t );
+
+	while ( remaining )
 	{
-		set_error( error_type::invalid_expression );
-		return 0;
+#if defined(_WIN32)
+		auto written = _write( _fd, bytes, unsigned( remaining < 0x40000000 ? remaining : 0x40000000 ) );
+#else
+		auto written = ::write( _fd, bytes, remaining );
+#endif
+		if ( written <= 0 )
+		{
+			_failed = true;
+			return false;
+		}
+
+		bytes += written;
+		remaining -= size_t( written );
 	}
 
-	return valueStack[0];
+	return true;
 }
 
 } // namespace lipp
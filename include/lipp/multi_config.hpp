@@ -0,0 +1,229 @@
+#pragma once
+
+#include <lipp/lipp.hpp>
+
+namespace lipp {
+
+// Preprocesses one file under many configurations, each a set of predefined macros on top of common ones,
+// like permutations of a shader. Configurations are bits of a mask. A run of one configuration records the
+// macros it looked up (see `preprocessor::record_dependencies`), and every configuration defining those the
+// same way gets its output without being run, so the number of runs is the number of configurations that
+// really differ for the file. Runs replay tokens from a shared include cache, files are read and lexed once
+// no matter how many runs there are. Outputs that are identical anyway are merged too.
+template <class Preprocessor>
+class multi_config_preprocessor
+{
+public:
+	using preprocessor_t = Preprocessor;
+	using traits_t = typename preprocessor_t::traits_t;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	using macros_t = typename preprocessor_t::macros_t;
+	using names_t = typename preprocessor_t::names_t;
+
+	// Bit `c % 64` of word `c / 64` stands for configuration `c`
+	using mask_t = vector_t<uint64_t>;
+
+	multi_config_preprocessor() LIPP_NOEXCEPT { _pp.set_token_replay( true ); }
+
+	// Common to all configurations
+	bool define( string_view_t name, string_view_t value ) LIPP_NOEXCEPT { return _common.define( name, value ); }
+
+	bool define( string_view_t name ) LIPP_NOEXCEPT { return _common.define( name ); }
+
+	bool undef( string_view_t name ) LIPP_NOEXCEPT { return _common.undef( name ); }
+
+	// Index of a new configuration with only the common macros
+	size_t add_configuration() LIPP_NOEXCEPT;
+
+	// Applied after the common macros, in the order they were given
+	void define( size_t config, string_view_t name, string_view_t value ) LIPP_NOEXCEPT { add_change( config, name, value, false ); }
+
+	void undef( size_t config, string_view_t name ) LIPP_NOEXCEPT { add_change( config, name, string_view_t(), true ); }
+
+	size_t configuration_count() const LIPP_NOEXCEPT { return lipp::size( _configs ); }
+
+	// For include directories and such, it is reset by every run
+	preprocessor_t &get_preprocessor() LIPP_NOEXCEPT { return _pp; }
+
+	// Preprocesses `fileName` under every configuration, returns number of configurations that failed
+	size_t run( string_view_t fileName ) LIPP_NOEXCEPT;
+
+	// Distinct outputs of the last `run`
+	size_t output_count() const LIPP_NOEXCEPT { return lipp::size( _outputs ); }
+
+	string_view_t output( size_t index ) const LIPP_NOEXCEPT { return _outputs[index].text; }
+
+	const mask_t &output_configurations( size_t index ) const LIPP_NOEXCEPT { return _outputs[index].configs; }
+
+	error_type output_error( size_t index ) const LIPP_NOEXCEPT { return _outputs[index].error; }
+
+	size_t output_of( size_t config ) const LIPP_NOEXCEPT { return _configs[config].output; }
+
+	// Preprocessor runs the last `run` took, at most `output_count`
+	size_t run_count() const LIPP_NOEXCEPT { return _runCount; }
+
+	static bool test( const mask_t &mask, size_t config ) LIPP_NOEXCEPT
+	{ return config / 64 < lipp::size( mask ) && ( mask[config / 64] >> ( config % 64 ) & 1 ); }
+
+protected:
+	struct change
+	{
+		string_t name;
+		string_t value;
+		bool undef;
+	};
+
+	struct configuration
+	{
+		vector_t<change> changes;
+		macros_t macros; // Common ones with the changes applied, built by `run`
+		size_t output;
+	};
+
+	struct result
+	{
+		string_t text;
+		uint64_t hash;
+		error_type error;
+		mask_t configs;
+	};
+
+	void add_change( size_t config, string_view_t name, string_view_t value, bool undef ) LIPP_NOEXCEPT;
+
+	static void set( mask_t &mask, size_t config ) LIPP_NOEXCEPT
+	{
+		if ( lipp::size( mask ) <= config / 64 )
+			resize( mask, config / 64 + 1 );
+
+		mask[config / 64] |= uint64_t( 1 ) << ( config % 64 );
+	}
+
+	preprocessor_t _common;
+
+	preprocessor_t _pp;
+
+	vector_t<configuration> _configs;
+
+	// Changed by any configuration, the only names whose definitions differ between them
+	names_t _changed;
+
+	vector_t<result> _outputs;
+
+	size_t _runCount = 0;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline size_t multi_config_preprocessor<P>::add_configuration() LIPP_NOEXCEPT
+{
+	resize( _configs, lipp::size( _configs ) + 1 );
+	return lipp::size( _configs ) - 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline void multi_config_preprocessor<P>::add_change( size_t config, string_view_t name,
+                                                                       string_view_t value, bool undef ) LIPP_NOEXCEPT
+{
+	push_back( _configs[config].changes, change{ string_t( name ), string_t( value ), undef } );
+
+	// Parameters of function-like macros are not part of the name
+	size_t begin = 0, end = 0;
+	while ( begin < lipp::size( name ) && name[begin] <= 32 )
+		++begin;
+
+	for ( end = begin; end < lipp::size( name ) && name[end] > 32 && name[end] != '('; )
+		++end;
+
+	_changed.insert( substr( name, begin, end - begin ) );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline size_t multi_config_preprocessor<P>::run( string_view_t fileName ) LIPP_NOEXCEPT
+{
+	size_t configCount = lipp::size( _configs );
+	size_t failed = 0;
+
+	clear( _outputs );
+	_runCount = 0;
+
+	for ( auto &c : _configs )
+	{
+		_pp.reset();
+		_pp.share_macros( _common.macros() );
+
+		for ( const auto &ch : c.changes )
+		{
+			if ( ch.undef )
+				_pp.undef( ch.name );
+			else
+				_pp.define( ch.name, ch.value );
+		}
+
+		c.macros = _pp.macros();
+		c.output = SIZE_MAX;
+	}
+
+	vector_t<string_view_t> relevant;
+
+	for ( size_t first = 0; first < configCount; ++first )
+	{
+		if ( _configs[first].output != SIZE_MAX )
+			continue;
+
+		_pp.reset();
+		_pp.share_macros( _configs[first].macros );
+		_pp.record_dependencies( true );
+
+		bool included = _pp.include_file( fileName );
+		string_t text = included ? _pp.read_all() : string_t();
+		error_type error = _pp.error() != error_type::none ? _pp.error() : included ? error_type::none : error_type::read_failed;
+
+		_pp.record_dependencies( false );
+		++_runCount;
+
+		// Changed names the run asked about, other configurations agreeing on them would produce the same
+		clear( relevant );
+		const auto &queried = _pp.queried_macros();
+
+		for ( size_t i = 0, S = _changed.size(); i < S; ++i )
+		{
+			if ( queried.find( _changed[i] ) < queried.size() )
+				push_back( relevant, _changed[i] );
+		}
+
+		// Same text as an earlier run, which can happen even when the configurations differ
+		uint64_t hash = hash_content( string_view_t( text ) );
+		size_t index = 0;
+
+		while ( index < lipp::size( _outputs ) && !( _outputs[index].hash == hash && _outputs[index].error == error &&
+		                                             string_view_t( _outputs[index].text ) == string_view_t( text ) ) )
+			++index;
+
+		if ( index == lipp::size( _outputs ) )
+			push_back( _outputs, result{ static_cast<string_t &&>( text ), hash, error, mask_t() } );
+
+		for ( size_t c = first; c < configCount; ++c )
+		{
+			auto &config = _configs[c];
+			if ( config.output != SIZE_MAX )
+				continue;
+
+			bool same = true;
+			for ( size_t i = 0, S = lipp::size( relevant ); i < S && same; ++i )
+				same = config.macros.same_definition( relevant[i], _configs[first].macros );
+
+			if ( same )
+			{
+				config.output = index;
+				set( _outputs[index].configs, c );
+				failed += error != error_type::none;
+			}
+		}
+	}
+
+	return failed;
+}
+
+} // namespace lipp
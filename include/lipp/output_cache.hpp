@@ -0,0 +1,550 @@
+#pragma once
+
+#include <lipp/lipp.hpp>
+
+#if defined(_WIN32)
+	#include <direct.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <io.h>
+	#include <process.h>
+	#include <sys/stat.h>
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace lipp {
+
+// Outputs of earlier runs stored in a local directory, so a file whose inputs did not change is not
+// preprocessed again. An output is keyed by the main file, content hashes of every file it included and
+// definitions of the macros it looked up (see `preprocessor::record_dependencies`), macros it never
+// asked about do not matter, and by the include directories and output settings. The directory holds
+// one file per output and a binary `index` with the dependencies of each, which is memory mapped for
+// lookups. Several processes may share the directory, stores merge the index while holding a lock on
+// `index.lock`.
+template <class Preprocessor>
+class output_cache
+{
+public:
+	using preprocessor_t = Preprocessor;
+	using traits_t = typename preprocessor_t::traits_t;
+	using char_t = typename traits_t::char_t;
+	using string_t = typename traits_t::string_t;
+	using string_view_t = typename traits_t::string_view_t;
+	template <typename U> using vector_t = typename traits_t::template vector_t<U>;
+	using macros_t = typename preprocessor_t::macros_t;
+	using names_t = typename preprocessor_t::names_t;
+
+	static_assert( sizeof( char_t ) == 1, "output cache stores raw bytes" );
+
+	// Directory is created when the first output is stored
+	explicit output_cache( string_view_t directory ) LIPP_NOEXCEPT : _directory( directory ) { }
+
+	// Output stored for `fileName` and the current macros of `pp`, false when there is none
+	bool lookup( const preprocessor_t &pp, string_view_t fileName, string_t &output ) LIPP_NOEXCEPT;
+
+	// Stored output when there is one, otherwise includes `fileName` into `pp`, reads all of it and
+	// stores the result. False when preprocessing failed, `pp.error()` then tells.
+	bool read_all( preprocessor_t &pp, string_view_t fileName, string_t &output ) LIPP_NOEXCEPT;
+
+	// Dependencies of the last run of `pp`, which started with `initial` macros
+	bool store( string_view_t fileName, const macros_t &initial, const preprocessor_t &pp, string_view_t output ) LIPP_NOEXCEPT;
+
+	string_view_t directory() const LIPP_NOEXCEPT { return _directory; }
+
+protected:
+	static constexpr uint32_t index_magic = 0x4350504c; // "LPPC"
+	static constexpr uint32_t index_version = 1;
+
+	struct index_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t entryCount;
+		uint32_t size;        // Of the whole index
+	};
+
+	// Follows the header, dependencies of all entries come after the last entry
+	struct index_entry
+	{
+		uint64_t main;        // Hash of the normalized main file path
+		uint64_t key;         // Hash of everything, names the output file
+		uint32_t dependencies;
+		uint32_t dependencyCount;
+	};
+
+	enum : uint32_t
+	{
+		dependency_file,
+		dependency_macro,
+	};
+
+	// Followed by the name, padded to 8 bytes
+	struct dependency
+	{
+		uint64_t hash;        // Of the file content, of the macro definition or zero when it is not defined
+		uint32_t kind;
+		uint32_t nameLength;
+	};
+
+	static uint64_t macro_hash( const macros_t &macros, string_view_t name ) LIPP_NOEXCEPT;
+
+	// Main file path together with settings of `pp` the output depends on
+	static uint64_t main_hash( const preprocessor_t &pp, string_view_t main ) LIPP_NOEXCEPT;
+
+	static bool hash_file( string_view_t path, uint64_t &hash ) LIPP_NOEXCEPT;
+
+	static bool read_file( string_view_t path, string_t &output ) LIPP_NOEXCEPT;
+
+	static bool write_file( string_view_t path, const char_t *content, size_t length ) LIPP_NOEXCEPT;
+
+	// Written to a name no other writer uses and renamed, so readers never see a partial file
+	static bool replace_file( const string_t &path, uint64_t key, const char_t *content, size_t length ) LIPP_NOEXCEPT;
+
+	// Blocks until this process holds the lock, released by closing the returned descriptor, -1 on failure
+	static int lock_file( const string_t &path ) LIPP_NOEXCEPT;
+
+	static void unlock_file( int fd ) LIPP_NOEXCEPT;
+
+	static void append( vector_t<char_t> &buffer, const void *bytes, size_t length ) LIPP_NOEXCEPT;
+
+	static uint64_t mix( uint64_t hash, uint64_t value ) LIPP_NOEXCEPT { return ( hash ^ value ) * 1099511628211ull; }
+
+	string_t file_path( string_view_t name ) const LIPP_NOEXCEPT;
+
+	string_t output_path( uint64_t key ) const LIPP_NOEXCEPT;
+
+	string_t _directory;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P>
+inline bool output_cache<P>::lookup( const preprocessor_t &pp, string_view_t fileName, string_t &output ) LIPP_NOEXCEPT
+{
+	string_t main( fileName );
+	normalize_path( main );
+
+	string_t indexPath = file_path( "index" );
+	string_t indexContent;
+	size_t mappedLength = 0;
+	const void *mapping = map_file( indexPath.c_str(), mappedLength );
+
+	if ( !mapping && !read_file( indexPath, indexContent ) )
+		return false;
+
+	const char *index = mapping ? static_cast<const char *>( mapping ) : data( indexContent );
+	size_t indexLength = mapping ? mappedLength : lipp::size( indexContent );
+
+	index_header header = { };
+	bool found = false;
+
+	if ( indexLength >= sizeof( header ) )
+		memcpy( &header, index, sizeof( header ) );
+
+	uint64_t mainHash = main_hash( pp, main );
+
+	// Same files are usually checked for many entries
+	names_t files;
+	vector_t<uint64_t> fileHashes;
+
+	bool valid = header.magic == index_magic && header.version == index_version && header.size == indexLength &&
+	             header.entryCount <= ( indexLength - sizeof( header ) ) / sizeof( index_entry );
+
+	// Newest entries are at the end
+	for ( size_t i = valid ? header.entryCount : 0; i-- > 0 && !found; )
+	{
+		index_entry e = { };
+		memcpy( &e, index + sizeof( header ) + i * sizeof( index_entry ), sizeof( e ) );
+
+		if ( e.main != mainHash )
+			continue;
+
+		bool match = true;
+		size_t offset = e.dependencies;
+
+		for ( size_t d = 0; d < e.dependencyCount && match; ++d )
+		{
+			dependency dep = { };
+
+			if ( offset + sizeof( dep ) > indexLength )
+			{
+				match = false;
+				break;
+			}
+
+			memcpy( &dep, index + offset, sizeof( dep ) );
+			offset += sizeof( dep );
+
+			if ( offset + dep.nameLength > indexLength )
+			{
+				match = false;
+				break;
+			}
+
+			string_view_t name( index + offset, dep.nameLength );
+			offset += ( dep.nameLength + 7 ) & ~size_t( 7 );
+
+			if ( dep.kind == dependency_macro )
+			{
+				match = macro_hash( pp.macros(), name ) == dep.hash;
+			}
+			else
+			{
+				size_t f = files.find( name );
+
+				if ( f == lipp::size( files ) )
+				{
+					uint64_t hash = 0;
+					files.insert( name );
+					push_back( fileHashes, hash_file( name, hash ) ? hash : 0 );
+				}
+
+				match = fileHashes[f] == dep.hash;
+			}
+		}
+
+		found = match && read_file( output_path( e.key ), output );
+	}
+
+	if ( mapping )
+		unmap_file( mapping, mappedLength );
+
+	return found;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P>
+inline bool output_cache<P>::read_all( preprocessor_t &pp, string_view_t fileName, string_t &output ) LIPP_NOEXCEPT
+{
+	if ( lookup( pp, fileName, output ) )
+		return true;
+
+	// Macros the run starts from, it may change them
+	macros_t initial( pp.macros() );
+
+	pp.record_dependencies( true );
+	bool included = pp.include_file( fileName );
+	output = pp.read_all();
+	pp.record_dependencies( false );
+
+	if ( !included || pp.error() != error_type::none )
+		return false;
+
+	// Output is valid even when it could not be stored
+	store( fileName, initial, pp, output );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool output_cache<P>::store( string_view_t fileName, const macros_t &initial,
+                                                       const preprocessor_t &pp, string_view_t output ) LIPP_NOEXCEPT
+{
+	string_t main( fileName );
+	normalize_path( main );
+
+	vector_t<char_t> dependencies;
+	uint64_t mainHash = main_hash( pp, main );
+	uint64_t key = mainHash;
+	uint32_t dependencyCount = 0;
+
+	auto addDependency = [&]( uint32_t kind, string_view_t name, uint64_t hash )
+	{
+		dependency dep = { hash, kind, uint32_t( lipp::size( name ) ) };
+		const uint64_t padding = 0;
+
+		append( dependencies, &dep, sizeof( dep ) );
+		append( dependencies, data( name ), lipp::size( name ) );
+		append( dependencies, &padding, ( 8 - lipp::size( name ) % 8 ) % 8 );
+		++dependencyCount;
+
+		key = mix( mix( mix( key, kind ), hash ), hash_content( name ) );
+	};
+
+	const auto &files = pp.included_files();
+	for ( size_t i = 0, S = lipp::size( files ); i < S; ++i )
+	{
+		uint64_t hash = 0;
+		if ( !hash_file( files[i], hash ) )
+			return false;
+
+		addDependency( dependency_file, files[i], hash );
+	}
+
+	const auto &queried = pp.queried_macros();
+	for ( size_t i = 0, S = lipp::size( queried ); i < S; ++i )
+		addDependency( dependency_macro, queried[i], macro_hash( initial, queried[i] ) );
+
+#if defined(_WIN32)
+	_mkdir( string_t( _directory ).c_str() );
+#else
+	mkdir( string_t( _directory ).c_str(), 0777 );
+#endif
+
+	if ( !replace_file( output_path( key ), key, data( output ), lipp::size( output ) ) )
+		return false;
+
+	// Index is rebuilt with the new entry replacing any older one with the same key. Other stores wait
+	// for the lock, so they read the index this one writes and keep its entries.
+	string_t indexPath = file_path( "index" );
+	int lock = lock_file( file_path( "index.lock" ) );
+	if ( lock < 0 )
+		return false;
+
+	string_t old;
+	index_header header = { };
+
+	if ( read_file( indexPath, old ) && lipp::size( old ) >= sizeof( header ) )
+		memcpy( &header, data( old ), sizeof( header ) );
+
+	if ( header.magic != index_magic || header.version != index_version || header.size != lipp::size( old ) ||
+	     header.entryCount > ( lipp::size( old ) - sizeof( header ) ) / sizeof( index_entry ) )
+		header.entryCount = 0;
+
+	vector_t<index_entry> entries;
+	vector_t<char_t> blobs;
+
+	for ( size_t i = 0; i < header.entryCount; ++i )
+	{
+		index_entry e = { };
+		memcpy( &e, data( old ) + sizeof( header ) + i * sizeof( index_entry ), sizeof( e ) );
+
+		size_t end = e.dependencies;
+		for ( size_t d = 0; d < e.dependencyCount && end + sizeof( dependency ) <= lipp::size( old ); ++d )
+		{
+			dependency dep = { };
+			memcpy( &dep, data( old ) + end, sizeof( dep ) );
+			end += sizeof( dep ) + ( ( dep.nameLength + 7 ) & ~size_t( 7 ) );
+		}
+
+		if ( e.key == key || end > lipp::size( old ) )
+			continue;
+
+		// Offsets are relative to the blobs until the entry count is known
+		append( blobs, data( old ) + e.dependencies, end - e.dependencies );
+		e.dependencies = uint32_t( lipp::size( blobs ) - ( end - e.dependencies ) );
+		push_back( entries, e );
+	}
+
+	push_back( entries, { mainHash, key, uint32_t( lipp::size( blobs ) ), dependencyCount } );
+	append( blobs, data( dependencies ), lipp::size( dependencies ) );
+
+	size_t blobsOffset = sizeof( header ) + lipp::size( entries ) * sizeof( index_entry );
+	header = { index_magic, index_version, uint32_t( lipp::size( entries ) ), uint32_t( blobsOffset + lipp::size( blobs ) ) };
+
+	vector_t<char_t> index;
+	append( index, &header, sizeof( header ) );
+
+	for ( size_t i = 0, S = lipp::size( entries ); i < S; ++i )
+	{
+		entries[i].dependencies += uint32_t( blobsOffset );
+		append( index, &entries[i], sizeof( index_entry ) );
+	}
+
+	append( index, data( blobs ), lipp::size( blobs ) );
+
+	bool ok = replace_file( indexPath, key, data( index ), lipp::size( index ) );
+	unlock_file( lock );
+	return ok;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline uint64_t output_cache<P>::macro_hash( const macros_t &macros, string_view_t name ) LIPP_NOEXCEPT
+{
+	const auto *m = macros.find( name );
+	if ( !m )
+		return 0;
+
+	// Parameter names are not in the value, only in the tokens referring to them
+	uint64_t hash = mix( mix( hash_content( macros.value( *m ) ), m->paramCount ), m->flags );
+
+	for ( size_t i = 0; i < m->tokenCount; ++i )
+	{
+		const auto &t = macros.token( m->tokens + i );
+		hash = mix( mix( mix( hash, uint64_t( t.type ) ), t.flags ), t.param );
+	}
+
+	return hash | 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline uint64_t output_cache<P>::main_hash( const preprocessor_t &pp, string_view_t main ) LIPP_NOEXCEPT
+{
+	uint64_t hash = mix( mix( hash_content( main ), uint64_t( pp.get_output_mode() ) ), pp.line_directives() );
+
+	// A header earlier in a changed search path replaces the one that was included
+	for ( int isSystem = 0; isSystem < 2; ++isSystem )
+	{
+		const auto &directories = pp.include_directories( isSystem != 0 );
+		hash = mix( hash, lipp::size( directories ) );
+
+		for ( size_t i = 0, S = lipp::size( directories ); i < S; ++i )
+			hash = mix( hash, hash_content( string_view_t( directories[i] ) ) );
+	}
+
+	return hash;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool output_cache<P>::hash_file( string_view_t path, uint64_t &hash ) LIPP_NOEXCEPT
+{
+	string_t p( path );
+	size_t length = 0;
+
+	if ( const void *mapping = map_file( p.c_str(), length ); mapping )
+	{
+		hash = hash_content( string_view_t( static_cast<const char_t *>( mapping ), length ) );
+		unmap_file( mapping, length );
+		return true;
+	}
+
+	string_t content;
+	if ( !read_file( path, content ) )
+		return false;
+
+	hash = hash_content( content );
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool output_cache<P>::read_file( string_view_t path, string_t &output ) LIPP_NOEXCEPT
+{
+	FILE *file = fopen( string_t( path ).c_str(), "rb" );
+	if ( !file )
+		return false;
+
+	long length = fseek( file, 0, SEEK_END ) == 0 ? ftell( file ) : -1;
+	bool ok = length >= 0 && fseek( file, 0, SEEK_SET ) == 0;
+
+	if ( ok )
+	{
+		output = string_t();
+		resize( output, size_t( length ) );
+		ok = !length || fread( &output[0], 1, size_t( length ), file ) == size_t( length );
+	}
+
+	fclose( file );
+	return ok;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool output_cache<P>::write_file( string_view_t path, const char_t *content, size_t length ) LIPP_NOEXCEPT
+{
+	FILE *file = fopen( string_t( path ).c_str(), "wb" );
+	if ( !file )
+		return false;
+
+	bool ok = !length || fwrite( content, 1, length, file ) == length;
+	return fclose( file ) == 0 && ok;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline bool output_cache<P>::replace_file( const string_t &path, uint64_t key, const char_t *content, size_t length ) LIPP_NOEXCEPT
+{
+	// Process id and key, a process has one store of a key at a time
+	char buff[64] = { };
+#if defined(_WIN32)
+	LIPP_SPRINTF( buff, ".%d.%016llx.tmp", _getpid(), static_cast<unsigned long long>( key ) );
+#else
+	LIPP_SPRINTF( buff, ".%d.%016llx.tmp", int( getpid() ), static_cast<unsigned long long>( key ) );
+#endif
+
+	string_t temporary = path;
+	temporary += buff;
+
+	if ( !write_file( temporary, content, length ) )
+	{
+		remove( temporary.c_str() );
+		return false;
+	}
+
+#if defined(_WIN32)
+	remove( path.c_str() );
+#endif
+
+	if ( rename( temporary.c_str(), path.c_str() ) == 0 )
+		return true;
+
+	remove( temporary.c_str() );
+	return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline int output_cache<P>::lock_file( const string_t &path ) LIPP_NOEXCEPT
+{
+	// Locks go away with the process, a crashed writer does not leave the cache locked
+#if defined(_WIN32)
+	int fd = _open( path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE );
+	if ( fd < 0 )
+		return -1;
+
+	// `_LK_LOCK` gives up after ten seconds of trying, waiting longer is up to the loop
+	while ( _locking( fd, _LK_LOCK, 1 ) != 0 )
+	{
+		if ( errno != EDEADLOCK )
+		{
+			_close( fd );
+			return -1;
+		}
+	}
+#else
+	int fd = open( path.c_str(), O_RDWR | O_CREAT, 0666 );
+	if ( fd < 0 )
+		return -1;
+
+	while ( flock( fd, LOCK_EX ) != 0 )
+	{
+		if ( errno != EINTR )
+		{
+			close( fd );
+			return -1;
+		}
+	}
+#endif
+
+	return fd;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline void output_cache<P>::unlock_file( int fd ) LIPP_NOEXCEPT
+{
+#if defined(_WIN32)
+	_lseek( fd, 0, SEEK_SET );
+	_locking( fd, _LK_UNLCK, 1 );
+	_close( fd );
+#else
+	close( fd );
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline void output_cache<P>::append( vector_t<char_t> &buffer, const void *bytes, size_t length ) LIPP_NOEXCEPT
+{
+	size_t offset = lipp::size( buffer );
+	resize( buffer, offset + length );
+
+	if ( length )
+		memcpy( &buffer[offset], bytes, length );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline typename output_cache<P>::string_t output_cache<P>::file_path( string_view_t name ) const LIPP_NOEXCEPT
+{
+	string_t path = _directory;
+	path += "/";
+	path += name;
+	return path;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+template <class P> inline typename output_cache<P>::string_t output_cache<P>::output_path( uint64_t key ) const LIPP_NOEXCEPT
+{
+	char buff[32] = { };
+	LIPP_SPRINTF( buff, "%016llx.out", static_cast<unsigned long long>( key ) );
+	return file_path( buff );
+}
+
+} // namespace lipp
@@ -20,23 +20,48 @@ workspace "lipp"
 		optimize "Speed"
 		inlining "Auto"
 
-	filter { "language:not C#" }
+	filter { "system:windows", "language:not C#" }
 		defines { "_CRT_SECURE_NO_WARNINGS" }
 		characterset ("MBCS")
 		buildoptions { "/std:c++latest" }
 
+	filter { "system:windows" }
+		defines { "WIN32", "_AMD64_" }
+
+	-- gcc and clang, for example "premake5 gmake2" on Linux
+	filter { "system:not windows" }
+		cppdialect "C++17"
+		warnings "Extra"
+		links { "pthread" }
+
 	filter { }
 		targetdir ".bin/%{cfg.longname}/"
-		defines { "WIN32", "_AMD64_" }
 		--exceptionhandling "Off"
 		rtti "Off"
 		vectorextensions "AVX2"
 
 -------------------------------------------------------------------------------
 
+-- Header only, the library target compiles every template member once to catch errors early
+project "lipp"
+	language "C++"
+	kind "StaticLib"
+	files { "src/**.cpp", "include/**.hpp", "include/**.inl" }
+	includedirs { "include" }
+
 project "test"
 	language "C++"
 	kind "ConsoleApp"
 	files { "test/**.cpp", "test/**.hpp", "include/**.hpp", "include/**.inl", "**.natvis" }
 	includedirs { "include" }
 	debugdir "test"
+
+-- Throughput on generated corpora, prints JSON: "bench [--scale N] [--iterations N] [--dir path] [--corpus name]"
+project "bench"
+	language "C++"
+	kind "ConsoleApp"
+	files { "bench/**.cpp", "include/**.hpp", "include/**.inl" }
+	includedirs { "include" }
+	debugdir "bench"
+	filter { "system:windows" }
+		links { "psapi" }
@@ -0,0 +1,35 @@
+// The library is header only. This translation unit instantiates every template with the standard
+// library types, so that the build compiles all of their members, not only those a program calls.
+
+#include <lipp/lipp.hpp>
+#include <lipp/batch.hpp>
+#include <lipp/incremental.hpp>
+#include <lipp/multi_config.hpp>
+#include <lipp/output_cache.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lipp {
+
+using std_traits = preprocessor_traits<char, std::string, std::string_view, std::vector>;
+
+template class text_arena<char, std::vector>;
+template class macro_table<std_traits>;
+template class name_set<std_traits>;
+template class include_cache<std_traits>;
+template class basic_preprocessor<std_traits>;
+template class basic_preprocessor<std_traits, preprocessor<std_traits>>;
+template class preprocessor<std_traits>;
+template class file_writer<std_traits>;
+template class batch_preprocessor<preprocessor<std_traits>>;
+template class incremental_preprocessor<preprocessor<std_traits>>;
+template class multi_config_preprocessor<preprocessor<std_traits>>;
+template class output_cache<preprocessor<std_traits>>;
+
+#if defined(LIPP_STATISTICS)
+template class preprocessor_statistics<std_traits>;
+#endif
+
+} // namespace lipp
@@ -1,14 +1,532 @@
 #include <lipp/lipp.hpp>
+#include <lipp/batch.hpp>
+#include <lipp/incremental.hpp>
+#include <lipp/multi_config.hpp>
+#include <lipp/output_cache.hpp>
+
+#include <filesystem>
+
+using traits = lipp::preprocessor_traits<char, std::string, std::string_view, std::vector>;
+
+static int failures = 0;
 
 //---------------------------------------------------------------------------------------------------------------------
-int main()
+static std::string read_text( const char *fileName )
+{
+	std::string text;
+
+	if ( FILE *file = fopen( fileName, "rb" ); file )
+	{
+		char buffer[4096];
+		for ( size_t length; ( length = fread( buffer, 1, sizeof( buffer ), file ) ) > 0; )
+			text.append( buffer, length );
+
+		fclose( file );
+	}
+
+	return text;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+static void check( const char *name, bool passed, const std::string &output, const std::string &expected )
+{
+	if ( passed && output == expected )
+		return;
+
+	printf( "FAILED %s\n--- output:\n%s\n--- expected:\n%s\n", name, output.c_str(), expected.c_str() );
+	++failures;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Output of `fileName` must match "expected/<fileName>"
+template <class P>
+static void check_file( P &pp, const char *fileName )
 {
-	using traits = lipp::preprocessor_traits<char, std::string, std::string_view, std::vector>;
+	pp.reset();
+	bool included = pp.include_file( fileName );
+	std::string output = pp.read_all();
+
+	check( fileName, included && pp.error() == lipp::error_type::none, output, read_text( ( std::string( "expected/" ) + fileName ).c_str() ) );
+}
 
+//---------------------------------------------------------------------------------------------------------------------
+// Tokens of `text` one per line as the preprocessor lexes them, without expanding macros. Backslashes
+// of line continuations are left out, minified output drops them.
+static std::string lex( const std::string &text )
+{
+	lipp::preprocessor<traits> pp;
+	pp.include_string( text, "lex" );
+
+	std::string tokens;
+	lipp::preprocessor<traits>::token t;
+
+	while ( pp.next_token( t, 0 ) )
+	{
+		if ( t.type != lipp::token_type::directive && t.text != "\\" )
+			tokens += std::string( t.text ) + "\n";
+	}
+
+	return tokens;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Minified outputs of `fileName` must lex to the same tokens as the full one
+template <class P>
+static void check_round_trip( P &pp, const char *fileName )
+{
+	pp.reset();
+	pp.set_line_directives( false );
+	pp.include_file( fileName );
+	std::string full = lex( pp.read_all() );
+	pp.set_line_directives( true );
+
+	for ( auto mode : { lipp::output_mode::minified, lipp::output_mode::minified_lines } )
+	{
+		pp.reset();
+		pp.set_output_mode( mode );
+		bool included = pp.include_file( fileName );
+		std::string minified = lex( pp.read_all() );
+		pp.set_output_mode( lipp::output_mode::full );
+
+		check( fileName, included && pp.error() == lipp::error_type::none, minified, full );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Include graph of `fileName` as "from -> to : line" lines must match `expected`
+template <class P>
+static void check_include_graph( P &pp, const char *fileName, const std::string &expected )
+{
+	pp.reset();
+	pp.record_dependencies( true );
+	bool included = pp.include_file( fileName ) && pp.read_all( []( std::string_view, std::string_view ) {} );
+	pp.record_dependencies( false );
+
+	std::string output;
+	const auto &files = pp.included_files();
+
+	for ( const auto &e : pp.include_graph() )
+	{
+		if ( e.from != P::no_file )
+			output += files[e.from];
+
+		output += " -> ";
+		output += files[e.to];
+		output += " : " + std::to_string( e.line ) + "\n";
+	}
+
+	check( fileName, included && pp.error() == lipp::error_type::none, output, expected );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Macros it knows better about, expansion, `#if` and `#ifdef` must all see them
+struct find_macro_override : lipp::preprocessor<traits>
+{
+	find_macro_override() { set_find_macro_hook( true ); }
+
+	const char *find_macro( std::string_view name ) const noexcept override
+	{
+		return name == "Q" ? "1" : name == "R" ? "R + 1" : name == "HIDDEN" ? nullptr : lipp::preprocessor<traits>::find_macro( name );
+	}
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Outputs of a batch on several threads sharing one include cache must match runs one after another
+static void check_batch( bool tokenReplay )
+{
+	std::vector<std::string> inputs;
+	for ( int i = 0; i < 8; ++i )
+		for ( const char *fileName : { "test.txt", "macros.txt", "guard_test.txt", "include_test.txt", "disabled_test.txt" } )
+			inputs.push_back( fileName );
+
+	lipp::batch_preprocessor<lipp::preprocessor<traits>> batch( 4 );
+	batch.define( "BATCH", "1" );
+	batch.set_token_replay( tokenReplay );
+
+	std::vector<std::string> outputs;
+	std::vector<lipp::error_type> errors;
+	size_t failed = batch.run( inputs, outputs, errors );
+
+	for ( size_t i = 0; i < inputs.size(); ++i )
+	{
+		lipp::preprocessor<traits> pp;
+		pp.define( "BATCH", "1" );
+		pp.include_file( inputs[i] );
+
+		check( tokenReplay ? "batch with token replay" : "batch", !failed && outputs.size() == inputs.size(), outputs[i], pp.read_all() );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+static void write_text( const std::string &fileName, const std::string &text )
+{
+	if ( FILE *file = fopen( fileName.c_str(), "wb" ); file )
+	{
+		fwrite( text.data(), 1, text.size(), file );
+		fclose( file );
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Stored outputs must be found again only while the files and the macros they looked at are the same
+static void check_output_cache()
+{
+	const std::string dir = "output_cache_test";
+	std::filesystem::remove_all( dir );
+	std::filesystem::create_directories( dir );
+
+	write_text( dir + "/main.txt", "#include \"inc.txt\"\n#if FEATURE\nfeature\n#endif\n" );
+	write_text( dir + "/other.txt", "other\n" );
+	write_text( dir + "/inc.txt", "int a;\n" );
+
+	lipp::output_cache<lipp::preprocessor<traits>> cache( dir + "/cache" );
+
+	auto lookup = [&]( const char *fileName, const char *feature, bool unrelated )
+	{
+		lipp::preprocessor<traits> pp;
+		pp.define( "FEATURE", feature );
+		if ( unrelated )
+			pp.define( "UNRELATED", "2" );
+
+		std::string output;
+		return cache.lookup( pp, dir + "/" + fileName, output ) ? output : std::string( "miss" );
+	};
+
+	auto run = [&]( const char *fileName )
+	{
+		lipp::preprocessor<traits> pp;
+		pp.define( "FEATURE", "1" );
+
+		std::string output;
+		return cache.read_all( pp, dir + "/" + fileName, output ) ? output : std::string( "failed" );
+	};
+
+	std::string output = run( "main.txt" ), other = run( "other.txt" );
+
+	check( "output_cache hit", true, lookup( "main.txt", "1", false ), output );
+	check( "output_cache other entry", true, lookup( "other.txt", "1", false ), other );
+	check( "output_cache unrelated macro", true, lookup( "main.txt", "1", true ), output );
+	check( "output_cache queried macro", true, lookup( "main.txt", "0", false ), "miss" );
+
+	write_text( dir + "/inc.txt", "int b;\n" );
+	check( "output_cache included file", true, lookup( "main.txt", "1", false ), "miss" );
+
+	std::filesystem::remove_all( dir );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Output after each edit must be the one of preprocessing the edited text from scratch
+static void check_incremental()
+{
+	std::string text = "#define ADD(a, b) ((a) + (b))\n";
+	for ( int i = 0; i < 40; ++i )
+		text += "int v" + std::to_string( i ) + " = ADD(" + std::to_string( i ) + ",\n\t" + std::to_string( i * 2 ) + " );\n/* note " + std::to_string( i ) + "\n   more */\n";
+
+	lipp::incremental_preprocessor<lipp::preprocessor<traits>> inc( 64 );
+	inc.define( "BASE", "1" );
+	inc.set_text( text, "edited" );
+
+	auto check_edit = [&]( const char *name, const char *find, size_t skip, size_t length, const char *replacement )
+	{
+		std::string edited = std::string( inc.text() );
+		size_t offset = edited.find( find ) + skip;
+
+		bool ok = inc.edit( offset, length, replacement );
+
+		lipp::preprocessor<traits> pp;
+		pp.define( "BASE", "1" );
+		pp.include_string( edited.replace( offset, length, replacement ), "edited" );
+		std::string expected = pp.read_all();
+
+		check( name, ok && inc.text() == edited && inc.error() == pp.error() && inc.reprocessed() < edited.size(), std::string( inc.output() ), expected );
+	};
+
+	// Second argument of a call split over two lines
+	check_edit( "incremental macro call", "\t20 );", 1, 2, "BASE + 7" );
+
+	// Inside a comment, then one ending the comment early
+	check_edit( "incremental comment", "note 25", 5, 2, "twenty-five" );
+	check_edit( "incremental comment end", "note 30", 0, 4, "*/ int cut; /*" );
+
+	// Lines added in front of checkpoints which are then reused, `#line` numbers behind must follow
+	check_edit( "incremental added lines", "int v10 ", 0, 0, "#define EXTRA 3\nint added = EXTRA;\n\nint more;\n" );
+	check_edit( "incremental removed lines", "int added", 0, 30, "" );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Output of every configuration must be the one of a separate run, configurations which agree on the
+// macros the file asks about share a run and equal outputs are merged
+static void check_multi_config()
+{
+	struct change { const char *name, *value; };
+	const std::vector<std::vector<change>> configs =
+	{
+		{ { "MODE", "1" } },
+		{ { "MODE", "1" }, { "UNUSED", "5" } }, // Same run as the first one
+		{ { "MODE", "2" } },
+		{ { "MODE", "3" } },                    // Run, but the same output as the one above
+		{ { "MODE", nullptr } },                // Undefined, the same output as the first one
+	};
+
+	using multi_t = lipp::multi_config_preprocessor<lipp::preprocessor<traits>>;
+	multi_t multi;
+	multi.define( "COMMON", "common" );
+	multi.define( "MODE", "0" );
+
+	for ( const auto &changes : configs )
+	{
+		size_t config = multi.add_configuration();
+
+		for ( const auto &ch : changes )
+		{
+			if ( ch.value )
+				multi.define( config, ch.name, ch.value );
+			else
+				multi.undef( config, ch.name );
+		}
+	}
+
+	size_t failed = multi.run( "multi_config_test.txt" );
+
+	for ( size_t config = 0; config < configs.size(); ++config )
+	{
+		lipp::preprocessor<traits> pp;
+		pp.define( "COMMON", "common" );
+		pp.define( "MODE", "0" );
+
+		for ( const auto &ch : configs[config] )
+		{
+			if ( ch.value )
+				pp.define( ch.name, ch.value );
+			else
+				pp.undef( ch.name );
+		}
+
+		pp.include_file( "multi_config_test.txt" );
+		std::string expected = pp.read_all();
+
+		size_t output = multi.output_of( config );
+		check( "multi_config output", !failed && multi_t::test( multi.output_configurations( output ), config ), std::string( multi.output( output ) ), expected );
+	}
+
+	check( "multi_config runs", multi.run_count() == 4 && multi.output_count() == 2, "", "" );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Preprocessor continuing from a saved state must give the tokens of one which ran the prelude itself,
+// without those the prelude put out. Conditional blocks cannot stay open across `include_string` calls,
+// so that one runs prelude and rest as one text.
+static void check_state()
+{
+	const std::string prelude =
+		"#define F(a, b) a + b\n"
+		"#define V(fmt, ...) f(fmt, __VA_ARGS__)\n"
+		"#define OBJ 42\n"
+		"#include \"dir/once.txt\"\n"
+		"#if OBJ == 42\n";
+
+	const std::string rest =
+		"F(1, 2) V(\"x\", 3, 4) OBJ G\n"
+		"#include \"dir/once.txt\"\n"
+		"#endif\n"
+		"#if OBJ != 42\n"
+		"skipped\n"
+		"#endif\n";
+
+	const char *stateFile = "state_test.bin";
+
+	auto run = [&]( bool fromState, bool defineAfter )
+	{
+		lipp::preprocessor<traits> pp;
+
+		if ( fromState && !pp.load_state( stateFile ) )
+			return std::string( "load failed" );
+
+		// Copies the mapped macros before changing them
+		if ( defineAfter )
+			pp.define( "G", "F(OBJ, 1)" );
+
+		pp.include_string( fromState ? rest : prelude + rest, "input" );
+		std::string tokens = lex( pp.read_all() );
+		return pp.error() == lipp::error_type::none ? tokens : "error";
+	};
+
+	// The block left open is an error at the end of the prelude, but stays in the state
+	{
+		lipp::preprocessor<traits> pp;
+		pp.include_string( prelude, "prelude" );
+		pp.read_all();
+
+		check( "save_state", pp.save_state( stateFile ), "", "" );
+	}
+
+	std::string once = lex( "( once.txt )\n" );
+
+	check( "load_state", true, once + run( true, false ), run( false, false ) );
+	check( "load_state define", true, once + run( true, true ), run( false, true ) );
+
+	remove( stateFile );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// `"..."` looks next to the including file first, `<...>` only in the directories, user ones before
+// system ones. Paths longer than 256 characters work too.
+static void check_include_directories()
+{
+	const std::string dir = "include_dirs_test";
+	std::string deep = dir + "/long";
+	for ( int i = 0; i < 8; ++i )
+		deep += "/directory_with_quite_a_long_name_" + std::to_string( i );
+
+	std::filesystem::remove_all( dir );
+	std::filesystem::create_directories( dir + "/user" );
+	std::filesystem::create_directories( dir + "/system" );
+	std::filesystem::create_directories( deep );
+
+	write_text( dir + "/main.txt", "#include \"a.h\"\n#include <a.h>\n#include <b.h>\n#include <deep.h>\n#include \"" + deep.substr( dir.size() + 1 ) + "/deep.h\"\n" );
+	write_text( dir + "/a.h", "local_a\n" );
+	write_text( dir + "/user/a.h", "user_a\n" );
+	write_text( dir + "/system/a.h", "system_a\n" );
+	write_text( dir + "/system/b.h", "system_b\n" );
+	write_text( deep + "/deep.h", "deep\n" );
+
+	lipp::preprocessor<traits> pp;
+	pp.set_line_directives( false );
+	pp.add_include_directory( dir + "/system", true );
+	pp.add_include_directory( dir + "/user" );
+	pp.add_include_directory( deep, true );
+
+	bool included = pp.include_file( dir + "/main.txt" );
+	std::string output = lex( pp.read_all() );
+
+	check( "include directories", deep.size() > 256 && included && pp.error() == lipp::error_type::none, output, "local_a\nuser_a\nsystem_b\ndeep\ndeep\n" );
+
+	std::filesystem::remove_all( dir );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Output without `#line` directives, where `find_location` must place every word where the directives
+// of the full output say it comes from. A directive can follow a comment on the same line.
+template <class P>
+static void check_locations( P &pp, const char *fileName )
+{
+	pp.reset();
+	pp.include_file( fileName );
+	std::string full = pp.read_all();
+
+	std::string expected, name;
+	int line = 1;
+
+	for ( size_t i = 0; i < full.size(); )
+	{
+		if ( full.compare( i, 6, "#line " ) == 0 )
+		{
+			size_t quote = full.find( '"', i ), end = full.find( '\n', i );
+			line = atoi( full.c_str() + i + 6 ) - 1;
+			name = full.substr( quote + 1, end - quote - 2 );
+			i = end;
+		}
+		else if ( full[i] == '\n' || full[i] == ' ' || full[i] == '\t' )
+			line += full[i++] == '\n';
+		else
+		{
+			size_t end = std::min( full.find_first_of( " \t\n", i ), full.size() );
+			expected += name + ":" + std::to_string( line ) + " " + full.substr( i, end - i ) + "\n";
+			i = end;
+		}
+	}
+
+	pp.reset();
+	pp.set_line_directives( false );
+	pp.track_locations( true );
+	bool included = pp.include_file( fileName );
+	std::string plain = pp.read_all();
+	pp.track_locations( false );
+	pp.set_line_directives( true );
+
+	std::string output;
+
+	for ( size_t i = plain.find_first_not_of( " \t\n" ); i < plain.size(); i = plain.find_first_not_of( " \t\n", i ) )
+	{
+		size_t end = std::min( plain.find_first_of( " \t\n", i ), plain.size() );
+		uint32_t file = 0;
+
+		output += pp.find_location( plain, i, file, line ) ? std::string( pp.file_names()[file] ) + ":" + std::to_string( line ) : std::string( "?" );
+		output += " " + plain.substr( i, end - i ) + "\n";
+		i = end;
+	}
+
+	check( fileName, included && pp.error() == lipp::error_type::none && plain.find( "#line" ) == std::string::npos, output, expected );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+int main()
+{
 	lipp::preprocessor<traits> pp;
 
 	pp.include_file( "eval.txt" );
 
-	printf( "%s", pp.read_all().c_str() );
-	return 0;
+	{
+		lipp::file_writer<traits> out( stdout );
+		pp.read_all( out );
+	}
+
+	printf( "\n" );
+
+	check_file( pp, "macros.txt" );
+
+	// Again with the files cached by the first run
+	check_file( pp, "guard_test.txt" );
+	check_file( pp, "guard_test.txt" );
+
+	check_file( pp, "disabled_test.txt" );
+	check_file( pp, "expression_test.txt" );
+
+	// Lines of the `#include` directives, the first one follows a comment on the same line
+	check_include_graph( pp, "test.txt",
+		" -> test.txt : 0\n"
+		"test.txt -> include_test.txt : 10\n"
+		"include_test.txt -> dir/another_file.txt : 4\n"
+		"dir/another_file.txt -> dir/foo.txt : 7\n"
+		"test.txt -> dir/another_file.txt : 15\n"
+		"dir/another_file.txt -> dir/foo.txt : 7\n" );
+
+	check_round_trip( pp, "minify_test.txt" );
+	check_round_trip( pp, "macros.txt" );
+	check_round_trip( pp, "test.txt" );
+
+	check_locations( pp, "test.txt" );
+	check_locations( pp, "disabled_test.txt" );
+
+	pp.set_output_mode( lipp::output_mode::minified );
+	check_file( pp, "minify_test.txt" );
+	pp.set_output_mode( lipp::output_mode::full );
+
+	find_macro_override over;
+	check_file( over, "find_macro_test.txt" );
+
+	// Answers of the hook are not written to the table
+	check( "find_macro table", over.macros().find( "HIDDEN" ) && !over.macros().find( "Q" ), "", "" );
+
+	// Parameter names must differ
+	pp.reset();
+	pp.include_string( "#define H(a, a) a\n", "params" );
+	pp.read_all();
+	check( "duplicate parameter", pp.error() == lipp::error_type::syntax_error, "", "" );
+
+	check_batch( false );
+	check_batch( true );
+
+	check_output_cache();
+
+	check_incremental();
+
+	check_multi_config();
+
+	check_state();
+
+	check_include_directories();
+
+	printf( failures ? "%d FAILED\n" : "All tests passed\n", failures );
+	return failures ? 1 : 0;
 }